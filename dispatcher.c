@@ -6,12 +6,30 @@
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "dispatcher.h"
 
 #define DISPATCHER_LOCK() do { pthread_mutex_lock(&g_dispatcher_lock); }while(0)
 #define DISPATCHER_UNLOCK() do { pthread_mutex_unlock(&g_dispatcher_lock); }while(0)
-#define DISPATCHER_WAKEUP() do { pthread_cond_signal(&g_dispatcher_cond); }while(0)
+#define DISPATCHER_WAKEUP() do { pthread_cond_broadcast(&g_dispatcher_cond); }while(0)
 #define DISPATCHER_WAIT()   do { pthread_cond_wait(&g_dispatcher_cond, &g_dispatcher_lock); }while(0)
+#define DISPATCHER_EVENTS (64) /* ready fds taken per epoll wait */
+#define DISPATCHER_MAX_THREADS (64)
+
+/*
+ * Each event loop thread has an epoll of its own and every fd is owned by
+ * a single loop, so the callbacks of a fd never run concurrently while
+ * a slow callback only holds up the fds of its own loop.
+ * The registrations of a loop live in a table indexed by the fd that only the
+ * loop thread touches. Registering posts the change to the loop through a
+ * lock free queue it drains before dispatching, so the dispatch path takes
+ * no lock and allocates nothing once the table has grown to the fds.
+ * The global lock only guards the fd ownership, the timers and the life cycle.
+ */
 struct dispatcher
 {
     int fd;
@@ -19,210 +37,657 @@ struct dispatcher
     void *arg;
     int (*callback)(int fd, void *arg);
 };
-static struct dispatcher *g_dispatcher_fds;
+
+/*
+ * A registration change posted to a loop. No callback deregisters.
+ */
+struct dispatcher_op
+{
+    struct dispatcher_op *next;
+    struct dispatcher dispatcher;
+};
+
+struct dispatcher_loop
+{
+    int epoll;
+    int wakeup; /* eventfd */
+    int num_fds; /* owned, under the lock */
+    struct dispatcher_op *ops; /* posted changes, newest first */
+    struct dispatcher *fds; /* loop thread only */
+    int max_fds;
+    pthread_t thread;
+    unsigned long passes; /* dispatch passes completed */
+    int pass_waiters; /* waiting on the end of a pass */
+    pthread_mutex_t pass_lock;
+    pthread_cond_t pass_cond;
+};
+
+/*
+ * Timers are kept in a min heap on the deadline. A single timerfd in the first
+ * loop is armed to the earliest deadline and fires the expired timers.
+ */
+struct dispatcher_timer
+{
+    unsigned int id;
+    int index; /* position in the heap */
+    uint64_t deadline; /* nsecs on the monotonic clock */
+    uint64_t interval; /* nsecs, 0 for a one shot */
+    void *arg;
+    int (*callback)(void *arg);
+};
+
+static int *g_fd_loops; /* owning loop + 1 by fd */
+static int g_max_fds;
 static int g_num_fds;
-static int g_dispatcher_pipe[2];
+static struct dispatcher_loop *g_dispatcher_loops;
+static int g_num_loops;
+static int g_num_threads = 1;
+static int g_running_threads;
 static int g_dispatcher_running;
+static struct dispatcher_timer **g_timers;
+static int g_num_timers;
+static int g_max_timers;
+static unsigned int g_timer_id;
+static int g_timer_fd = -1;
 static pthread_mutex_t g_dispatcher_lock  = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  g_dispatcher_cond = PTHREAD_COND_INITIALIZER;
 
-static int get_dispatcher(int index, int fd)
+static int dispatcher_wakeup(struct dispatcher_loop *loop)
 {
-    if(index >= 0 && index < g_num_fds && g_dispatcher_fds[index].fd == fd)
-        return index;
+    uint64_t c = 1;
+    return write(loop->wakeup, &c, sizeof(c)) == sizeof(c) ? 0 : -1;
+}
 
-    for(int i = 0; i < g_num_fds; ++i)
+/*
+ * New fds go to the loop with the fewest.
+ */
+static int pick_loop(void)
+{
+    int best = 0;
+    for(int i = 1; i < g_num_loops; ++i)
     {
-        if(g_dispatcher_fds[i].fd == fd)
-            return i;
+        if(g_dispatcher_loops[i].num_fds < g_dispatcher_loops[best].num_fds)
+            best = i;
     }
-    return -1;
+    return best;
 }
 
-int dispatcher_breaker(void)
+static void post_op(struct dispatcher_loop *loop, int fd, int events, void *arg,
+                    int (*cb)(int fd, void *arg))
 {
-    int c = 'w';
-    return write(g_dispatcher_pipe[1], &c, 1) == 1 ? 0 : -1;
+    struct dispatcher_op *op = malloc(sizeof(*op));
+    assert(op != NULL);
+    op->dispatcher.fd = fd;
+    op->dispatcher.events = events;
+    op->dispatcher.arg = arg;
+    op->dispatcher.callback = cb;
+    op->next = __atomic_load_n(&loop->ops, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&loop->ops, &op->next, op, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 }
 
-int dispatcher_register(int fd, int events, void *arg, int (*cb)(int fd, void *arg))
+/*
+ * Apply the posted changes in the order they were made.
+ */
+static void drain_ops(struct dispatcher_loop *loop)
+{
+    struct dispatcher_op *op = __atomic_exchange_n(&loop->ops, NULL, __ATOMIC_ACQUIRE);
+    struct dispatcher_op *ops = NULL;
+    while(op)
+    {
+        struct dispatcher_op *next = op->next;
+        op->next = ops;
+        ops = op;
+        op = next;
+    }
+    while( (op = ops) )
+    {
+        int fd = op->dispatcher.fd;
+        ops = op->next;
+        if(fd >= loop->max_fds)
+        {
+            int max_fds = loop->max_fds ? loop->max_fds : 64;
+            while(max_fds <= fd) max_fds <<= 1;
+            loop->fds = realloc(loop->fds, sizeof(*loop->fds) * max_fds);
+            assert(loop->fds != NULL);
+            memset(loop->fds + loop->max_fds, 0, sizeof(*loop->fds) * (max_fds - loop->max_fds));
+            loop->max_fds = max_fds;
+        }
+        memcpy(&loop->fds[fd], &op->dispatcher, sizeof(op->dispatcher));
+        free(op);
+    }
+}
+
+/*
+ * For a new fd the change is posted ahead of the epoll add so the loop
+ * has it by the time the fd turns ready. Called with the lock held.
+ */
+static int __dispatcher_register(int fd, int events, void *arg, int (*cb)(int fd, void *arg), int loop)
 {
     int err = -1;
-    if(fd < 0 || !cb) goto out;
-    DISPATCHER_LOCK();
-    g_dispatcher_fds = realloc(g_dispatcher_fds, sizeof(*g_dispatcher_fds) * (g_num_fds+1));
-    assert(g_dispatcher_fds != NULL);
-    g_dispatcher_fds[g_num_fds].fd = fd;
-    g_dispatcher_fds[g_num_fds].callback = cb;
-    g_dispatcher_fds[g_num_fds].arg = arg;
+    struct epoll_event event;
+    if(fd >= g_max_fds)
+    {
+        int max_fds = g_max_fds ? g_max_fds : 64;
+        while(max_fds <= fd) max_fds <<= 1;
+        g_fd_loops = realloc(g_fd_loops, sizeof(*g_fd_loops) * max_fds);
+        assert(g_fd_loops != NULL);
+        memset(g_fd_loops + g_max_fds, 0, sizeof(*g_fd_loops) * (max_fds - g_max_fds));
+        g_max_fds = max_fds;
+    }
     if(!events)
         events = POLLIN | POLLRDNORM;
-    g_dispatcher_fds[g_num_fds].events = events;
-    ++g_num_fds;
-    if(fd != g_dispatcher_pipe[0])
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    /*
+     * Registering again updates the events and the callback on the same loop.
+     */
+    if(g_fd_loops[fd])
     {
-        dispatcher_breaker();
+        loop = g_fd_loops[fd] - 1;
+        if(epoll_ctl(g_dispatcher_loops[loop].epoll, EPOLL_CTL_MOD, fd, &event) < 0)
+        {
+            fprintf(stderr, "Unable to register fd [%d] with the dispatcher: [%s]\n", fd, strerror(errno));
+            goto out;
+        }
+        post_op(&g_dispatcher_loops[loop], fd, events, arg, cb);
     }
-    if(g_dispatcher_running)
+    else
     {
-        DISPATCHER_WAKEUP();
+        if(loop < 0)
+            loop = pick_loop();
+        post_op(&g_dispatcher_loops[loop], fd, events, arg, cb);
+        if(epoll_ctl(g_dispatcher_loops[loop].epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            fprintf(stderr, "Unable to register fd [%d] with the dispatcher: [%s]\n", fd, strerror(errno));
+            post_op(&g_dispatcher_loops[loop], fd, 0, NULL, NULL);
+            goto out;
+        }
+        g_fd_loops[fd] = loop + 1;
+        ++g_num_fds;
+        ++g_dispatcher_loops[loop].num_fds;
     }
-    DISPATCHER_UNLOCK();
     err = 0;
     out:
     return err;
 }
 
+int dispatcher_register(int fd, int events, void *arg, int (*cb)(int fd, void *arg))
+{
+    int err = -1;
+    if(fd < 0 || !cb) goto out;
+    DISPATCHER_LOCK();
+    if(g_num_loops > 0)
+        err = __dispatcher_register(fd, events, arg, cb, -1);
+    DISPATCHER_UNLOCK();
+    out:
+    return err;
+}
+
 int dispatcher_deregister(int fd)
 {
     int err = -1;
-    int index;
     DISPATCHER_LOCK();
-    index = get_dispatcher(-1, fd);
-    if(index < 0)
+    if(fd < 0 || fd >= g_max_fds || !g_fd_loops[fd])
     {
         goto out_unlock;
     }
+    struct dispatcher_loop *loop = &g_dispatcher_loops[g_fd_loops[fd] - 1];
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, fd, NULL);
+    post_op(loop, fd, 0, NULL, NULL);
+    --loop->num_fds;
+    g_fd_loops[fd] = 0;
     --g_num_fds;
-    memmove(g_dispatcher_fds + index, g_dispatcher_fds + index + 1, 
-            sizeof(*g_dispatcher_fds) * (g_num_fds - index));
-    dispatcher_breaker();
-    DISPATCHER_WAKEUP();
     err = 0;
     out_unlock:
     DISPATCHER_UNLOCK();
     return err;
 }
 
-static int get_pollfds(int fds, struct pollfd *cur_pollfds)
+/*
+ * Wait for the loop to get past the pass it was in. The loop is woken up to
+ * finish it. From the loop thread itself there is nothing to wait for.
+ */
+static void wait_pass(struct dispatcher_loop *loop, unsigned long passes)
 {
-    if(fds > g_num_fds) return -1;
-    for(int i = 0; i < fds; ++i)
-    {
-        memset(cur_pollfds+i, 0, sizeof(*cur_pollfds));
-        cur_pollfds[i].fd = g_dispatcher_fds[i].fd;
-        cur_pollfds[i].events = g_dispatcher_fds[i].events;
-        cur_pollfds[i].revents = 0;
-    }
-    return 0;
+    if(pthread_equal(loop->thread, pthread_self()))
+        return;
+    pthread_mutex_lock(&loop->pass_lock);
+    __atomic_add_fetch(&loop->pass_waiters, 1, __ATOMIC_SEQ_CST);
+    dispatcher_wakeup(loop);
+    while(__atomic_load_n(&loop->passes, __ATOMIC_SEQ_CST) == passes
+          &&
+          __atomic_load_n(&g_dispatcher_running, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&loop->pass_cond, &loop->pass_lock);
+    __atomic_sub_fetch(&loop->pass_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&loop->pass_lock);
 }
 
-static int dispatcher_invoke(struct pollfd *cur_pollfds, int cur_fds, int max_fds)
+/*
+ * Deregister and wait out a callback of the fd in progress on its loop,
+ * after which the arg it was registered with can be freed.
+ */
+int dispatcher_deregister_wait(int fd)
+{
+    int err = -1;
+    struct dispatcher_loop *loop = NULL;
+    DISPATCHER_LOCK();
+    if(fd >= 0 && fd < g_max_fds && g_fd_loops[fd])
+        loop = &g_dispatcher_loops[g_fd_loops[fd] - 1];
+    DISPATCHER_UNLOCK();
+    if(!loop) goto out;
+    unsigned long passes = __atomic_load_n(&loop->passes, __ATOMIC_SEQ_CST);
+    err = dispatcher_deregister(fd);
+    if(!err)
+        wait_pass(loop, passes);
+    out:
+    return err;
+}
+
+/*
+ * Whether the caller is one of the event loop threads, which can't block
+ * on a callback of their own.
+ */
+int dispatcher_in_thread(void)
+{
+    int found = 0;
+    pthread_t self = pthread_self();
+    DISPATCHER_LOCK();
+    for(int i = 0; g_dispatcher_running && i < g_num_loops && !found; ++i)
+        found = pthread_equal(g_dispatcher_loops[i].thread, self);
+    DISPATCHER_UNLOCK();
+    return found;
+}
+
+/*
+ * Changes posted by the callbacks of this batch are applied before the next
+ * one runs, so a fd deregistered after it was found ready is skipped.
+ */
+static int dispatcher_invoke(struct dispatcher_loop *loop, struct epoll_event *events, int num_events)
 {
     int err = 0;
-    int c = 0;
-    struct dispatcher *dispatcher_list = calloc(max_fds, sizeof(*dispatcher_list));
-    assert(dispatcher_list);
-    for(int i = 0; i < cur_fds && c < max_fds; ++i)
+    for(int i = 0; i < num_events; ++i)
     {
-        int index = get_dispatcher(i, cur_pollfds[i].fd);
-        if(index < 0)
+        int fd = events[i].data.fd;
+        if(fd == loop->wakeup)
         {
-            fprintf(stderr, "Unable to find dispatcher for fd [%d]\n", cur_pollfds[i].fd);
+            uint64_t c;
+            read(fd, &c, sizeof(c));
             continue;
         }
-        struct dispatcher *dispatcher = g_dispatcher_fds + index;
-        if( (dispatcher->events & cur_pollfds[i].revents) )
+        if(__atomic_load_n(&loop->ops, __ATOMIC_RELAXED))
+            drain_ops(loop);
+        if(fd >= loop->max_fds || !loop->fds[fd].callback)
+            continue;
+        struct dispatcher *dispatcher = &loop->fds[fd];
+        if( (dispatcher->events & events[i].events)
+            ||
+            (events[i].events & (EPOLLERR | EPOLLHUP)) )
         {
-            memcpy(&dispatcher_list[c++], dispatcher, sizeof(*dispatcher));
+            err |= dispatcher->callback(fd, dispatcher->arg);
         }
     }
-    DISPATCHER_UNLOCK();
-    for(int i = 0; i < c; ++i)
-    {
-        err |= dispatcher_list[i].callback(dispatcher_list[i].fd, dispatcher_list[i].arg);
-    }
-    free(dispatcher_list);
-    DISPATCHER_LOCK();
     return err;
 }
 
+/*
+ * The pass lock is only taken when a thread waits on the pass to end.
+ */
+static void dispatcher_pass_done(struct dispatcher_loop *loop)
+{
+    __atomic_add_fetch(&loop->passes, 1, __ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&loop->pass_waiters, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&loop->pass_lock);
+    pthread_cond_broadcast(&loop->pass_cond);
+    pthread_mutex_unlock(&loop->pass_lock);
+}
+
 static void *dispatcher_thread(void *arg)
 {
-    struct pollfd *cur_pollfds = NULL;
-    int cur_fds = 0;
-    int cur_max_fds = 0;
-    DISPATCHER_LOCK();
-    while(g_dispatcher_running)
+    struct dispatcher_loop *loop = arg;
+    struct epoll_event events[DISPATCHER_EVENTS];
+    while(__atomic_load_n(&g_dispatcher_running, __ATOMIC_ACQUIRE))
     {
-        while(!g_num_fds && g_dispatcher_running)
-        {
-            DISPATCHER_WAIT();
-        }
-        if(!g_dispatcher_running) break;
-        if(cur_max_fds < g_num_fds)
-        {
-            cur_max_fds = g_num_fds;
-            cur_pollfds = realloc(cur_pollfds, sizeof(*cur_pollfds) * cur_max_fds);
-            assert(cur_pollfds);
-        }
-        cur_fds = g_num_fds;
-        if(get_pollfds(cur_fds, cur_pollfds) < 0)
-        {
-            break;
-        }
-        DISPATCHER_UNLOCK();
-        int num_fds;
-        retry:
-        num_fds = poll(cur_pollfds, cur_fds, -1);
-        if(num_fds < 0)
+        int num_events = epoll_wait(loop->epoll, events, DISPATCHER_EVENTS, -1);
+        if(num_events < 0)
         {
             if(errno == EINTR)
-                goto retry;
-            fprintf(stderr, "Dispatcher poll error [%s]\n", strerror(errno));
-            DISPATCHER_LOCK();
-            g_dispatcher_running = 0;
+                continue;
+            fprintf(stderr, "Dispatcher epoll error [%s]\n", strerror(errno));
             break;
         }
-        DISPATCHER_LOCK();
-        if(num_fds > 0)
+        if(num_events > 0)
         {
-            dispatcher_invoke(cur_pollfds, cur_fds, num_fds);
+            dispatcher_invoke(loop, events, num_events);
         }
+        dispatcher_pass_done(loop);
     }
+    dispatcher_pass_done(loop);
+    DISPATCHER_LOCK();
+    --g_running_threads;
     DISPATCHER_WAKEUP();
     DISPATCHER_UNLOCK();
-    if(cur_pollfds)
-        free(cur_pollfds);
     return NULL;
 }
 
-static int breaker_callback(int fd, void *arg)
+static uint64_t timer_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timer_swap(int a, int b)
 {
-    int dummy;
-    read(fd, &dummy, 1);
+    struct dispatcher_timer *t = g_timers[a];
+    g_timers[a] = g_timers[b];
+    g_timers[b] = t;
+    g_timers[a]->index = a;
+    g_timers[b]->index = b;
+}
+
+static void timer_sift_up(int i)
+{
+    while(i > 0)
+    {
+        int parent = (i - 1) >> 1;
+        if(g_timers[parent]->deadline <= g_timers[i]->deadline)
+            break;
+        timer_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void timer_sift_down(int i)
+{
+    for(;;)
+    {
+        int least = i, child = 2*i + 1;
+        if(child < g_num_timers && g_timers[child]->deadline < g_timers[least]->deadline)
+            least = child;
+        if(++child < g_num_timers && g_timers[child]->deadline < g_timers[least]->deadline)
+            least = child;
+        if(least == i) break;
+        timer_swap(i, least);
+        i = least;
+    }
+}
+
+static void timer_remove(struct dispatcher_timer *timer)
+{
+    int i = timer->index;
+    if(i != --g_num_timers)
+    {
+        timer_swap(i, g_num_timers);
+        timer_sift_down(i);
+        timer_sift_up(i);
+    }
+}
+
+/*
+ * Arm the timerfd to the earliest deadline or disarm it with no timers left.
+ */
+static void timer_rearm(void)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if(g_num_timers > 0)
+    {
+        uint64_t deadline = g_timers[0]->deadline;
+        its.it_value.tv_sec = deadline / 1000000000ULL;
+        its.it_value.tv_nsec = deadline % 1000000000ULL;
+        if(!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Expired timers run unlocked on the first loop like the fd callbacks.
+ * A periodic timer is rescheduled before it runs so it can be cancelled
+ * from its own callback. Past the batch the rearmed timerfd fires again.
+ */
+static int timer_callback(int fd, void *arg)
+{
+    uint64_t expirations;
+    struct dispatcher_timer fired[DISPATCHER_EVENTS];
+    int c = 0;
+    read(fd, &expirations, sizeof(expirations));
+    DISPATCHER_LOCK();
+    uint64_t now = timer_clock();
+    while(g_num_timers > 0 && c < DISPATCHER_EVENTS && g_timers[0]->deadline <= now)
+    {
+        struct dispatcher_timer *timer = g_timers[0];
+        memcpy(&fired[c++], timer, sizeof(*timer));
+        if(timer->interval)
+        {
+            timer->deadline += timer->interval;
+            if(timer->deadline <= now)
+                timer->deadline = now + timer->interval; /* skip the missed periods */
+            timer_sift_down(0);
+        }
+        else
+        {
+            timer_remove(timer);
+            free(timer);
+        }
+    }
+    timer_rearm();
+    DISPATCHER_UNLOCK();
+    for(int i = 0; i < c; ++i)
+        fired[i].callback(fired[i].arg);
     return 0;
 }
 
-int dispatcher_initialize(void)
+/*
+ * Run the callback after msecs and then every interval msecs if one is given.
+ * The id in p_timer_id cancels the timer.
+ */
+int dispatcher_add_timer(int msecs, int interval, void *arg, int (*cb)(void *arg),
+                         unsigned int *p_timer_id)
 {
     int err = -1;
-    if(pipe(g_dispatcher_pipe) < 0)
+    if(msecs < 0 || interval < 0 || !cb) goto out;
+    struct dispatcher_timer *timer = calloc(1, sizeof(*timer));
+    assert(timer != NULL);
+    timer->deadline = timer_clock() + msecs * 1000000ULL;
+    timer->interval = interval * 1000000ULL;
+    timer->arg = arg;
+    timer->callback = cb;
+    DISPATCHER_LOCK();
+    if(g_timer_fd < 0)
     {
-        fprintf(stderr, "Error creating dispatcher breaker pipe: [%s]\n", strerror(errno));
+        DISPATCHER_UNLOCK();
+        free(timer);
         goto out;
     }
-    err = dispatcher_register(g_dispatcher_pipe[0], POLLIN|POLLRDNORM, NULL, breaker_callback);
-    if(err < 0)
+    if(g_num_timers == g_max_timers)
+    {
+        g_max_timers = g_max_timers ? g_max_timers << 1 : 16;
+        g_timers = realloc(g_timers, sizeof(*g_timers) * g_max_timers);
+        assert(g_timers != NULL);
+    }
+    do timer->id = ++g_timer_id; while(!timer->id);
+    timer->index = g_num_timers;
+    g_timers[g_num_timers++] = timer;
+    timer_sift_up(timer->index);
+    if(!timer->index)
+        timer_rearm();
+    if(p_timer_id) *p_timer_id = timer->id;
+    DISPATCHER_UNLOCK();
+    err = 0;
+    out:
+    return err;
+}
+
+/*
+ * A timer that already fired may still be running its callback.
+ */
+int dispatcher_cancel_timer(unsigned int timer_id)
+{
+    int err = -1;
+    DISPATCHER_LOCK();
+    for(int i = 0; i < g_num_timers; ++i)
+    {
+        struct dispatcher_timer *timer = g_timers[i];
+        if(timer->id != timer_id) continue;
+        timer_remove(timer);
+        free(timer);
+        if(!i)
+            timer_rearm();
+        err = 0;
+        break;
+    }
+    DISPATCHER_UNLOCK();
+    return err;
+}
+
+/*
+ * Cancel and wait out a callback of the timer in progress, after which
+ * its arg can be freed.
+ */
+int dispatcher_cancel_timer_wait(unsigned int timer_id)
+{
+    struct dispatcher_loop *loop = NULL;
+    unsigned long passes = 0;
+    DISPATCHER_LOCK();
+    if(g_num_loops > 0)
+    {
+        loop = &g_dispatcher_loops[0];
+        passes = __atomic_load_n(&loop->passes, __ATOMIC_SEQ_CST);
+    }
+    DISPATCHER_UNLOCK();
+    int err = dispatcher_cancel_timer(timer_id);
+    if(loop)
+        wait_pass(loop, passes);
+    return err;
+}
+
+/*
+ * Number of event loop threads started by the next initialize.
+ */
+int dispatcher_set_threads(int num_threads)
+{
+    int err = -1;
+    if(num_threads <= 0 || num_threads > DISPATCHER_MAX_THREADS)
+        return err;
+    DISPATCHER_LOCK();
+    if(!g_num_loops)
+    {
+        g_num_threads = num_threads;
+        err = 0;
+    }
+    DISPATCHER_UNLOCK();
+    return err;
+}
+
+static void close_loops(void)
+{
+    for(int i = 0; i < g_num_loops; ++i)
+    {
+        struct dispatcher_loop *loop = &g_dispatcher_loops[i];
+        close(loop->epoll);
+        close(loop->wakeup);
+        drain_ops(loop);
+        free(loop->fds);
+        pthread_mutex_destroy(&loop->pass_lock);
+        pthread_cond_destroy(&loop->pass_cond);
+    }
+    free(g_dispatcher_loops);
+    g_dispatcher_loops = NULL;
+    g_num_loops = 0;
+    for(int i = 0; i < g_num_timers; ++i)
+        free(g_timers[i]);
+    free(g_timers);
+    g_timers = NULL;
+    g_num_timers = g_max_timers = 0;
+    if(g_timer_fd >= 0)
+    {
+        close(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    free(g_fd_loops);
+    g_fd_loops = NULL;
+    g_max_fds = 0;
+    g_num_fds = 0;
+}
+
+int dispatcher_initialize(void)
+{
+    int err = -1;
+    DISPATCHER_LOCK();
+    if(g_num_loops)
+        goto out_unlock;
+    g_dispatcher_loops = calloc(g_num_threads, sizeof(*g_dispatcher_loops));
+    assert(g_dispatcher_loops != NULL);
+    for(; g_num_loops < g_num_threads; ++g_num_loops)
+    {
+        struct dispatcher_loop *loop = &g_dispatcher_loops[g_num_loops];
+        struct epoll_event event;
+        loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epoll < 0)
+        {
+            fprintf(stderr, "Error creating dispatcher epoll: [%s]\n", strerror(errno));
+            goto out_close;
+        }
+        loop->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(loop->wakeup < 0)
+        {
+            fprintf(stderr, "Error creating dispatcher wakeup: [%s]\n", strerror(errno));
+            close(loop->epoll);
+            goto out_close;
+        }
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = loop->wakeup;
+        if(epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->wakeup, &event) < 0)
+        {
+            close(loop->epoll);
+            close(loop->wakeup);
+            goto out_close;
+        }
+        pthread_mutex_init(&loop->pass_lock, NULL);
+        pthread_cond_init(&loop->pass_cond, NULL);
+    }
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(g_timer_fd < 0)
+    {
+        fprintf(stderr, "Error creating dispatcher timer: [%s]\n", strerror(errno));
+        goto out_close;
+    }
+    if(__dispatcher_register(g_timer_fd, POLLIN|POLLRDNORM, NULL, timer_callback, 0) < 0)
         goto out_close;
     g_dispatcher_running = 1;
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_t tid;
-    err = pthread_create(&tid, &attr, dispatcher_thread, NULL);
-    if(err < 0)
+    for(int i = 0; i < g_num_loops; ++i)
     {
-        g_dispatcher_running = 0;
-        fprintf(stderr, "Error creating dispatcher thread: [%s]\n", strerror(errno));
-        goto out_close;
+        pthread_t tid;
+        if(pthread_create(&tid, &attr, dispatcher_thread, &g_dispatcher_loops[i]))
+        {
+            fprintf(stderr, "Error creating dispatcher thread: [%s]\n", strerror(errno));
+            __atomic_store_n(&g_dispatcher_running, 0, __ATOMIC_RELEASE);
+            for(int j = 0; j < i; ++j)
+                dispatcher_wakeup(&g_dispatcher_loops[j]);
+            while(g_running_threads > 0)
+                DISPATCHER_WAIT();
+            pthread_attr_destroy(&attr);
+            goto out_close;
+        }
+        g_dispatcher_loops[i].thread = tid;
+        ++g_running_threads;
     }
-    goto out;
+    pthread_attr_destroy(&attr);
+    err = 0;
+    goto out_unlock;
 
     out_close:
-    close(g_dispatcher_pipe[0]);
-    close(g_dispatcher_pipe[1]);
-    out:
+    close_loops();
+    out_unlock:
+    DISPATCHER_UNLOCK();
     return err;
 }
 
@@ -235,22 +700,13 @@ int dispatcher_finalize(void)
         DISPATCHER_UNLOCK();
         goto out;
     }
-    g_dispatcher_running = 0;
-    dispatcher_breaker();
-    DISPATCHER_WAKEUP();
-    DISPATCHER_WAIT();
+    __atomic_store_n(&g_dispatcher_running, 0, __ATOMIC_RELEASE);
+    for(int i = 0; i < g_num_loops; ++i)
+        dispatcher_wakeup(&g_dispatcher_loops[i]);
+    while(g_running_threads > 0)
+        DISPATCHER_WAIT();
+    close_loops();
     DISPATCHER_UNLOCK();
-    if(g_num_fds > 0)
-    {
-        g_num_fds = 0;
-    }
-    if(g_dispatcher_fds)
-    {
-        free(g_dispatcher_fds);
-        g_dispatcher_fds = NULL;
-    }
-    close(g_dispatcher_pipe[0]);
-    close(g_dispatcher_pipe[1]);
     err = 0;
 
     out:
@@ -5,10 +5,17 @@
 extern "C" {
 #endif
 
+extern int dispatcher_set_threads(int num_threads);
 extern int dispatcher_initialize(void);
 extern int dispatcher_finalize(void);
 extern int dispatcher_register(int fd, int events, void *arg, int (*cb)(int fd, void *arg));
 extern int dispatcher_deregister(int fd);
+extern int dispatcher_deregister_wait(int fd);
+extern int dispatcher_in_thread(void);
+extern int dispatcher_add_timer(int msecs, int interval, void *arg, int (*cb)(void *arg),
+                                unsigned int *p_timer_id);
+extern int dispatcher_cancel_timer(unsigned int timer_id);
+extern int dispatcher_cancel_timer_wait(unsigned int timer_id);
 
 #ifdef __cplusplus
 }
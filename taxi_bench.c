@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <time.h>
+#include "taxi.h"
+#include "taxi_pack.h"
+#include "taxi_lz.h"
+
+/*
+ * Throughput of the taxi codec off the network. Each case is run over and over
+ * for the time budget at every list size and reports the wire bytes and taxis
+ * it got through per second and the heap allocations it made per op.
+ */
+#define _BENCH_MSECS (200)
+
+static unsigned long g_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    ++g_allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    ++g_allocs;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    ++g_allocs;
+    return __libc_realloc(ptr, size);
+}
+
+struct bench_ctx
+{
+    struct taxi *taxis;
+    int num_taxis;
+    struct taxi customer;
+    unsigned char *list; /* packed list command */
+    int list_len;
+    unsigned char *ping; /* packed customer and list */
+    int ping_len;
+    unsigned char *v2; /* count, reference point and compact taxis */
+    int v2_len;
+    unsigned char *lz; /* compressed entries of the list */
+    int lz_len;
+    unsigned char *scratch;
+};
+
+struct bench_case
+{
+    const char *name;
+    int (*op)(struct bench_ctx *ctx); /* returns the wire bytes handled */
+};
+
+static int list_pack_op(struct bench_ctx *ctx)
+{
+    int len = 0;
+    unsigned char *buf = taxi_list_pack_with_buf(ctx->taxis, ctx->num_taxis, NULL, &len, 0);
+    free(buf);
+    return len;
+}
+
+static int list_encode_op(struct bench_ctx *ctx)
+{
+    return taxi_list_encode(ctx->taxis, ctx->num_taxis, ctx->scratch);
+}
+
+static int list_unpack_op(struct bench_ctx *ctx)
+{
+    struct taxi *taxis = NULL;
+    int num_taxis = 0;
+    int len = ctx->list_len;
+    int err = taxi_list_unpack(ctx->list, &len, &taxis, &num_taxis);
+    assert(err == 0 && num_taxis == ctx->num_taxis);
+    free(taxis);
+    return ctx->list_len;
+}
+
+static int list_view_op(struct bench_ctx *ctx)
+{
+    struct taxi_view view;
+    struct taxi_view_entry entry;
+    int len = ctx->list_len;
+    int err = taxi_list_view_init(&view, ctx->list, &len);
+    assert(err == 0);
+    while(taxi_view_next(&view, &entry));
+    return ctx->list_len;
+}
+
+static int ping_pack_op(struct bench_ctx *ctx)
+{
+    int len = 0;
+    unsigned char *buf = taxis_ping_pack_with_buf(&ctx->customer, ctx->taxis, ctx->num_taxis,
+                                                  NULL, &len, 0);
+    free(buf);
+    return len;
+}
+
+static int ping_unpack_op(struct bench_ctx *ctx)
+{
+    struct taxi customer;
+    struct taxi *taxis = NULL;
+    int num_taxis = 0;
+    int len = ctx->ping_len;
+    int err = taxis_ping_unpack(ctx->ping, &len, &customer, &taxis, &num_taxis);
+    assert(err == 0 && num_taxis == ctx->num_taxis);
+    free(taxis);
+    return ctx->ping_len;
+}
+
+static int v2_encode(struct taxi *taxis, int num_taxis, unsigned char *buf)
+{
+    unsigned char *s = buf;
+    int ref_latitude = taxi_v2_coord(taxis[0].latitude);
+    int ref_longitude = taxi_v2_coord(taxis[0].longitude);
+    *(unsigned int*)s = htonl(num_taxis);
+    *(unsigned int*)(s + sizeof(unsigned int)) = htonl(ref_latitude);
+    *(unsigned int*)(s + 2*sizeof(unsigned int)) = htonl(ref_longitude);
+    s += sizeof(unsigned int) + _TAXI_V2_HEADER_LEN;
+    for(int i = 0; i < num_taxis; ++i)
+        s += taxi_v2_pack_entry(&taxis[i], ref_latitude, ref_longitude, s);
+    return s - buf;
+}
+
+static int v2_encode_op(struct bench_ctx *ctx)
+{
+    return v2_encode(ctx->taxis, ctx->num_taxis, ctx->scratch);
+}
+
+static int v2_unpack_op(struct bench_ctx *ctx)
+{
+    struct taxi *taxis = NULL;
+    int num_taxis = 0;
+    int len = ctx->v2_len;
+    int err = taxis_v2_unpack(ctx->v2, &len, &taxis, &num_taxis);
+    assert(err == 0 && num_taxis == ctx->num_taxis);
+    free(taxis);
+    return ctx->v2_len;
+}
+
+static int lz_compress_op(struct bench_ctx *ctx)
+{
+    int len = taxi_lz_compress(ctx->list, ctx->list_len, ctx->scratch, __MAX_PACKET_LEN);
+    assert(len > 0);
+    return ctx->list_len;
+}
+
+static int lz_decompress_op(struct bench_ctx *ctx)
+{
+    int len = taxi_lz_decompress(ctx->lz, ctx->lz_len, ctx->scratch, __MAX_PACKET_LEN);
+    assert(len == ctx->list_len);
+    return ctx->list_len;
+}
+
+static struct bench_case bench_cases[] = {
+    { "list_pack", list_pack_op },
+    { "list_encode", list_encode_op },
+    { "list_unpack", list_unpack_op },
+    { "list_view", list_view_op },
+    { "ping_pack", ping_pack_op },
+    { "ping_unpack", ping_unpack_op },
+    { "v2_encode", v2_encode_op },
+    { "v2_unpack", v2_unpack_op },
+    { "lz_compress", lz_compress_op },
+    { "lz_decompress", lz_decompress_op },
+};
+
+static uint64_t bench_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Taxis spread over the bay area with ids and addresses like the real ones.
+ */
+static void bench_setup(struct bench_ctx *ctx, int num_taxis)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->taxis = calloc(num_taxis, sizeof(*ctx->taxis));
+    assert(ctx->taxis);
+    ctx->num_taxis = num_taxis;
+    srand(num_taxis);
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        struct taxi *taxi = &ctx->taxis[i];
+        taxi->id_len = snprintf((char*)taxi->id, sizeof(taxi->id), "%012d", 100000000 + rand() % 900000000);
+        taxi->latitude = 37.7 + (rand() % 100000) / 1e6;
+        taxi->longitude = -122.4 - (rand() % 100000) / 1e6;
+        taxi->state = _TAXI_STATE_IDLE;
+        taxi->addr.sin_family = PF_INET;
+        taxi->addr.sin_addr.s_addr = htonl(0x0a000000 | (rand() & 0xffff));
+        taxi->addr.sin_port = htons(20000 + rand() % 1000);
+    }
+    ctx->customer.id_len = snprintf((char*)ctx->customer.id, sizeof(ctx->customer.id), "customer");
+    ctx->customer.latitude = 37.75;
+    ctx->customer.longitude = -122.45;
+    ctx->scratch = malloc(2 * __MAX_PACKET_LEN);
+    assert(ctx->scratch);
+    ctx->list = taxi_list_pack_with_buf(ctx->taxis, num_taxis, NULL, &ctx->list_len, 0);
+    ctx->ping = taxis_ping_pack_with_buf(&ctx->customer, ctx->taxis, num_taxis, NULL, &ctx->ping_len, 0);
+    ctx->v2 = malloc(sizeof(unsigned int) + _TAXI_V2_HEADER_LEN + num_taxis * _TAXI_V2_MAX_ENTRY_LEN);
+    assert(ctx->v2);
+    ctx->v2_len = v2_encode(ctx->taxis, num_taxis, ctx->v2);
+    ctx->lz = malloc(__MAX_PACKET_LEN);
+    assert(ctx->lz);
+    ctx->lz_len = taxi_lz_compress(ctx->list, ctx->list_len, ctx->lz, __MAX_PACKET_LEN);
+    assert(ctx->lz_len > 0);
+}
+
+static void bench_teardown(struct bench_ctx *ctx)
+{
+    free(ctx->taxis);
+    free(ctx->list);
+    free(ctx->ping);
+    free(ctx->v2);
+    free(ctx->lz);
+    free(ctx->scratch);
+}
+
+static void bench_run(struct bench_case *bench, struct bench_ctx *ctx, int msecs)
+{
+    uint64_t budget = msecs * 1000000ULL;
+    uint64_t ops = 0, bytes = 0;
+    bench->op(ctx); /* warm up */
+    unsigned long allocs = g_allocs;
+    uint64_t start = bench_clock(), elapsed;
+    do
+    {
+        for(int i = 0; i < 64; ++i)
+            bytes += bench->op(ctx);
+        ops += 64;
+        elapsed = bench_clock() - start;
+    } while(elapsed < budget);
+    allocs = g_allocs - allocs;
+    double secs = elapsed / 1e9;
+    printf("%-14s %6d taxis %10.1f MB/s %14.0f taxis/s %10.0f ns/op %6.2f allocs/op\n",
+           bench->name, ctx->num_taxis, bytes / secs / 1e6, ops * ctx->num_taxis / secs,
+           elapsed / (double)ops, allocs / (double)ops);
+}
+
+static char *prog;
+
+static void usage(void)
+{
+    fprintf(stderr, "%s [ -t | msecs per case ] [ -b | only the case ] [ -h | this help ]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static int sizes[] = { 1, 16, 128, 512 };
+    int msecs = _BENCH_MSECS;
+    const char *only = NULL;
+    int c;
+    char *s;
+    prog = argv[0];
+    if( (s = strrchr(prog, '/') ) )
+        prog = s+1;
+    opterr = 0;
+    while( (c = getopt(argc, argv, "t:b:h") ) != EOF )
+    {
+        switch(c)
+        {
+        case 't':
+            msecs = atoi(optarg);
+            break;
+
+        case 'b':
+            only = optarg;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            usage();
+        }
+    }
+    if(msecs <= 0) usage();
+    for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+    {
+        struct bench_ctx ctx;
+        bench_setup(&ctx, sizes[i]);
+        for(int j = 0; j < sizeof(bench_cases)/sizeof(bench_cases[0]); ++j)
+        {
+            if(only && strcmp(only, bench_cases[j].name)) continue;
+            bench_run(&bench_cases[j], &ctx, msecs);
+        }
+        bench_teardown(&ctx);
+    }
+    return 0;
+}
@@ -2,25 +2,159 @@
 #include "taxi_utils.h"
 #include "taxi_pack.h"
 #include "taxi_customer.h"
+#include "taxi_lz.h"
 #include "dispatcher.h"
 #include <poll.h>
+#include <math.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define _TAXI_LIST_TIMEOUT (2000) /* 1 second response timeout from the server*/
+#define _TAXI_FRAG_TIMEOUT (250) /* re-request missing fragments after this */
+#define _TAXI_WAIT_TIMEOUT (2 * _TAXI_LIST_TIMEOUT) /* bounds a blocking call should the timers stall */
+#define _CLIENT_RECV_BATCH (16) /* datagrams taken per receive off the client socket */
+#define _CLIENT_STREAM_BUF_LEN (2 * (sizeof(unsigned int) + __MAX_PACKET_LEN))
 
-static struct sockaddr_in client_addr;
-static socklen_t client_addrlen = sizeof(client_addr);
-static taxi_hook_t g_taxi_hook;
+/*
+ * Region subscriptions of a context. Deltas arrive on its client socket.
+ */
+#define _TAXI_MAX_REGIONS (16)
+struct taxi_region
+{
+    unsigned int sub_id; /* 0 for a free entry */
+    struct taxi_client_ctx *ctx;
+    double latitude_min;
+    double longitude_min;
+    double latitude_max;
+    double longitude_max;
+    int lease;
+    unsigned int next_seq;
+    unsigned int timer_id; /* renews the lease */
+    taxi_region_hook_t hook;
+};
+
+/*
+ * A client context is a socket of its own with the customers and taxis matched
+ * over it and the regions subscribed to. The contexts of a process share
+ * the dispatcher, the requests pending on the server and the fetch cache and
+ * update suppression settings.
+ */
+struct taxi_client_ctx
+{
+    int fd;
+    struct sockaddr_in client_addr;
+    struct sockaddr_in server_addr;
+    int initialized;
+    taxi_hook_t hook;
+    unsigned int fetch_flags; /* command word flags of fetch requests */
+    int stream_fd; /* optional persistent stream to the server */
+    pthread_mutex_t stream_lock; /* serializes the frames sent */
+    unsigned char *stream_buf; /* reply frames read in by the dispatcher */
+    int stream_len;
+    struct taxi_customer_map customers;
+    struct taxi_region regions[_TAXI_MAX_REGIONS];
+    pthread_mutex_t region_lock;
+    int closing; /* destroy called */
+};
+
+/*
+ * The context behind the calls without one.
+ */
+static struct taxi_client_ctx g_client_ctx = {
+    .stream_fd = -1,
+    .stream_lock = PTHREAD_MUTEX_INITIALIZER,
+    .region_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_mutex_t g_client_ctx_lock = PTHREAD_MUTEX_INITIALIZER; /* sets it up once */
+
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_dispatcher_users; /* contexts on the dispatcher */
+
+/*
+ * Each event loop thread receives into buffers of its own.
+ */
+static pthread_key_t client_bufs_key;
+static pthread_once_t client_bufs_once = PTHREAD_ONCE_INIT;
 
-static int send_taxi_ping_reply_cmd(struct taxi *customer, struct taxi *me, int sd)
+static unsigned int g_region_sub_id; /* unique across the contexts */
+
+/*
+ * Stream framing: a 4 byte length followed by the datagram encoding.
+ * Callers hold the stream lock.
+ */
+static int stream_write(struct taxi_client_ctx *ctx, const void *buf, int len, int flags)
+{
+    const unsigned char *s = buf;
+    while(len > 0)
+    {
+        int nbytes = send(ctx->stream_fd, s, len, flags | MSG_NOSIGNAL);
+        if(nbytes < 0)
+        {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        s += nbytes;
+        len -= nbytes;
+    }
+    return 0;
+}
+
+static int stream_send_frame(struct taxi_client_ctx *ctx, unsigned char *buf, int len)
+{
+    unsigned int frame_len = htonl(len);
+    if(stream_write(ctx, &frame_len, sizeof(frame_len), MSG_MORE) < 0)
+        return -1;
+    return stream_write(ctx, buf, len, 0);
+}
+
+/*
+ * Only the dispatcher thread of the stream and the context going away close it.
+ * A sender that fails shuts the stream down and the dispatcher sees it close.
+ */
+static void stream_close(struct taxi_client_ctx *ctx)
 {
+    output("Closing stream to server [%s]\n", inet_ntoa(ctx->server_addr.sin_addr));
+    dispatcher_deregister(ctx->stream_fd);
+    close(ctx->stream_fd);
+    ctx->stream_fd = -1;
+}
+
+/*
+ * Send a request over the stream if there is one, else as a datagram.
+ * The stream lock is held for the frame alone, so requests are pipelined
+ * and their replies matched by request id off the dispatcher.
+ * Returns 1 when the stream carried it.
+ */
+static int send_taxi_cmd(struct taxi_client_ctx *ctx, unsigned char *buf, int len)
+{
+    if(ctx->stream_fd >= 0)
+    {
+        int err = -1;
+        pthread_mutex_lock(&ctx->stream_lock);
+        if(ctx->stream_fd >= 0)
+        {
+            err = stream_send_frame(ctx, buf, len);
+            if(err < 0)
+                shutdown(ctx->stream_fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&ctx->stream_lock);
+        if(!err) return 1;
+    }
+    return sendto(ctx->fd, buf, len, 0, (struct sockaddr*)&ctx->server_addr,
+                  sizeof(ctx->server_addr)) == len ? 0 : -1;
+}
+
+static int send_taxi_ping_reply_cmd(struct taxi_client_ctx *ctx, struct taxi *customer, struct taxi *me)
+{
+    int sd = ctx->fd;
     int err = -1;
-    int len = 1024;
-    unsigned char *buf = calloc(1, len);
+    int len = sizeof(unsigned int) + taxis_ping_packed_size(customer, me, 1);
+    unsigned char *buf = malloc(len);
     assert(buf != NULL);
     *(unsigned int*)buf = htonl(_TAXI_PING_REPLY_CMD);
-    buf = taxis_ping_pack_with_buf(customer, me, 1, &buf, &len, sizeof(unsigned int));
-    assert(buf != NULL);
-    len += sizeof(unsigned int);
+    taxis_ping_encode(customer, me, 1, buf + sizeof(unsigned int));
     /*
      * Tell the customer that the taxi has accepted the request.
      */
@@ -35,7 +169,8 @@ static int send_taxi_ping_reply_cmd(struct taxi *customer, struct taxi *me, int
     }
     if(!(me->state & (_TAXI_STATE_ACTIVE | _TAXI_STATE_PICKUP)))
     {
-        err = update_taxi_state_customer(me->id, me->id_len, customer->id, customer->id_len, _TAXI_STATE_ACTIVE);
+        err = update_taxi_state_customer(&ctx->customers, me->id, me->id_len,
+                                         customer->id, customer->id_len, _TAXI_STATE_ACTIVE);
         if(err < 0)
         {
             output("Error activating state of taxi [%.*s] for customer [%.*s]\n", 
@@ -48,8 +183,8 @@ static int send_taxi_ping_reply_cmd(struct taxi *customer, struct taxi *me, int
      */
     struct taxi *not_mes = NULL;
     int num_notmes = 0;
-    get_taxis_excluding_self_customer(customer->id, customer->id_len, client_addr.sin_port,
-                                      &not_mes, &num_notmes);
+    get_taxis_excluding_self_customer(&ctx->customers, customer->id, customer->id_len,
+                                      ctx->client_addr.sin_port, &not_mes, &num_notmes);
     if(num_notmes > 0)
     {
         /*
@@ -81,15 +216,11 @@ static int send_taxi_ping_reply_cmd(struct taxi *customer, struct taxi *me, int
 
 static int send_taxis_ping_cmd(struct taxi *customer, struct taxi *taxis, int num_taxis, int sd)
 {
-    int len = 1024;
-    unsigned char *buf = calloc(1, len);
+    int cur_packed = sizeof(unsigned int) + taxis_ping_packed_size(customer, taxis, num_taxis);
+    unsigned char *buf = malloc(cur_packed);
     assert(buf != NULL);
-    unsigned char *s = buf;
-    *(unsigned int*)s = htonl(_TAXI_PING_CMD);
-    s += sizeof(unsigned int);
-    buf = taxis_ping_pack_with_buf(customer, taxis, num_taxis, &buf, &len, sizeof(unsigned int));
-    assert(buf != NULL);
-    int cur_packed = len + sizeof(unsigned int);
+    *(unsigned int*)buf = htonl(_TAXI_PING_CMD);
+    taxis_ping_encode(customer, taxis, num_taxis, buf + sizeof(unsigned int));
     for(int i = 0; i < num_taxis; ++i)
     {
         int bytes = sendto(sd, buf, cur_packed, 0, (struct sockaddr*)&taxis[i].addr,
@@ -106,188 +237,1289 @@ static int send_taxis_ping_cmd(struct taxi *customer, struct taxi *taxis, int nu
 }
 
 /*
- * pack a fetch request.
+ * Fragments of a fetch reply being reassembled. The received datagrams are kept
+ * and viewed in place till the reply is complete.
  */
-static int send_taxi_fetch_cmd(double latitude, double longitude,
-                               struct taxi **p_taxis, int *p_num_taxis,
-                               int fd, struct sockaddr_in *dest, socklen_t dest_addrlen)
+struct taxi_frags
 {
-    struct taxi taxi = {0};
-    taxi.latitude = latitude;
-    taxi.longitude = longitude;
-    int len = 1024, err = -1;
-    unsigned char *buf = calloc(1, len);
-    assert(buf);
-    unsigned char *s = buf;
-    *(unsigned int*)s = htonl(_TAXI_FETCH_CMD);
-    s += sizeof(unsigned int);
-    buf = taxi_pack_with_buf(&taxi, &buf, &len, s - buf);
-    assert(buf);
-    len += sizeof(unsigned int);
-    int sd = socket(PF_INET, SOCK_DGRAM, 0);
-    int nbytes = sendto(sd, buf, len, 0, (struct sockaddr*)dest, dest_addrlen);
-    if(nbytes != len)
+    unsigned int req_id;
+    int total;
+    uint64_t received;
+    unsigned char *bufs[_TAXI_MAX_FRAGS];
+    struct taxi_view views[_TAXI_MAX_FRAGS];
+};
+
+#define _TAXI_FRAGS_MASK(total) ( (total) >= 64 ? ~0ULL : (1ULL << (total)) - 1 )
+
+static unsigned int g_fetch_req_id;
+
+static void reset_frags(struct taxi_frags *frags)
+{
+    for(int i = 0; i < _TAXI_MAX_FRAGS; ++i)
     {
-        printf("Unable to send taxi fetch command to server at [%s]\n",
-               inet_ntoa(dest->sin_addr));
-        goto out_free;
+        if(frags->bufs[i]) free(frags->bufs[i]);
+        frags->bufs[i] = NULL;
     }
-    len = __MAX_PACKET_LEN;
-    buf = realloc(buf, len);
-    assert(buf);
-    struct sockaddr_in server_addr;
-    socklen_t addrlen = sizeof(server_addr);
-    struct pollfd pollfds;
-    int status;
-    memset(&pollfds, 0, sizeof(pollfds));
-    pollfds.events = POLLIN | POLLRDNORM;
-    pollfds.fd = sd;
-    status = poll(&pollfds, 1, _TAXI_LIST_TIMEOUT);
-    if(status <= 0 || !(pollfds.revents & (POLLIN | POLLRDNORM)))
-    {
-        printf("Unable to receive response from server at [%s] for TAXI LIST COMMAND\n",
-               inet_ntoa(dest->sin_addr));
-        goto out_free;
+    frags->total = 0;
+    frags->received = 0;
+}
+
+/*
+ * Swap a compressed reply for the reply it was compressed from, header included.
+ * The inflated reply is in a buffer of its own for the caller to free.
+ * Returns -1 for a bad reply.
+ */
+static int inflate_reply(unsigned char **p_buf, int *p_len, int header_len)
+{
+    unsigned char *buf = *p_buf;
+    int len = *p_len;
+    if(len < (int)sizeof(unsigned int) || !(ntohl(*(unsigned int*)buf) & _TAXI_CMD_LZ))
+        return 0;
+    int offset = header_len + sizeof(unsigned int);
+    if(len < offset) return -1;
+    unsigned int raw_len = ntohl(*(unsigned int*)(buf + header_len));
+    if(raw_len > __MAX_PACKET_LEN) return -1;
+    unsigned char *raw = malloc(header_len + raw_len + 1);
+    assert(raw);
+    if(taxi_lz_decompress(buf + offset, len - offset, raw + header_len, raw_len) != (int)raw_len)
+    {
+        free(raw);
+        return -1;
     }
-    memset(&server_addr, 0, sizeof(server_addr));
-    nbytes = recvfrom(sd, buf, len, 0, (struct sockaddr*)&server_addr, &addrlen);
-    if(nbytes < 0)
+    memcpy(raw, buf, header_len);
+    *(unsigned int*)raw = htonl(ntohl(*(unsigned int*)buf) & ~_TAXI_CMD_LZ);
+    *p_buf = raw;
+    *p_len = header_len + raw_len;
+    return 0;
+}
+
+/*
+ * Returns 1 once all the fragments are in, 0 if more are expected and -1 for a bad fragment.
+ * The views of a fragment point into the buffer it came in. The fragment that
+ * completes the reply is viewed in place, to be merged before the buffer is
+ * reused. A fragment held till the rest arrive takes over the receive buffer
+ * if it is handed over in p_owner and is copied otherwise.
+ */
+static int add_frag(struct taxi_frags *frags, unsigned char *buf, int len, unsigned char **p_owner)
+{
+    unsigned int *hdr = (unsigned int*)buf;
+    if(len < _TAXI_LIST_FRAG_HEADER_LEN) return -1;
+    if(_TAXI_CMD(ntohl(hdr[0])) != _TAXI_LIST_FRAG_CMD || ntohl(hdr[1]) != frags->req_id)
+        return -1;
+    int seq = ntohl(hdr[2]);
+    int total = ntohl(hdr[3]);
+    if(total <= 0 || total > _TAXI_MAX_FRAGS || seq < 0 || seq >= total)
+        return -1;
+    /*
+     * A different count means the server recomputed the reply. Start over.
+     */
+    if(frags->total && frags->total != total)
+        reset_frags(frags);
+    frags->total = total;
+    if(!(frags->received & (1ULL << seq)))
     {
-        perror("recvfrom ERROR while trying to fetch taxi locations:");
-        goto out_free;
+        int compact = !!(ntohl(hdr[0]) & _TAXI_CMD_V2);
+        int header_len = _TAXI_LIST_FRAG_HEADER_LEN + sizeof(unsigned int);
+        unsigned char *frag = buf, *own = NULL;
+        if(compact) header_len += _TAXI_V2_HEADER_LEN;
+        if(inflate_reply(&frag, &len, header_len) < 0)
+            return -1;
+        if(frag != buf)
+            own = frag;
+        else if((frags->received | (1ULL << seq)) != _TAXI_FRAGS_MASK(total))
+        {
+            if(p_owner && *p_owner == buf)
+            {
+                /*
+                 * Trim the receive buffer down to the fragment before holding on to it.
+                 */
+                own = realloc(buf, len);
+                assert(own);
+                *p_owner = NULL;
+            }
+            else
+            {
+                own = malloc(len);
+                assert(own);
+                memcpy(own, buf, len);
+            }
+            frag = own;
+        }
+        len -= _TAXI_LIST_FRAG_HEADER_LEN;
+        if(taxis_view_init(&frags->views[seq], frag + _TAXI_LIST_FRAG_HEADER_LEN, &len, compact) < 0)
+        {
+            if(own) free(own);
+            return -1;
+        }
+        frags->bufs[seq] = own;
+        frags->received |= 1ULL << seq;
     }
+    return frags->received == _TAXI_FRAGS_MASK(total) ? 1 : 0;
+}
+
+/*
+ * The taxis of all the fragments go straight into the array handed back.
+ */
+static void merge_frags(struct taxi_frags *frags, struct taxi **p_taxis, int *p_num_taxis)
+{
+    struct taxi_view_entry entry;
     struct taxi *taxis = NULL;
     int num_taxis = 0;
-    err = taxi_list_unpack(buf, &nbytes, &taxis, &num_taxis);
-#if 0
-    printf("Received [%d] taxis near location [%lg:%lg]\n", num_taxis, latitude, longitude);
-    for(int i = 0; i < num_taxis; ++i)
+    for(int i = 0; i < frags->total; ++i)
+        num_taxis += frags->views[i].num_taxis;
+    if(num_taxis > 0)
     {
-        printf("Received Taxi [%.*s] at location [%lg:%lg]\n", 
-               taxis[i].id_len, taxis[i].id, taxis[i].latitude, taxis[i].longitude);
-    }
-#endif
-    if(p_taxis) 
-    {
-        *p_taxis = taxis;
-        taxis = NULL;
+        taxis = calloc(num_taxis, sizeof(*taxis));
+        assert(taxis);
+        num_taxis = 0;
+        for(int i = 0; i < frags->total; ++i)
+        {
+            while(taxi_view_next(&frags->views[i], &entry))
+                taxi_view_entry_copy(&entry, &taxis[num_taxis++]);
+        }
     }
-    if(p_num_taxis)
-        *p_num_taxis = num_taxis;
+    if(p_taxis) *p_taxis = taxis;
+    else if(taxis) free(taxis);
+    if(p_num_taxis) *p_num_taxis = num_taxis;
+}
 
-    if(taxis) free(taxis);
-    
-    out_free:
+static unsigned char *pack_taxi_fetch_request(struct taxi_client_ctx *ctx, unsigned int cmd,
+                                              unsigned int req_id, uint64_t frag_mask,
+                                              struct taxi *taxi, int *p_len)
+{
+    int offset = sizeof(unsigned int) + _TAXI_FETCH_FRAG_HEADER_LEN;
+    int len = offset + taxi_packed_size(taxi);
+    unsigned char *buf = malloc(len);
+    assert(buf);
+    unsigned int *s = (unsigned int*)buf;
+    s[0] = htonl(cmd | __atomic_load_n(&ctx->fetch_flags, __ATOMIC_RELAXED));
+    s[1] = htonl(req_id);
+    s[2] = htonl((unsigned int)(frag_mask >> 32));
+    s[3] = htonl((unsigned int)frag_mask);
+    taxis_encode(taxi, 1, buf + offset);
+    *p_len = len;
+    return buf;
+}
+
+/*
+ * Returns 1 when the request went over the stream.
+ */
+static int send_taxi_fetch_request(struct taxi_client_ctx *ctx, unsigned int cmd, unsigned int req_id,
+                                   uint64_t frag_mask, struct taxi *taxi)
+{
+    int len = 0;
+    unsigned char *buf = pack_taxi_fetch_request(ctx, cmd, req_id, frag_mask, taxi, &len);
+    int err = send_taxi_cmd(ctx, buf, len);
+    if(err < 0)
+        printf("Unable to send taxi fetch command to server at [%s]\n",
+               inet_ntoa(ctx->server_addr.sin_addr));
     free(buf);
-    close(sd);
     return err;
 }
 
-static int send_taxi_location_cmd(struct taxi *taxi, int sd, struct sockaddr_in *dest, socklen_t dest_addrlen)
+/*
+ * Requests in flight on the client socket by request id. The server echoes
+ * the id in the replies, which are matched on the dispatcher thread.
+ * A one shot timer per request reaps it at the deadline and gives it a
+ * chance to retry before then. A request completes outside the table lock
+ * once it is out of the table. The table doubles as the requests outgrow it.
+ */
+#define _TAXI_PENDING_BUCKETS (256) /* to start with */
+
+struct taxi_pending
+{
+    struct taxi_pending *next;
+    struct taxi_client_ctx *ctx;
+    unsigned int req_id;
+    uint64_t deadline;
+    int busy; /* a reply is being taken in outside the table lock */
+    int timer_due; /* the timer fired while busy */
+    /*
+     * Returns 1 once the reply is complete, 0 for more and -1 for a bad reply.
+     * The buffer can be taken over if it is handed over in p_owner.
+     */
+    int (*reply)(struct taxi_pending *pending, unsigned char *buf, int len, unsigned char **p_owner);
+    /* Optional. Returns when to check the request again */
+    uint64_t (*retry)(struct taxi_pending *pending, uint64_t now);
+    void (*complete)(struct taxi_pending *pending, int err);
+};
+
+static struct taxi_pending *pending_buckets[_TAXI_PENDING_BUCKETS];
+static struct taxi_pending **pending_table = pending_buckets;
+static unsigned int pending_mask = _TAXI_PENDING_BUCKETS - 1;
+static unsigned int g_num_pending;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct taxi_pending **find_pending(unsigned int req_id)
+{
+    struct taxi_pending **p = &pending_table[req_id & pending_mask];
+    while(*p && (*p)->req_id != req_id)
+        p = &(*p)->next;
+    return p;
+}
+
+static void unlink_pending(struct taxi_pending **p)
+{
+    *p = (*p)->next;
+    --g_num_pending;
+}
+
+/*
+ * Keep the chains short as the requests in flight grow. Called with the table lock.
+ */
+static void grow_pending(void)
+{
+    unsigned int num_buckets = (pending_mask + 1) << 1;
+    struct taxi_pending **table = calloc(num_buckets, sizeof(*table));
+    assert(table != NULL);
+    for(unsigned int i = 0; i <= pending_mask; ++i)
+    {
+        struct taxi_pending *pending;
+        while( (pending = pending_table[i]) )
+        {
+            pending_table[i] = pending->next;
+            pending->next = table[pending->req_id & (num_buckets - 1)];
+            table[pending->req_id & (num_buckets - 1)] = pending;
+        }
+    }
+    if(pending_table != pending_buckets)
+        free(pending_table);
+    pending_table = table;
+    pending_mask = num_buckets - 1;
+}
+
+/*
+ * A request busy with a reply is left to it.
+ */
+static struct taxi_pending *remove_pending(unsigned int req_id)
+{
+    pthread_mutex_lock(&pending_lock);
+    struct taxi_pending **p = find_pending(req_id);
+    struct taxi_pending *pending = *p;
+    if(pending && pending->busy)
+        pending = NULL;
+    if(pending)
+        unlink_pending(p);
+    pthread_mutex_unlock(&pending_lock);
+    return pending;
+}
+
+/*
+ * A request busy with a reply has the reply run its timer once done.
+ */
+static int pending_timer(void *arg)
+{
+    unsigned int req_id = (unsigned int)(unsigned long)arg;
+    uint64_t now = forward_clock();
+    pthread_mutex_lock(&pending_lock);
+    struct taxi_pending **p = find_pending(req_id);
+    struct taxi_pending *pending = *p;
+    if(!pending || pending->busy)
+    {
+        if(pending) pending->timer_due = 1;
+        pthread_mutex_unlock(&pending_lock);
+        return 0;
+    }
+    if(now >= pending->deadline)
+    {
+        struct in_addr server = pending->ctx->server_addr.sin_addr;
+        unlink_pending(p);
+        pthread_mutex_unlock(&pending_lock);
+        printf("Unable to receive response from server at [%s] for request [%u]\n",
+               inet_ntoa(server), req_id);
+        pending->complete(pending, -1);
+        return 0;
+    }
+    uint64_t next = pending->retry ? pending->retry(pending, now) : pending->deadline;
+    if(next > pending->deadline) next = pending->deadline;
+    pthread_mutex_unlock(&pending_lock);
+    if(dispatcher_add_timer((next - now)/1000 + 1, 0, arg, pending_timer, NULL) < 0)
+    {
+        /*
+         * Nothing would reap the request. It fails now, or once a reply
+         * busy with it is done.
+         */
+        pthread_mutex_lock(&pending_lock);
+        p = find_pending(req_id);
+        pending = *p;
+        if(pending && pending->busy)
+        {
+            pending->deadline = 0;
+            pending->timer_due = 1;
+            pending = NULL;
+        }
+        else if(pending)
+            unlink_pending(p);
+        pthread_mutex_unlock(&pending_lock);
+        if(pending)
+        {
+            printf("Unable to re-arm the timer of request [%u]\n", req_id);
+            pending->complete(pending, -1);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Give the request an id and a deadline and track it till it completes.
+ * Its request goes out after this so no reply is missed.
+ */
+static int add_pending(struct taxi_client_ctx *ctx, struct taxi_pending *pending, int timeout, int check)
+{
+    pending->ctx = ctx;
+    pending->req_id = __atomic_add_fetch(&g_fetch_req_id, 1, __ATOMIC_RELAXED);
+    pending->deadline = forward_clock() + timeout * 1000ULL;
+    pending->busy = 0;
+    pending->timer_due = 0;
+    pthread_mutex_lock(&pending_lock);
+    if(++g_num_pending > pending_mask + 1)
+        grow_pending();
+    struct taxi_pending **p = find_pending(pending->req_id);
+    pending->next = *p;
+    *p = pending;
+    pthread_mutex_unlock(&pending_lock);
+    if(dispatcher_add_timer(check, 0, (void*)(unsigned long)pending->req_id, pending_timer, NULL) < 0)
+    {
+        remove_pending(pending->req_id);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fail the requests of a context going away. Their timers find nothing left.
+ * The sockets of the context are off the dispatcher so none is busy.
+ */
+static void fail_pending(struct taxi_client_ctx *ctx)
+{
+    struct taxi_pending *failed = NULL, *pending;
+    pthread_mutex_lock(&pending_lock);
+    for(unsigned int i = 0; i <= pending_mask; ++i)
+    {
+        struct taxi_pending **p = &pending_table[i];
+        while( (pending = *p) )
+        {
+            if(pending->ctx != ctx)
+            {
+                p = &pending->next;
+                continue;
+            }
+            assert(!pending->busy);
+            unlink_pending(p);
+            pending->next = failed;
+            failed = pending;
+        }
+    }
+    pthread_mutex_unlock(&pending_lock);
+    while( (pending = failed) )
+    {
+        failed = pending->next;
+        pending->complete(pending, -1);
+    }
+}
+
+/*
+ * A reply off a socket of the context. Replies to no pending request of the
+ * context or from anyone but its server are dropped. The request is marked
+ * busy while the reply is taken in, outside the table lock.
+ */
+static int process_reply(struct taxi_client_ctx *ctx, struct sockaddr_in *src, unsigned int req_id,
+                         unsigned char *buf, int len, unsigned char **p_owner)
+{
+    int status = -1, timer_due = 0;
+    pthread_mutex_lock(&pending_lock);
+    struct taxi_pending *pending = *find_pending(req_id);
+    if(!pending || pending->busy || pending->ctx != ctx
+       ||
+       src->sin_addr.s_addr != ctx->server_addr.sin_addr.s_addr
+       ||
+       src->sin_port != ctx->server_addr.sin_port)
+    {
+        pthread_mutex_unlock(&pending_lock);
+        return -1;
+    }
+    pending->busy = 1;
+    pthread_mutex_unlock(&pending_lock);
+    status = pending->reply(pending, buf, len, p_owner);
+    pthread_mutex_lock(&pending_lock);
+    pending->busy = 0;
+    timer_due = pending->timer_due;
+    pending->timer_due = 0;
+    if(status == 1)
+        unlink_pending(find_pending(req_id));
+    pthread_mutex_unlock(&pending_lock);
+    if(status == 1)
+        pending->complete(pending, 0);
+    else if(timer_due)
+        pending_timer((void*)(unsigned long)req_id);
+    return status < 0 ? -1 : 0;
+}
+
+/*
+ * Completion of the blocking calls waiting on a request.
+ */
+struct taxi_wait
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int err;
+};
+
+static void wait_init(struct taxi_wait *wait)
+{
+    pthread_condattr_t attr;
+    memset(wait, 0, sizeof(*wait));
+    pthread_mutex_init(&wait->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wait->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void wait_done(struct taxi_wait *wait, int err)
+{
+    pthread_mutex_lock(&wait->lock);
+    wait->err = err;
+    wait->done = 1;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->lock);
+}
+
+/*
+ * The request completes by its deadline, so the wait only runs out if the
+ * timers stall. The request is then failed here unless it is completing.
+ */
+static int wait_for(struct taxi_wait *wait, unsigned int req_id)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += _TAXI_WAIT_TIMEOUT / 1000;
+    ts.tv_nsec += (_TAXI_WAIT_TIMEOUT % 1000) * 1000000L;
+    if(ts.tv_nsec >= 1000000000L)
+    {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&wait->lock);
+    while(!wait->done)
+    {
+        if(pthread_cond_timedwait(&wait->cond, &wait->lock, &ts) != ETIMEDOUT)
+            continue;
+        pthread_mutex_unlock(&wait->lock);
+        struct taxi_pending *pending = remove_pending(req_id);
+        if(pending)
+            pending->complete(pending, -1);
+        pthread_mutex_lock(&wait->lock);
+        while(!wait->done)
+            pthread_cond_wait(&wait->cond, &wait->lock);
+    }
+    pthread_mutex_unlock(&wait->lock);
+    pthread_mutex_destroy(&wait->lock);
+    pthread_cond_destroy(&wait->cond);
+    return wait->err;
+}
+
+/*
+ * A fetch reply comes back in MTU sized fragments. Fragments that don't show
+ * up within the fragment timeout are re-requested till the list timeout
+ * expires and the hook gets the taxis or the error.
+ */
+struct taxi_fetch
+{
+    struct taxi_pending pending;
+    struct taxi query;
+    uint64_t last_frag; /* last fragment received or requested */
+    int streamed; /* the reply comes whole over the stream */
+    taxi_fetch_hook_t hook;
+    void *arg;
+    struct taxi_frags frags;
+    struct taxi *taxis; /* merged once all the fragments are in */
+    int num_taxis;
+};
+
+/*
+ * The last fragment is viewed in the receive buffer, so the reply is merged
+ * before the buffer goes back to the dispatcher.
+ */
+static int fetch_reply(struct taxi_pending *pending, unsigned char *frag, int len, unsigned char **p_owner)
+{
+    struct taxi_fetch *fetch = (struct taxi_fetch*)pending;
+    int status = add_frag(&fetch->frags, frag, len, p_owner);
+    if(status == 1)
+    {
+        merge_frags(&fetch->frags, &fetch->taxis, &fetch->num_taxis);
+        reset_frags(&fetch->frags);
+    }
+    fetch->last_frag = forward_clock();
+    return status;
+}
+
+static uint64_t fetch_retry(struct taxi_pending *pending, uint64_t now)
+{
+    struct taxi_fetch *fetch = (struct taxi_fetch*)pending;
+    if(fetch->streamed && pending->ctx->stream_fd >= 0)
+        return pending->deadline;
+    if(now - fetch->last_frag >= _TAXI_FRAG_TIMEOUT * 1000ULL)
+    {
+        /*
+         * Ask for the missing fragments. Without any, the whole list is recomputed.
+         */
+        struct taxi_frags *frags = &fetch->frags;
+        uint64_t missing = frags->total ? _TAXI_FRAGS_MASK(frags->total) & ~frags->received : 0;
+        fetch->streamed = send_taxi_fetch_request(pending->ctx, _TAXI_FETCH_FRAG_CMD, pending->req_id,
+                                                  missing, &fetch->query) > 0;
+        fetch->last_frag = now;
+    }
+    return fetch->last_frag + _TAXI_FRAG_TIMEOUT * 1000ULL;
+}
+
+/*
+ * The hook takes over the taxis.
+ */
+static void fetch_complete(struct taxi_pending *pending, int err)
+{
+    struct taxi_fetch *fetch = (struct taxi_fetch*)pending;
+    reset_frags(&fetch->frags);
+    if(err && fetch->taxis)
+    {
+        free(fetch->taxis);
+        fetch->taxis = NULL;
+        fetch->num_taxis = 0;
+    }
+    fetch->hook(err, fetch->taxis, fetch->num_taxis, fetch->arg);
+    free(fetch);
+}
+
+/*
+ * pack a fetch request. The fetch and ping variant carries the customer.
+ */
+static int send_taxi_fetch_async(struct taxi_client_ctx *ctx, unsigned int cmd, struct taxi *taxi,
+                                 taxi_fetch_hook_t hook, void *arg, unsigned int *p_req_id)
+{
+    struct taxi_fetch *fetch = calloc(1, sizeof(*fetch));
+    assert(fetch);
+    memcpy(&fetch->query, taxi, sizeof(fetch->query));
+    fetch->hook = hook;
+    fetch->arg = arg;
+    fetch->last_frag = forward_clock();
+    fetch->streamed = ctx->stream_fd >= 0;
+    fetch->pending.reply = fetch_reply;
+    fetch->pending.retry = fetch_retry;
+    fetch->pending.complete = fetch_complete;
+    if(add_pending(ctx, &fetch->pending, _TAXI_LIST_TIMEOUT, _TAXI_FRAG_TIMEOUT) < 0)
+    {
+        free(fetch);
+        return -1;
+    }
+    unsigned int req_id = fetch->pending.req_id;
+    fetch->frags.req_id = req_id;
+    if(p_req_id) *p_req_id = req_id;
+    if(send_taxi_fetch_request(ctx, cmd, req_id, 0, taxi) < 0
+       &&
+       remove_pending(req_id))
+    {
+        free(fetch);
+        return -1;
+    }
+    return 0;
+}
+
+struct taxi_fetch_wait
+{
+    struct taxi_wait wait;
+    struct taxi *taxis;
+    int num_taxis;
+};
+
+static int fetch_wait_hook(int err, struct taxi *taxis, int num_taxis, void *arg)
+{
+    struct taxi_fetch_wait *fetch_wait = arg;
+    fetch_wait->taxis = taxis;
+    fetch_wait->num_taxis = num_taxis;
+    wait_done(&fetch_wait->wait, err);
+    return 0;
+}
+
+/*
+ * The blocking calls wait on a reply delivered by the dispatcher threads,
+ * so they fail on one rather than deadlock.
+ */
+static int blocking_call_allowed(const char *call)
+{
+    if(!dispatcher_in_thread())
+        return 1;
+    printf("Blocking call [%s] not allowed from a dispatcher thread\n", call);
+    return 0;
+}
+
+/*
+ * The blocking fetch waits on the asynchronous one.
+ */
+static int send_taxi_fetch_cmd(struct taxi_client_ctx *ctx, unsigned int cmd, struct taxi *taxi,
+                               struct taxi **p_taxis, int *p_num_taxis)
 {
     int err = -1;
-    int len = 1024;
-    unsigned char *buf = calloc(1, len);
-    assert(buf);
-    unsigned char *s = buf;
-    *(unsigned int*)s = htonl(_TAXI_LOCATION_CMD);
-    s += sizeof(unsigned int);
-    buf = taxi_pack_with_buf(taxi, &buf, &len, s - buf);
-    assert(buf);
-    len += sizeof(unsigned int);
-    int nbytes = sendto(sd, buf, len, 0, (struct sockaddr*)dest, dest_addrlen);
-    if(nbytes  != len)
+    unsigned int req_id = 0;
+    struct taxi_fetch_wait fetch_wait;
+    if(!blocking_call_allowed("fetch"))
+        return err;
+    memset(&fetch_wait, 0, sizeof(fetch_wait));
+    wait_init(&fetch_wait.wait);
+    if(send_taxi_fetch_async(ctx, cmd, taxi, fetch_wait_hook, &fetch_wait, &req_id) < 0)
+        fetch_wait_hook(-1, NULL, 0, &fetch_wait);
+    err = wait_for(&fetch_wait.wait, req_id);
+    if(err < 0)
+        return err;
+    if(p_taxis) *p_taxis = fetch_wait.taxis;
+    else if(fetch_wait.taxis) free(fetch_wait.taxis);
+    if(p_num_taxis) *p_num_taxis = fetch_wait.num_taxis;
+    return err;
+}
+
+static int send_taxi_location_cmd(struct taxi_client_ctx *ctx, struct taxi *taxi)
+{
+    unsigned int buf[(sizeof(unsigned int) + _TAXI_MAX_ENTRY_LEN)/sizeof(unsigned int)];
+    buf[0] = htonl(_TAXI_LOCATION_CMD);
+    int len = sizeof(unsigned int) + taxis_encode(taxi, 1, (unsigned char*)(buf + 1));
+    if(send_taxi_cmd(ctx, (unsigned char*)buf, len) < 0)
     {
         printf("Location command send to server [%s] didn't succeed\n", 
-               inet_ntoa(dest->sin_addr));
-        goto out_free;
+               inet_ntoa(ctx->server_addr.sin_addr));
+        return -1;
     }
     printf("Location [%lg:%lg] successfully updated for taxi [%.*s]\n",
            taxi->latitude, taxi->longitude, taxi->id_len, taxi->id);
-    err = 0;
-    out_free:
-    free(buf);
-    return err;
+    return 0;
 }
 
-static int send_taxi_delete_cmd(struct taxi *taxi, int sd, struct sockaddr_in *dest, socklen_t dest_addrlen)
+/*
+ * Send the taxis in as few datagrams as they fit.
+ */
+static int send_taxi_location_batch_cmd(struct taxi_client_ctx *ctx, struct taxi *taxis, int num_taxis)
 {
-    int len = 1024, err = -1;
-    unsigned char *buf = calloc(1, len);
-    assert(buf);
-    unsigned char *s = buf;
-    *(unsigned int*)s = htonl(_TAXI_DELETE_CMD);
-    s += sizeof(unsigned int);
-    buf = taxi_pack_with_buf(taxi, &buf, &len, s - buf);
-    assert(buf);
-    len += sizeof(unsigned int);
-    int nbytes = sendto(sd, buf, len, 0, (struct sockaddr*)dest, dest_addrlen);
-    if(nbytes != len)
+    unsigned int buf[_TAXI_LOCATION_BATCH_LEN/sizeof(unsigned int)];
+    int i = 0;
+    while(i < num_taxis)
+    {
+        int len = _TAXI_LOCATION_BATCH_HEADER_LEN;
+        int n = 0;
+        while(i + n < num_taxis)
+        {
+            int entry_len = taxi_batch_packed_size(&taxis[i + n]);
+            if(n && len + entry_len > _TAXI_LOCATION_BATCH_LEN) break;
+            len += entry_len;
+            ++n;
+        }
+        buf[0] = htonl(_TAXI_LOCATION_BATCH_CMD);
+        buf[1] = (unsigned int)ctx->client_addr.sin_port; /* network order like a packed address */
+        buf[2] = htonl(n);
+        taxis_batch_encode(taxis + i, n, (unsigned char*)(buf + 3));
+        if(send_taxi_cmd(ctx, (unsigned char*)buf, len) < 0)
+        {
+            printf("Location batch send to server [%s] didn't succeed\n",
+                   inet_ntoa(ctx->server_addr.sin_addr));
+            return -1;
+        }
+        i += n;
+    }
+    printf("Locations successfully updated for [%d] taxis\n", num_taxis);
+    return 0;
+}
+
+static int send_taxi_delete_cmd(struct taxi_client_ctx *ctx, struct taxi *taxi)
+{
+    unsigned int buf[(sizeof(unsigned int) + _TAXI_MAX_ENTRY_LEN)/sizeof(unsigned int)];
+    buf[0] = htonl(_TAXI_DELETE_CMD);
+    int len = sizeof(unsigned int) + taxis_encode(taxi, 1, (unsigned char*)(buf + 1));
+    if(send_taxi_cmd(ctx, (unsigned char*)buf, len) < 0)
     {
         printf("Unable to send delete taxi command to the server at [%s] for taxi [%.*s]\n",
-               inet_ntoa(dest->sin_addr), taxi->id_len, taxi->id);
-        goto out_free;
+               inet_ntoa(ctx->server_addr.sin_addr), taxi->id_len, taxi->id);
+        return -1;
     }
-    err = 0;
-    out_free:
-    free(buf);
-    return err;
+    return 0;
+}
+
+/*
+ * Location updates are left out while a taxi stays within the error bound
+ * (degrees) of the location last reported for it, which is what the server
+ * holds. An update still goes out every heartbeat (msecs) and on a change
+ * of state.
+ */
+#define _TAXI_REPORT_BUCKETS (1024)
+
+struct taxi_report
+{
+    struct taxi_report *next;
+    unsigned char id[MAX_ID_LEN];
+    int id_len;
+    double latitude;
+    double longitude;
+    int state;
+    uint64_t reported;
+};
+
+static struct taxi_report *report_table[_TAXI_REPORT_BUCKETS];
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static double g_report_bound;
+static int g_report_heartbeat;
+
+static struct taxi_report **find_report(struct taxi *taxi)
+{
+    unsigned int hash = 2166136261U;
+    for(int i = 0; i < taxi->id_len; ++i)
+        hash = (hash ^ taxi->id[i]) * 16777619U;
+    struct taxi_report **p = &report_table[hash & (_TAXI_REPORT_BUCKETS - 1)];
+    while(*p && ((*p)->id_len != taxi->id_len || memcmp((*p)->id, taxi->id, taxi->id_len)))
+        p = &(*p)->next;
+    return p;
+}
+
+static int report_suppressed(struct taxi *taxi, uint64_t now)
+{
+    int suppressed = 0;
+    pthread_mutex_lock(&report_lock);
+    if(g_report_bound <= 0)
+        goto out_unlock;
+    struct taxi_report *report = *find_report(taxi);
+    if(report
+       &&
+       report->state == taxi->state
+       &&
+       now - report->reported < g_report_heartbeat * 1000ULL
+       &&
+       fabs(taxi->latitude - report->latitude) <= g_report_bound
+       &&
+       fabs(taxi->longitude - report->longitude) <= g_report_bound)
+        suppressed = 1;
+
+    out_unlock:
+    pthread_mutex_unlock(&report_lock);
+    return suppressed;
+}
+
+static void report_sent(struct taxi *taxi, uint64_t now)
+{
+    pthread_mutex_lock(&report_lock);
+    if(g_report_bound <= 0)
+        goto out_unlock;
+    struct taxi_report **p = find_report(taxi);
+    struct taxi_report *report = *p;
+    if(!report)
+    {
+        report = calloc(1, sizeof(*report));
+        assert(report);
+        memcpy(report->id, taxi->id, taxi->id_len);
+        report->id_len = taxi->id_len;
+        *p = report;
+    }
+    report->latitude = taxi->latitude;
+    report->longitude = taxi->longitude;
+    report->state = taxi->state;
+    report->reported = now;
+
+    out_unlock:
+    pthread_mutex_unlock(&report_lock);
+}
+
+static void report_forget(struct taxi *taxi)
+{
+    pthread_mutex_lock(&report_lock);
+    struct taxi_report **p = find_report(taxi);
+    struct taxi_report *report = *p;
+    if(report)
+    {
+        *p = report->next;
+        free(report);
+    }
+    pthread_mutex_unlock(&report_lock);
+}
+
+/*
+ * Suppress location updates within bound degrees of the last reported location
+ * for up to heartbeat msecs. A bound of 0 reports every update.
+ */
+int taxi_client_set_update_suppression(double bound, int heartbeat)
+{
+    if(bound < 0 || (bound > 0 && heartbeat <= 0))
+        return -1;
+    pthread_mutex_lock(&report_lock);
+    for(int i = 0; i < _TAXI_REPORT_BUCKETS; ++i)
+    {
+        struct taxi_report *report;
+        while( (report = report_table[i]) )
+        {
+            report_table[i] = report->next;
+            free(report);
+        }
+    }
+    g_report_bound = bound;
+    g_report_heartbeat = heartbeat;
+    pthread_mutex_unlock(&report_lock);
+    return 0;
 }
 
 /*
- * Update the taxi location to the server.
+ * Update the taxi location to the server unless it is within the report bound.
  */
-static int client_fd;
-static struct sockaddr_in server_addr;
-static int client_initialized;
+int update_taxi_location_ctx(struct taxi_client_ctx *ctx, struct taxi *taxi)
+{
+    int err = -1;
+    if(!ctx->initialized)
+    {
+        printf("Taxi client uninitialized\n");
+        goto out;
+    }
+    uint64_t now = forward_clock();
+    if(report_suppressed(taxi, now))
+    {
+        err = 0;
+        goto out;
+    }
+    memcpy(&taxi->addr, &ctx->client_addr, sizeof(taxi->addr));
+    err = send_taxi_location_cmd(ctx, taxi);
+    if(!err)
+        report_sent(taxi, now);
+    out:
+    return err;
+}
 
 int update_taxi_location(struct taxi *taxi)
+{
+    return update_taxi_location_ctx(&g_client_ctx, taxi);
+}
+
+/*
+ * Update the locations of many taxis batched per datagram, leaving out those
+ * within the report bound. The server reaches all of them at the client address.
+ */
+int update_taxi_locations_ctx(struct taxi_client_ctx *ctx, struct taxi *taxis, int num_taxis)
 {
     int err = -1;
-    if(!client_initialized)
+    struct taxi *reports = taxis;
+    int num_reports = num_taxis;
+    if(!ctx->initialized)
     {
         printf("Taxi client uninitialized\n");
         goto out;
     }
-    memcpy(&taxi->addr, &client_addr, sizeof(taxi->addr));
-    err = send_taxi_location_cmd(taxi, client_fd, &server_addr, sizeof(server_addr));
+    uint64_t now = forward_clock();
+    pthread_mutex_lock(&report_lock);
+    int suppress = g_report_bound > 0;
+    pthread_mutex_unlock(&report_lock);
+    if(suppress)
+    {
+        reports = malloc(num_taxis * sizeof(*reports));
+        assert(reports || !num_taxis);
+        num_reports = 0;
+        for(int i = 0; i < num_taxis; ++i)
+        {
+            if(!report_suppressed(&taxis[i], now))
+                memcpy(&reports[num_reports++], &taxis[i], sizeof(*reports));
+        }
+    }
+    err = 0;
+    if(num_reports > 0)
+        err = send_taxi_location_batch_cmd(ctx, reports, num_reports);
+    for(int i = 0; suppress && !err && i < num_reports; ++i)
+        report_sent(&reports[i], now);
+    if(reports != taxis)
+        free(reports);
+    out:
+    return err;
+}
+
+int update_taxi_locations(struct taxi *taxis, int num_taxis)
+{
+    return update_taxi_locations_ctx(&g_client_ctx, taxis, num_taxis);
+}
+
+int delete_taxi_ctx(struct taxi_client_ctx *ctx, struct taxi *taxi)
+{
+    int err = -1;
+    if(!ctx->initialized) 
+    {
+        printf("Taxi client uninitialized\n");
+        goto out;
+    }
+    memcpy(&taxi->addr, &ctx->client_addr, sizeof(taxi->addr));
+    err = send_taxi_delete_cmd(ctx, taxi);
+    report_forget(taxi);
     out:
     return err;
 }
 
 int delete_taxi(struct taxi *taxi)
+{
+    return delete_taxi_ctx(&g_client_ctx, taxi);
+}
+
+/*
+ * Optional cache of nearest taxi fetches keyed by the query location quantized
+ * to the tolerance (degrees). An entry serves the fetches in its cell up to the
+ * max age (msecs) and is refreshed in the background past half of it.
+ * A ping reply or intimation drops the entries with the taxi as its state changed.
+ * The key has the server and the fetch flags of the context as well, so the
+ * contexts only share the fetches that get the same reply.
+ */
+#define _TAXI_CACHE_SLOTS (64)
+
+struct taxi_cache_key
+{
+    uint64_t cell;
+    unsigned int server_addr;
+    unsigned short server_port;
+    unsigned int flags;
+};
+
+static struct taxi_cache_entry
+{
+    struct taxi_cache_key key;
+    double latitude;
+    double longitude;
+    uint64_t fetched; /* 0 for a free entry */
+    int refreshing;
+    struct taxi *taxis;
+    int num_taxis;
+} taxi_cache[_TAXI_CACHE_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_cache_max_age;
+static double g_cache_tolerance;
+
+/*
+ * Called with the cache lock held for the tolerance.
+ */
+static void cache_key(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                      struct taxi_cache_key *key)
+{
+    key->cell = (uint64_t)(unsigned int)((latitude + 90) / g_cache_tolerance) << 32
+        | (unsigned int)((longitude + 180) / g_cache_tolerance);
+    key->server_addr = ctx->server_addr.sin_addr.s_addr;
+    key->server_port = ctx->server_addr.sin_port;
+    key->flags = __atomic_load_n(&ctx->fetch_flags, __ATOMIC_RELAXED);
+}
+
+static int cache_key_equal(struct taxi_cache_key *a, struct taxi_cache_key *b)
+{
+    return a->cell == b->cell && a->server_addr == b->server_addr
+        && a->server_port == b->server_port && a->flags == b->flags;
+}
+
+static struct taxi_cache_entry *cache_slot(struct taxi_cache_key *key)
+{
+    uint64_t hash = key->cell ^ ((uint64_t)key->server_addr << 32 | (uint64_t)key->server_port << 16)
+        ^ (uint64_t)key->flags << 8;
+    return &taxi_cache[(hash * 0x9e3779b97f4a7c15ULL) >> 58];
+}
+
+static void cache_drop(struct taxi_cache_entry *entry)
+{
+    if(entry->taxis) free(entry->taxis);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static struct taxi *copy_taxis(struct taxi *taxis, int num_taxis)
+{
+    struct taxi *copy = NULL;
+    if(num_taxis > 0)
+    {
+        copy = malloc(num_taxis * sizeof(*copy));
+        assert(copy);
+        memcpy(copy, taxis, num_taxis * sizeof(*copy));
+    }
+    return copy;
+}
+
+/*
+ * Called with the cache lock held.
+ */
+static void __cache_store(struct taxi_cache_key *key, double latitude, double longitude,
+                          struct taxi *taxis, int num_taxis)
+{
+    struct taxi_cache_entry *entry = cache_slot(key);
+    struct taxi_cache_key entry_key = *key; /* key may be the entry's */
+    cache_drop(entry);
+    entry->key = entry_key;
+    entry->latitude = latitude;
+    entry->longitude = longitude;
+    entry->fetched = forward_clock();
+    entry->taxis = copy_taxis(taxis, num_taxis);
+    entry->num_taxis = num_taxis;
+}
+
+static void cache_store(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                        struct taxi *taxis, int num_taxis)
+{
+    struct taxi_cache_key key;
+    pthread_mutex_lock(&cache_lock);
+    if(g_cache_max_age > 0)
+    {
+        cache_key(ctx, latitude, longitude, &key);
+        __cache_store(&key, latitude, longitude, taxis, num_taxis);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int cache_refresh_hook(int err, struct taxi *taxis, int num_taxis, void *arg)
+{
+    struct taxi_cache_key *key = arg;
+    pthread_mutex_lock(&cache_lock);
+    struct taxi_cache_entry *entry = cache_slot(key);
+    if(entry->fetched && cache_key_equal(&entry->key, key) && entry->refreshing)
+    {
+        if(err < 0 || !g_cache_max_age)
+            entry->refreshing = 0;
+        else
+            __cache_store(key, entry->latitude, entry->longitude, taxis, num_taxis);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(key);
+    if(taxis) free(taxis);
+    return 0;
+}
+
+/*
+ * Returns 1 with a copy of the cached taxis on a hit.
+ */
+static int cache_lookup(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                        struct taxi **p_taxis, int *p_num_taxis)
+{
+    int hit = 0;
+    struct taxi_cache_key key, *refresh = NULL;
+    double refresh_latitude = 0, refresh_longitude = 0;
+    pthread_mutex_lock(&cache_lock);
+    if(g_cache_max_age <= 0)
+        goto out_unlock;
+    cache_key(ctx, latitude, longitude, &key);
+    struct taxi_cache_entry *entry = cache_slot(&key);
+    if(!entry->fetched || !cache_key_equal(&entry->key, &key))
+        goto out_unlock;
+    uint64_t age = forward_clock() - entry->fetched;
+    if(age >= g_cache_max_age * 1000ULL)
+    {
+        cache_drop(entry);
+        goto out_unlock;
+    }
+    *p_taxis = copy_taxis(entry->taxis, entry->num_taxis);
+    *p_num_taxis = entry->num_taxis;
+    hit = 1;
+    if(!entry->refreshing && age >= g_cache_max_age * 500ULL)
+    {
+        entry->refreshing = 1;
+        refresh = malloc(sizeof(*refresh));
+        assert(refresh);
+        *refresh = key;
+        refresh_latitude = entry->latitude;
+        refresh_longitude = entry->longitude;
+    }
+
+    out_unlock:
+    pthread_mutex_unlock(&cache_lock);
+    if(refresh
+       &&
+       get_nearest_taxis_async_ctx(ctx, refresh_latitude, refresh_longitude, cache_refresh_hook, refresh) < 0)
+        cache_refresh_hook(-1, NULL, 0, refresh);
+    return hit;
+}
+
+static void cache_invalidate_taxi(struct taxi *taxi)
+{
+    pthread_mutex_lock(&cache_lock);
+    for(int i = 0; i < _TAXI_CACHE_SLOTS; ++i)
+    {
+        struct taxi_cache_entry *entry = &taxi_cache[i];
+        for(int j = 0; entry->fetched && j < entry->num_taxis; ++j)
+        {
+            if(entry->taxis[j].id_len == taxi->id_len
+               &&
+               !memcmp(entry->taxis[j].id, taxi->id, taxi->id_len))
+                cache_drop(entry);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Serve get_nearest_taxis from the cache for up to max_age msecs for queries
+ * within tolerance degrees. A max age of 0 turns the cache off.
+ */
+int taxi_client_set_fetch_cache(int max_age, double tolerance)
+{
+    if(max_age < 0 || (max_age > 0 && tolerance <= 0))
+        return -1;
+    pthread_mutex_lock(&cache_lock);
+    for(int i = 0; i < _TAXI_CACHE_SLOTS; ++i)
+        cache_drop(&taxi_cache[i]);
+    g_cache_max_age = max_age;
+    g_cache_tolerance = tolerance;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+int get_nearest_taxis_ctx(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                          struct taxi **taxis, int *num_taxis)
 {
     int err = -1;
-    if(!client_initialized) 
+    if(!ctx->initialized)
     {
         printf("Taxi client uninitialized\n");
         goto out;
     }
-    memcpy(&taxi->addr, &client_addr, sizeof(taxi->addr));
-    err = send_taxi_delete_cmd(taxi, client_fd, &server_addr, sizeof(server_addr));
+    if(taxis && num_taxis && cache_lookup(ctx, latitude, longitude, taxis, num_taxis))
+    {
+        err = 0;
+        goto out;
+    }
+    struct taxi taxi = {0};
+    taxi.latitude = latitude;
+    taxi.longitude = longitude;
+    err = send_taxi_fetch_cmd(ctx, _TAXI_FETCH_FRAG_CMD, &taxi, taxis, num_taxis);
+    if(!err && taxis && num_taxis)
+        cache_store(ctx, latitude, longitude, *taxis, *num_taxis);
     out:
     return err;
 }
 
 int get_nearest_taxis(double latitude, double longitude,
                       struct taxi **taxis, int *num_taxis)
+{
+    return get_nearest_taxis_ctx(&g_client_ctx, latitude, longitude, taxis, num_taxis);
+}
+
+/*
+ * The hook runs on the dispatcher thread with the taxis, which it frees,
+ * or with an error if the server didn't reply within the list timeout.
+ */
+int get_nearest_taxis_async_ctx(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                                taxi_fetch_hook_t hook, void *arg)
 {
     int err = -1;
-    if(!client_initialized)
+    if(!ctx->initialized)
     {
         printf("Taxi client uninitialized\n");
         goto out;
     }
-    err = send_taxi_fetch_cmd(latitude, longitude, taxis, num_taxis,
-                              client_fd, &server_addr, sizeof(server_addr));
+    if(!hook) goto out;
+    struct taxi taxi = {0};
+    taxi.latitude = latitude;
+    taxi.longitude = longitude;
+    err = send_taxi_fetch_async(ctx, _TAXI_FETCH_FRAG_CMD, &taxi, hook, arg, NULL);
     out:
     return err;
 }
 
-int ping_nearby_taxis(struct taxi *customer, struct taxi *taxis, int num_taxis)
+int get_nearest_taxis_async(double latitude, double longitude,
+                            taxi_fetch_hook_t hook, void *arg)
+{
+    return get_nearest_taxis_async_ctx(&g_client_ctx, latitude, longitude, hook, arg);
+}
+
+/*
+ * A stats request lives on the stack of the call waiting for it.
+ */
+struct taxi_stats_request
+{
+    struct taxi_pending pending;
+    struct taxi_server_stats *stats;
+    struct taxi_wait wait;
+};
+
+static int stats_reply(struct taxi_pending *pending, unsigned char *buf, int len, unsigned char **p_owner)
+{
+    struct taxi_stats_request *request = (struct taxi_stats_request*)pending;
+    len -= 2*sizeof(unsigned int);
+    return taxi_stats_unpack(buf + 2*sizeof(unsigned int), &len, request->stats) < 0 ? -1 : 1;
+}
+
+static void stats_complete(struct taxi_pending *pending, int err)
+{
+    struct taxi_stats_request *request = (struct taxi_stats_request*)pending;
+    wait_done(&request->wait, err);
+}
+
+/*
+ * Ask the server for its counters, latency histograms and index gauges.
+ */
+int get_taxi_server_stats_ctx(struct taxi_client_ctx *ctx, struct taxi_server_stats *stats)
+{
+    int err = -1;
+    unsigned int req[2];
+    struct taxi_stats_request request;
+    if(!ctx->initialized)
+    {
+        printf("Taxi client uninitialized\n");
+        goto out;
+    }
+    if(!blocking_call_allowed("stats"))
+        goto out;
+    req[0] = htonl(_TAXI_STATS_CMD);
+    memset(&request, 0, sizeof(request));
+    request.stats = stats;
+    request.pending.reply = stats_reply;
+    request.pending.complete = stats_complete;
+    wait_init(&request.wait);
+    if(add_pending(ctx, &request.pending, _TAXI_LIST_TIMEOUT, _TAXI_LIST_TIMEOUT) < 0)
+        stats_complete(&request.pending, -1);
+    else
+    {
+        req[1] = htonl(request.pending.req_id);
+        if(send_taxi_cmd(ctx, (unsigned char*)req, sizeof(req)) < 0
+           &&
+           remove_pending(request.pending.req_id))
+            stats_complete(&request.pending, -1);
+    }
+    err = wait_for(&request.wait, request.pending.req_id);
+
+    out:
+    return err;
+}
+
+int get_taxi_server_stats(struct taxi_server_stats *stats)
+{
+    return get_taxi_server_stats_ctx(&g_client_ctx, stats);
+}
+
+/*
+ * Fetch the taxis near the customer and let the server ping them in one go.
+ * Taxis reply to the customer on the client socket like with ping_nearby_taxis.
+ */
+int fetch_and_ping_nearby_taxis_ctx(struct taxi_client_ctx *ctx, struct taxi *customer,
+                                    struct taxi **taxis, int *num_taxis)
 {
     int err = -1;
-    if(!client_initialized)
+    if(!ctx->initialized)
+    {
+        printf("Taxi client uninitialized\n");
+        goto out;
+    }
+    if(!customer || !taxis || !num_taxis)
+        goto out;
+    struct taxi query;
+    memcpy(&query, customer, sizeof(query));
+    memset(&query.addr, 0, sizeof(query.addr));
+    query.addr.sin_port = ctx->client_addr.sin_port;
+    err = send_taxi_fetch_cmd(ctx, _TAXI_FETCH_PING_CMD, &query, taxis, num_taxis);
+    if(err < 0 || !*num_taxis)
+        goto out;
+    err = add_taxis_customer(&ctx->customers, customer, *taxis, *num_taxis);
+    if(err < 0)
+        printf("Error creating customer taxi list for fetch and ping\n");
+
+    out:
+    return err;
+}
+
+int fetch_and_ping_nearby_taxis(struct taxi *customer, struct taxi **taxis, int *num_taxis)
+{
+    return fetch_and_ping_nearby_taxis_ctx(&g_client_ctx, customer, taxis, num_taxis);
+}
+
+int ping_nearby_taxis_ctx(struct taxi_client_ctx *ctx, struct taxi *customer,
+                          struct taxi *taxis, int num_taxis)
+{
+    int err = -1;
+    if(!ctx->initialized)
     {
         printf("Taxi client uninitialized\n");
         goto out;
@@ -300,25 +1532,30 @@ int ping_nearby_taxis(struct taxi *customer, struct taxi *taxis, int num_taxis)
     /*
      * Create a customer taxi list for retrieval.
      */
-    err = add_taxis_customer(customer, taxis, num_taxis); 
+    err = add_taxis_customer(&ctx->customers, customer, taxis, num_taxis); 
     if(err < 0)
     {
         printf("Error creating customer taxi list before ping command\n");
         goto out;
     }
 
-    err = send_taxis_ping_cmd(customer, taxis, num_taxis, client_fd);
+    err = send_taxis_ping_cmd(customer, taxis, num_taxis, ctx->fd);
 
     out:
     return err;
 }
 
-static int process_taxi_ping_request(struct taxi *customer, struct taxi *taxis, int num_taxis)
+int ping_nearby_taxis(struct taxi *customer, struct taxi *taxis, int num_taxis)
+{
+    return ping_nearby_taxis_ctx(&g_client_ctx, customer, taxis, num_taxis);
+}
+
+static int process_taxi_ping_request(struct taxi_client_ctx *ctx, struct taxi *customer, struct taxi_view *view)
 {
     int err = 0;
     if(err) goto out;
     struct taxi self, *p_self = NULL;
-    err = find_taxi_by_hint(client_addr.sin_port, &self);
+    err = find_taxi_by_hint(&ctx->customers, ctx->client_addr.sin_port, &self);
     if(err == 0)
     {
         p_self = &self;
@@ -327,7 +1564,7 @@ static int process_taxi_ping_request(struct taxi *customer, struct taxi *taxis,
             /*
              * Check if this customer is part of the taxi list.
              */
-            if(find_customer_taxi(self.id, self.id_len, customer->id, customer->id_len, NULL))
+            if(find_customer_taxi(&ctx->customers, self.id, self.id_len, customer->id, customer->id_len, NULL))
             {
                 output("Ignoring customer request as taxi [%.*s] is already active serving another customer\n",
                        self.id_len, self.id);
@@ -335,25 +1572,33 @@ static int process_taxi_ping_request(struct taxi *customer, struct taxi *taxis,
             }
         }
     }
-    err = add_taxis_customer(customer, taxis, num_taxis);
-    if(err) goto out;
+    struct taxi_view_entry entry;
+    taxi_view_rewind(view);
+    while(taxi_view_next(view, &entry))
+    {
+        struct taxi taxi;
+        memset(&taxi, 0, sizeof(taxi));
+        taxi_view_entry_copy(&entry, &taxi);
+        err = add_taxis_customer(&ctx->customers, customer, &taxi, 1);
+        if(err) goto out;
+    }
 
     if(!p_self)
     {
-        err = get_taxi_matching_self_customer(customer->id, customer->id_len, 
-                                              client_addr.sin_port, &self);
+        err = get_taxi_matching_self_customer(&ctx->customers, customer->id, customer->id_len, 
+                                              ctx->client_addr.sin_port, &self);
         if(err)
         {
             printf("No taxi matching self for customer [%.*s]\n", customer->id_len, customer->id);
             goto out;
         }
 
-        printf("Our taxi id [%.*s], port [%d]\n", self.id_len, self.id, ntohs(client_addr.sin_port));
+        printf("Our taxi id [%.*s], port [%d]\n", self.id_len, self.id, ntohs(ctx->client_addr.sin_port));
 
         /*
          * Now find the number of taxis approaching the customer.
          */
-        int num_approaching = get_taxis_approaching_customer(customer->id, customer->id_len);
+        int num_approaching = get_taxis_approaching_customer(&ctx->customers, customer->id, customer->id_len);
         if(num_approaching >= 2)
         {
             printf("Already [%d] approaching the customer [%.*s]. Backing out\n", num_approaching,
@@ -366,20 +1611,21 @@ static int process_taxi_ping_request(struct taxi *customer, struct taxi *taxis,
      * If there are hooks registered, invoke them for the cmd.
      * These hooks could update the location information for the taxi from the mobile interface.
      */
-    if(g_taxi_hook) 
+    if(ctx->hook) 
     {
-        g_taxi_hook(_TAXI_PING_CMD, customer, &self, 1);
+        ctx->hook(_TAXI_PING_CMD, customer, &self, 1);
     }
-    err = send_taxi_ping_reply_cmd(customer, &self, client_fd);
+    err = send_taxi_ping_reply_cmd(ctx, customer, &self);
 
     out:
     return err;
 }
 
-static int process_taxi_ping_reply_request(int cmd, struct taxi *customer, struct taxi *peer)
+static int process_taxi_ping_reply_request(struct taxi_client_ctx *ctx, int cmd,
+                                           struct taxi *customer, struct taxi *peer)
 {
     int err;
-    err = add_taxis_customer(customer, peer, 1);
+    err = add_taxis_customer(&ctx->customers, customer, peer, 1);
     if(err < 0)
     {
         output("Unable to add peer taxi [%.*s] to taxi map for customer [%.*s]\n",
@@ -387,12 +1633,13 @@ static int process_taxi_ping_reply_request(int cmd, struct taxi *customer, struc
         goto out;
     }
 
-    err = update_taxi_state_customer(peer->id, peer->id_len, 
+    err = update_taxi_state_customer(&ctx->customers, peer->id, peer->id_len, 
                                      customer->id, customer->id_len, peer->state);
+    cache_invalidate_taxi(peer);
 
-    if(g_taxi_hook)
+    if(ctx->hook)
     {
-        g_taxi_hook(cmd, customer, peer, 1);
+        ctx->hook(cmd, customer, peer, 1);
     }
 
     out:
@@ -400,83 +1647,160 @@ static int process_taxi_ping_reply_request(int cmd, struct taxi *customer, struc
 }
 
 
-static int taxi_client_dispatcher(int fd, void *arg)
+static int send_subscribe_cmd(struct taxi_region *region, int lease, unsigned int flags)
 {
-#define _CHECK_SPACE(sp) do { len -= (sp); if(len < 0) goto out; } while(0)
-    unsigned char buf[0xffff+1];
-    int len, err = -1;
-    struct sockaddr_in dest;
-    socklen_t addrlen = sizeof(dest);
-    memset(&dest, 0, sizeof(dest));
-    retry:
-    len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&dest, &addrlen);
-    if(len <= 0)
-    {
-        if(len < 0)
-        {
-            if(errno == EINTR)
-                goto retry;
-            fprintf(stderr, "recvfrom failed with [%s]\n", strerror(errno));
-            goto out;
+    int offset = sizeof(unsigned int) + _TAXI_SUBSCRIBE_HEADER_LEN + sizeof(unsigned int);
+    unsigned int s[(sizeof(unsigned int) + _TAXI_SUBSCRIBE_HEADER_LEN + sizeof(unsigned int)
+                    + 2*_TAXI_MAX_ENTRY_LEN)/sizeof(unsigned int)];
+    unsigned char *buf = (unsigned char*)s;
+    struct taxi corners[2];
+    memset(corners, 0, sizeof(corners));
+    corners[0].latitude = region->latitude_min;
+    corners[0].longitude = region->longitude_min;
+    corners[1].latitude = region->latitude_max;
+    corners[1].longitude = region->longitude_max;
+    s[0] = htonl(_TAXI_SUBSCRIBE_CMD);
+    s[1] = htonl(region->sub_id);
+    s[2] = htonl(lease);
+    s[3] = htonl(flags);
+    s[4] = htonl(2);
+    int len = offset + taxis_encode(corners, 2, buf + offset);
+    struct taxi_client_ctx *ctx = region->ctx;
+    if(sendto(ctx->fd, buf, len, 0, (struct sockaddr*)&ctx->server_addr, sizeof(ctx->server_addr)) != len)
+    {
+        printf("Unable to send subscription [%u] to server at [%s]\n",
+               region->sub_id, inet_ntoa(ctx->server_addr.sin_addr));
+        return -1;
+    }
+    return 0;
+}
+
+static struct taxi_region *find_region(struct taxi_client_ctx *ctx, unsigned int sub_id)
+{
+    for(int i = 0; i < _TAXI_MAX_REGIONS; ++i)
+    {
+        if(sub_id && ctx->regions[i].sub_id == sub_id)
+            return &ctx->regions[i];
+    }
+    return NULL;
+}
+
+/*
+ * Deltas are applied in sequence. On a gap the subscription is reset
+ * and the next snapshot (sequence 0) starts over.
+ */
+static int process_region_delta(struct taxi_client_ctx *ctx, struct taxi_region_delta *delta)
+{
+    taxi_region_hook_t hook = NULL;
+    pthread_mutex_lock(&ctx->region_lock);
+    struct taxi_region *region = find_region(ctx, delta->sub_id);
+    if(region)
+    {
+        if(!delta->seq || delta->seq == region->next_seq)
+        {
+            region->next_seq = delta->seq + 1;
+            hook = region->hook;
+        }
+        else
+        {
+            printf("Region [%u] delta [%u] out of sequence, expected [%u]. Resetting\n",
+                   delta->sub_id, delta->seq, region->next_seq);
+            send_subscribe_cmd(region, region->lease, _TAXI_SUBSCRIBE_RESET);
         }
-        goto out;
     }
+    pthread_mutex_unlock(&ctx->region_lock);
+    if(!hook) return -1;
+    return hook(delta);
+}
+
+/*
+ * A datagram receive buffer is handed over in p_owner for a reply to take over.
+ */
+static int process_client_packet(struct taxi_client_ctx *ctx, unsigned char *buf, int len,
+                                 struct sockaddr_in *dest, unsigned char **p_owner)
+{
+#define _CHECK_SPACE(sp) do { len -= (sp); if(len < 0) goto out; } while(0)
+    int err = -1;
+    if(len <= 0) goto out;
     output("Got [%d] bytes on the client\n", len);
     unsigned char *s = buf;
     _CHECK_SPACE(sizeof(unsigned int));
     int cmd = ntohl(*(unsigned int*)s);
     s += sizeof(unsigned int);
 
+    if(_TAXI_CMD(cmd) == _TAXI_LIST_FRAG_CMD || cmd == _TAXI_STATS_CMD)
+    {
+        _CHECK_SPACE(sizeof(unsigned int));
+        err = process_reply(ctx, dest, ntohl(*(unsigned int*)s), buf, len + 2*sizeof(unsigned int), p_owner);
+        goto out;
+    }
     switch(cmd)
     {
     case _TAXI_PING_CMD:
         {
-            struct taxi *taxis = NULL;
-            int num_taxis = 0;
+            struct taxi_view view;
+            struct taxi_view_entry entry;
             struct taxi customer = {0};
-            err = taxis_ping_unpack(s, &len, &customer, &taxis, &num_taxis);
+            err = taxis_ping_view_init(&view, s, &len, &customer);
             if(err < 0)
             {
                 output("Taxi ping command unpack failed\n");
                 goto out;
             }
             /*
-             * Copy the customer address.
+             * Copy the customer address unless the server pinged on behalf of the customer.
              */
-            memcpy(&customer.addr, &dest, sizeof(customer.addr));
+            if(dest->sin_addr.s_addr != ctx->server_addr.sin_addr.s_addr
+               ||
+               dest->sin_port != ctx->server_addr.sin_port)
+            {
+                memcpy(&customer.addr, dest, sizeof(customer.addr));
+            }
             printf("Got ping command from customer [%.*s] at [%lg:%lg] for [%d] taxis at [%s]\n",
                    customer.id_len, customer.id, customer.latitude, customer.longitude,
-                   num_taxis, inet_ntoa(dest.sin_addr));
-            for(int i = 0; i < num_taxis; ++i)
+                   view.num_taxis, inet_ntoa(dest->sin_addr));
+            while(taxi_view_next(&view, &entry))
             {
                 printf("Ping command with taxi [%.*s] traced at location [%lg:%lg]\n",
-                       taxis[i].id_len, taxis[i].id, taxis[i].latitude, taxis[i].longitude);
+                       entry.id_len, entry.id, entry.latitude, entry.longitude);
             }
             /*
              * Add the list to the customer list.
              */
-            process_taxi_ping_request(&customer, taxis, num_taxis);
-            free(taxis);
+            process_taxi_ping_request(ctx, &customer, &view);
+        }
+        break;
+    case _TAXI_REGION_DELTA_CMD:
+        {
+            struct taxi_region_delta delta;
+            err = taxi_region_delta_unpack(s, &len, &delta);
+            if(err < 0)
+            {
+                output("Region delta unpack failed\n");
+                goto out;
+            }
+            process_region_delta(ctx, &delta);
+            taxi_region_delta_free(&delta);
         }
         break;
     case _TAXI_PING_INTIMATION_CMD:
     case _TAXI_PING_REPLY_CMD:
         {
-            struct taxi *taxis = NULL;
-            int num_taxis = 0;
-            struct taxi customer = {0};
-            err = taxis_ping_unpack(s, &len, &customer, &taxis, &num_taxis);
-            if(err < 0)
+            struct taxi_view view;
+            struct taxi_view_entry entry;
+            struct taxi customer = {0}, peer = {0};
+            err = taxis_ping_view_init(&view, s, &len, &customer);
+            if(err < 0 || !taxi_view_next(&view, &entry))
             {
                 output("Taxi ping intimation cmd unpack failed\n");
+                err = -1;
                 goto out;
             }
-            assert(num_taxis == 1);
+            taxi_view_entry_copy(&entry, &peer);
             printf("Got ping [%s] from peer taxi [%.*s] for customer [%.*s]\n",
                    cmd == _TAXI_PING_REPLY_CMD ? "reply" : "intimation",
-                   taxis->id_len, taxis->id, customer.id_len, customer.id);
-            process_taxi_ping_reply_request(cmd, &customer, taxis);
-            free(taxis);
+                   peer.id_len, peer.id, customer.id_len, customer.id);
+            process_taxi_ping_reply_request(ctx, cmd, &customer, &peer);
         }
         break;
     default:
@@ -492,68 +1816,536 @@ static int taxi_client_dispatcher(int fd, void *arg)
 #undef _CHECK_SPACE
 }
 
-int taxi_client_initialize(const char *ip, int port)
+/*
+ * Reply frames off the stream are handled like the datagrams as they complete.
+ * A partial frame stays in the buffer for the next call.
+ */
+static int taxi_client_stream_dispatcher(int fd, void *arg)
 {
-    int sd;
-    int err = -1;
-    if(client_initialized)
+    struct taxi_client_ctx *ctx = arg;
+    for(;;)
     {
-        err = 0;
-        goto out;
+        int nbytes = recv(fd, ctx->stream_buf + ctx->stream_len,
+                          _CLIENT_STREAM_BUF_LEN - ctx->stream_len, MSG_DONTWAIT);
+        if(nbytes < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+        }
+        if(nbytes <= 0)
+            goto out_close;
+        ctx->stream_len += nbytes;
+        int offset = 0;
+        while(ctx->stream_len - offset >= (int)sizeof(unsigned int))
+        {
+            unsigned int frame_len = ntohl(*(unsigned int*)(ctx->stream_buf + offset));
+            if(frame_len > __MAX_PACKET_LEN)
+                goto out_close;
+            if(ctx->stream_len - offset - sizeof(unsigned int) < frame_len)
+                break;
+            offset += sizeof(unsigned int);
+            process_client_packet(ctx, ctx->stream_buf + offset, frame_len, &ctx->server_addr, NULL);
+            offset += frame_len;
+        }
+        ctx->stream_len -= offset;
+        memmove(ctx->stream_buf, ctx->stream_buf + offset, ctx->stream_len);
     }
-    err = dispatcher_initialize();
-    if(err < 0)
+    return 0;
+
+    out_close:
+    pthread_mutex_lock(&ctx->stream_lock);
+    if(ctx->stream_fd == fd)
+        stream_close(ctx);
+    pthread_mutex_unlock(&ctx->stream_lock);
+    return 0;
+}
+
+struct client_bufs
+{
+    unsigned char *bufs[_CLIENT_RECV_BATCH];
+};
+
+static void client_bufs_free(void *arg)
+{
+    struct client_bufs *client_bufs = arg;
+    for(int i = 0; i < _CLIENT_RECV_BATCH; ++i)
+        free(client_bufs->bufs[i]);
+    free(client_bufs);
+}
+
+static void client_bufs_key_create(void)
+{
+    pthread_key_create(&client_bufs_key, client_bufs_free);
+}
+
+/*
+ * The client socket is drained a batch at a time until it would block, so a
+ * burst of pings costs a wakeup per batch rather than per datagram.
+ * The socket stays blocking for the sends. The receive buffers belong to
+ * the event loop thread and are reused for all the contexts it owns.
+ * A fragment held for the rest of its reply takes its buffer along and
+ * the slot gets a new one.
+ */
+static int taxi_client_dispatcher(int fd, void *arg)
+{
+    struct taxi_client_ctx *ctx = arg;
+    struct mmsghdr msgs[_CLIENT_RECV_BATCH];
+    struct iovec iovecs[_CLIENT_RECV_BATCH];
+    struct sockaddr_in addrs[_CLIENT_RECV_BATCH];
+    pthread_once(&client_bufs_once, client_bufs_key_create);
+    struct client_bufs *client_bufs = pthread_getspecific(client_bufs_key);
+    if(!client_bufs)
+    {
+        client_bufs = calloc(1, sizeof(*client_bufs));
+        assert(client_bufs != NULL);
+        pthread_setspecific(client_bufs_key, client_bufs);
+    }
+    for(;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < _CLIENT_RECV_BATCH; ++i)
+        {
+            if(!client_bufs->bufs[i])
+            {
+                client_bufs->bufs[i] = malloc(0xffff+1);
+                assert(client_bufs->bufs[i] != NULL);
+            }
+            iovecs[i].iov_base = client_bufs->bufs[i];
+            iovecs[i].iov_len = 0xffff+1;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        int nmsgs = recvmmsg(fd, msgs, _CLIENT_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if(nmsgs < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "recvmmsg failed with [%s]\n", strerror(errno));
+            break;
+        }
+        for(int i = 0; i < nmsgs; ++i)
+            process_client_packet(ctx, iovecs[i].iov_base, msgs[i].msg_len, &addrs[i],
+                                  &client_bufs->bufs[i]);
+        if(nmsgs < _CLIENT_RECV_BATCH) break;
+    }
+    return 0;
+}
+
+/*
+ * Spread the sockets registered with the dispatcher over more event loop
+ * threads. Takes effect only before the first context is initialized.
+ */
+int taxi_client_set_dispatcher_threads(int num_threads)
+{
+    int err = -1;
+    pthread_mutex_lock(&client_lock);
+    if(!g_dispatcher_users)
+        err = dispatcher_set_threads(num_threads);
+    pthread_mutex_unlock(&client_lock);
+    return err;
+}
+
+/*
+ * The dispatcher runs while there are contexts on it.
+ */
+static int client_dispatcher_get(void)
+{
+    int err = 0;
+    pthread_mutex_lock(&client_lock);
+    if(!g_dispatcher_users && dispatcher_initialize() < 0)
     {
         fprintf(stderr, "Dispatcher initialize failed\n");
-        goto out;
+        err = -1;
     }
+    else
+        ++g_dispatcher_users;
+    pthread_mutex_unlock(&client_lock);
+    return err;
+}
+
+static void client_dispatcher_put(void)
+{
+    pthread_mutex_lock(&client_lock);
+    if(!--g_dispatcher_users)
+        dispatcher_finalize();
+    pthread_mutex_unlock(&client_lock);
+}
+
+static int taxi_client_ctx_init(struct taxi_client_ctx *ctx, const char *ip, int port)
+{
+    int sd;
+    int err = -1;
+    socklen_t client_addrlen = sizeof(ctx->client_addr);
+    err = client_dispatcher_get();
+    if(err < 0)
+        goto out;
     sd = bind_server(NULL, 0);
     if(sd < 0)
-        goto out_finalize;
-    client_fd = sd;
-    err = dispatcher_register(sd, 0, NULL, taxi_client_dispatcher);
+        goto out_put;
+    ctx->fd = sd;
+    ctx->stream_fd = -1;
+    taxi_customer_map_init(&ctx->customers);
+    ctx->server_addr.sin_port = htons(port);
+    ctx->server_addr.sin_family = PF_INET;
+    get_server_addr(ip, &ctx->server_addr);
+    getsockname(sd, (struct sockaddr*)&ctx->client_addr, &client_addrlen);
+    err = dispatcher_register(sd, 0, ctx, taxi_client_dispatcher);
     if(err < 0)
     {
         fprintf(stderr, "Taxi dispatcher register failed\n");
         goto out_close;
     }
-    server_addr.sin_port = htons(port);
-    server_addr.sin_family = PF_INET;
-    get_server_addr(ip, &server_addr);
-    getsockname(client_fd, (struct sockaddr*)&client_addr, &client_addrlen);
-    printf("Local client address [%s], port [%d]\n", inet_ntoa(client_addr.sin_addr),
-           ntohs(client_addr.sin_port));
-    client_initialized = 1;
-
-    /*
-     * load the cache
-     */
-    get_if_addrs(NULL, NULL);
-    
+    printf("Local client address [%s], port [%d]\n", inet_ntoa(ctx->client_addr.sin_addr),
+           ntohs(ctx->client_addr.sin_port));
+    ctx->initialized = 1;
     err = 0;
     goto out;
 
     out_close:
+    taxi_customer_map_destroy(&ctx->customers);
     close(sd);
 
-    out_finalize:
-    dispatcher_finalize();
+    out_put:
+    client_dispatcher_put();
 
     out:
     return err;
 }
+
+/*
+ * A context on a client socket of its own to the server at ip:port.
+ * Contexts can be used from any thread.
+ */
+struct taxi_client_ctx *taxi_client_ctx_create(const char *ip, int port)
+{
+    struct taxi_client_ctx *ctx = calloc(1, sizeof(*ctx));
+    assert(ctx != NULL);
+    pthread_mutex_init(&ctx->stream_lock, NULL);
+    pthread_mutex_init(&ctx->region_lock, NULL);
+    if(taxi_client_ctx_init(ctx, ip, port) < 0)
+    {
+        pthread_mutex_destroy(&ctx->stream_lock);
+        pthread_mutex_destroy(&ctx->region_lock);
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static void taxi_client_ctx_close(struct taxi_client_ctx *ctx)
+{
+    if(ctx->initialized)
+    {
+        dispatcher_deregister_wait(ctx->fd);
+        pthread_mutex_lock(&ctx->stream_lock);
+        int stream_fd = ctx->stream_fd;
+        ctx->stream_fd = -1;
+        pthread_mutex_unlock(&ctx->stream_lock);
+        if(stream_fd >= 0)
+        {
+            dispatcher_deregister_wait(stream_fd);
+            close(stream_fd);
+        }
+        fail_pending(ctx);
+        /*
+         * The renew timers take the region lock, so they are waited out without it.
+         */
+        for(int i = 0; i < _TAXI_MAX_REGIONS; ++i)
+        {
+            pthread_mutex_lock(&ctx->region_lock);
+            unsigned int timer_id = ctx->regions[i].timer_id;
+            ctx->regions[i].timer_id = 0;
+            pthread_mutex_unlock(&ctx->region_lock);
+            if(timer_id)
+                dispatcher_cancel_timer_wait(timer_id);
+        }
+        pthread_mutex_lock(&ctx->region_lock);
+        for(int i = 0; i < _TAXI_MAX_REGIONS; ++i)
+        {
+            struct taxi_region *region = &ctx->regions[i];
+            if(!region->sub_id)
+                continue;
+            send_subscribe_cmd(region, 0, 0);
+            memset(region, 0, sizeof(*region));
+        }
+        pthread_mutex_unlock(&ctx->region_lock);
+        free(ctx->stream_buf);
+        close(ctx->fd);
+        taxi_customer_map_destroy(&ctx->customers);
+        client_dispatcher_put();
+    }
+    pthread_mutex_destroy(&ctx->stream_lock);
+    pthread_mutex_destroy(&ctx->region_lock);
+    free(ctx);
+}
+
+static int taxi_client_ctx_close_timer(void *arg)
+{
+    taxi_client_ctx_close(arg);
+    return 0;
+}
+
+/*
+ * Close the context once the calls on it have returned. The requests it has
+ * pending fail and its regions are unsubscribed. From a dispatcher thread,
+ * where a hook of the context may be the caller, it is closed on the timer
+ * thread once the callback in progress returns. Calls from the hooks of a
+ * context that is closing are ignored.
+ */
+void taxi_client_ctx_destroy(struct taxi_client_ctx *ctx)
+{
+    if(!ctx || ctx == &g_client_ctx) return;
+    if(__atomic_exchange_n(&ctx->closing, 1, __ATOMIC_ACQ_REL))
+        return;
+    if(dispatcher_in_thread()
+       &&
+       !dispatcher_add_timer(0, 0, ctx, taxi_client_ctx_close_timer, NULL))
+        return;
+    taxi_client_ctx_close(ctx);
+}
+
+int taxi_client_initialize(const char *ip, int port)
+{
+    int err = 0;
+    pthread_mutex_lock(&g_client_ctx_lock);
+    if(!g_client_ctx.initialized)
+        err = taxi_client_ctx_init(&g_client_ctx, ip, port);
+    pthread_mutex_unlock(&g_client_ctx_lock);
+    if(!err)
+    {
+        /*
+         * load the cache
+         */
+        get_if_addrs(NULL, NULL);
+    }
+    return err;
+}
  
-int taxi_client_register_hook(taxi_hook_t hook)
+/*
+ * Carry requests over a persistent stream to the server from now on.
+ * Requests fall back to datagrams if the stream breaks.
+ */
+int taxi_client_connect_stream_ctx(struct taxi_client_ctx *ctx)
 {
     int err = -1;
-
-    if(!hook) goto out;
-    if(!g_taxi_hook) 
+    if(!ctx->initialized)
+    {
+        printf("Taxi client uninitialized\n");
+        goto out;
+    }
+    pthread_mutex_lock(&ctx->stream_lock);
+    if(ctx->stream_fd >= 0)
     {
         err = 0;
-        g_taxi_hook = hook;
+        goto out_unlock;
+    }
+    int sd = socket(PF_INET, SOCK_STREAM, 0);
+    if(sd < 0)
+        goto out_unlock;
+    if(connect(sd, (struct sockaddr*)&ctx->server_addr, sizeof(ctx->server_addr)) < 0)
+    {
+        printf("Unable to connect stream to server at [%s:%d]: [%s]\n",
+               inet_ntoa(ctx->server_addr.sin_addr), ntohs(ctx->server_addr.sin_port), strerror(errno));
+        close(sd);
+        goto out_unlock;
+    }
+    int on = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(!ctx->stream_buf)
+    {
+        ctx->stream_buf = malloc(_CLIENT_STREAM_BUF_LEN);
+        assert(ctx->stream_buf != NULL);
+    }
+    ctx->stream_len = 0;
+    ctx->stream_fd = sd;
+    if(dispatcher_register(sd, 0, ctx, taxi_client_stream_dispatcher) < 0)
+    {
+        fprintf(stderr, "Taxi dispatcher register failed for the stream\n");
+        ctx->stream_fd = -1;
+        close(sd);
+        goto out_unlock;
+    }
+    err = 0;
+
+    out_unlock:
+    pthread_mutex_unlock(&ctx->stream_lock);
+    out:
+    return err;
+}
+
+int taxi_client_connect_stream(void)
+{
+    return taxi_client_connect_stream_ctx(&g_client_ctx);
+}
+
+/*
+ * Ask for fetch replies in the compact encoding from now on. The taxi
+ * coordinates come back rounded to the fixed point of the encoding.
+ */
+int taxi_client_set_compact_ctx(struct taxi_client_ctx *ctx, int compact)
+{
+    if(compact)
+        __atomic_or_fetch(&ctx->fetch_flags, _TAXI_CMD_V2, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(&ctx->fetch_flags, ~_TAXI_CMD_V2, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int taxi_client_set_compact(int compact)
+{
+    return taxi_client_set_compact_ctx(&g_client_ctx, compact);
+}
+
+/*
+ * Take fetch replies compressed, trading server and client cycles for bandwidth.
+ */
+int taxi_client_set_compress_ctx(struct taxi_client_ctx *ctx, int compress)
+{
+    if(compress)
+        __atomic_or_fetch(&ctx->fetch_flags, _TAXI_CMD_LZ, __ATOMIC_RELAXED);
+    else
+        __atomic_and_fetch(&ctx->fetch_flags, ~_TAXI_CMD_LZ, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int taxi_client_set_compress(int compress)
+{
+    return taxi_client_set_compress_ctx(&g_client_ctx, compress);
+}
+
+/*
+ * The context cancels the timers of its regions before it goes away.
+ */
+static int renew_region_timer(void *arg)
+{
+    struct taxi_region *region = arg;
+    struct taxi_client_ctx *ctx = region->ctx;
+    pthread_mutex_lock(&ctx->region_lock);
+    if(region->sub_id)
+        send_subscribe_cmd(region, region->lease, 0);
+    pthread_mutex_unlock(&ctx->region_lock);
+    return 0;
+}
+
+/*
+ * Subscribe to the taxis in the region for the lease (msecs).
+ * The hook gets the snapshot of the region first and then the deltas.
+ * The lease is renewed every half period until unsubscribed.
+ */
+int subscribe_taxi_region_ctx(struct taxi_client_ctx *ctx,
+                              double latitude_min, double longitude_min,
+                              double latitude_max, double longitude_max,
+                              int lease, taxi_region_hook_t hook, unsigned int *p_sub_id)
+{
+    int err = -1;
+    if(!ctx->initialized)
+    {
+        printf("Taxi client uninitialized\n");
+        goto out;
+    }
+    if(lease <= 0 || !hook) goto out;
+    pthread_mutex_lock(&ctx->region_lock);
+    struct taxi_region *region = NULL;
+    for(int i = 0; !region && i < _TAXI_MAX_REGIONS; ++i)
+    {
+        if(!ctx->regions[i].sub_id)
+            region = &ctx->regions[i];
+    }
+    if(!region)
+    {
+        printf("Too many region subscriptions\n");
+        goto out_unlock;
+    }
+    region->sub_id = __atomic_add_fetch(&g_region_sub_id, 1, __ATOMIC_RELAXED);
+    region->ctx = ctx;
+    region->latitude_min = latitude_min;
+    region->longitude_min = longitude_min;
+    region->latitude_max = latitude_max;
+    region->longitude_max = longitude_max;
+    region->lease = lease;
+    region->next_seq = 0;
+    region->hook = hook;
+    err = send_subscribe_cmd(region, lease, 0);
+    if(err < 0)
+    {
+        region->sub_id = 0;
+        goto out_unlock;
+    }
+    int period = lease > 1 ? lease / 2 : 1;
+    if(dispatcher_add_timer(period, period, region, renew_region_timer, &region->timer_id) < 0)
+        printf("Unable to renew the lease of region [%u]\n", region->sub_id);
+    if(p_sub_id) *p_sub_id = region->sub_id;
+
+    out_unlock:
+    pthread_mutex_unlock(&ctx->region_lock);
+    out:
+    return err;
+}
+
+int subscribe_taxi_region(double latitude_min, double longitude_min,
+                          double latitude_max, double longitude_max,
+                          int lease, taxi_region_hook_t hook, unsigned int *p_sub_id)
+{
+    return subscribe_taxi_region_ctx(&g_client_ctx, latitude_min, longitude_min,
+                                     latitude_max, longitude_max, lease, hook, p_sub_id);
+}
+
+/*
+ * Extend the lease of the subscription by another lease period.
+ */
+int renew_taxi_region_ctx(struct taxi_client_ctx *ctx, unsigned int sub_id)
+{
+    int err = -1;
+    pthread_mutex_lock(&ctx->region_lock);
+    struct taxi_region *region = find_region(ctx, sub_id);
+    if(region)
+        err = send_subscribe_cmd(region, region->lease, 0);
+    pthread_mutex_unlock(&ctx->region_lock);
+    return err;
+}
+
+int renew_taxi_region(unsigned int sub_id)
+{
+    return renew_taxi_region_ctx(&g_client_ctx, sub_id);
+}
+
+int unsubscribe_taxi_region_ctx(struct taxi_client_ctx *ctx, unsigned int sub_id)
+{
+    int err = -1;
+    pthread_mutex_lock(&ctx->region_lock);
+    struct taxi_region *region = find_region(ctx, sub_id);
+    if(region)
+    {
+        if(region->timer_id)
+            dispatcher_cancel_timer(region->timer_id);
+        err = send_subscribe_cmd(region, 0, 0);
+        memset(region, 0, sizeof(*region));
     }
+    pthread_mutex_unlock(&ctx->region_lock);
+    return err;
+}
+
+int unsubscribe_taxi_region(unsigned int sub_id)
+{
+    return unsubscribe_taxi_region_ctx(&g_client_ctx, sub_id);
+}
+
+int taxi_client_register_hook_ctx(struct taxi_client_ctx *ctx, taxi_hook_t hook)
+{
+    int err = -1;
+
+    taxi_hook_t none = NULL;
+    if(!hook) goto out;
+    if(__atomic_compare_exchange_n(&ctx->hook, &none, hook, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        err = 0;
 
     out:
     return err;
 }
+
+int taxi_client_register_hook(taxi_hook_t hook)
+{
+    return taxi_client_register_hook_ctx(&g_client_ctx, hook);
+}
@@ -8,20 +8,73 @@
 #include <assert.h>
 #include <sys/socket.h>
 #include "taxi.h"
+#include "taxi_stats.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef int (*taxi_hook_t)(int cmd, struct taxi *customer, struct taxi *taxis, int num_taxis);
+struct taxi_region_delta;
+typedef int (*taxi_region_hook_t)(struct taxi_region_delta *delta);
+typedef int (*taxi_fetch_hook_t)(int err, struct taxi *taxis, int num_taxis, void *arg);
 
 extern int update_taxi_location(struct taxi *taxi);
+extern int update_taxi_locations(struct taxi *taxis, int num_taxis);
 extern int delete_taxi(struct taxi *taxi);
 extern int get_nearest_taxis(double latitude, double longitude,
                              struct taxi **taxis, int *num_taxis);
+extern int get_nearest_taxis_async(double latitude, double longitude,
+                                   taxi_fetch_hook_t hook, void *arg);
 extern int ping_nearby_taxis(struct taxi *customer, struct taxi *taxis, int num_taxis);
+extern int fetch_and_ping_nearby_taxis(struct taxi *customer, struct taxi **taxis, int *num_taxis);
+extern int taxi_client_set_dispatcher_threads(int num_threads);
 extern int taxi_client_initialize(const char *ip, int port);
+extern int taxi_client_connect_stream(void);
+extern int taxi_client_set_compact(int compact);
+extern int taxi_client_set_compress(int compress);
+extern int taxi_client_set_fetch_cache(int max_age, double tolerance);
+extern int taxi_client_set_update_suppression(double bound, int heartbeat);
 extern int taxi_client_register_hook(taxi_hook_t hook);
+extern int get_taxi_server_stats(struct taxi_server_stats *stats);
+extern int subscribe_taxi_region(double latitude_min, double longitude_min,
+                                 double latitude_max, double longitude_max,
+                                 int lease, taxi_region_hook_t hook, unsigned int *p_sub_id);
+extern int renew_taxi_region(unsigned int sub_id);
+extern int unsubscribe_taxi_region(unsigned int sub_id);
+
+/*
+ * Many clients in one process: each context has a socket, customers and
+ * region subscriptions of its own and the contexts share the dispatcher
+ * threads. The calls above act on the context set up by taxi_client_initialize.
+ * Region subscription ids are unique across the contexts.
+ */
+struct taxi_client_ctx;
+
+extern struct taxi_client_ctx *taxi_client_ctx_create(const char *ip, int port);
+extern void taxi_client_ctx_destroy(struct taxi_client_ctx *ctx);
+extern int update_taxi_location_ctx(struct taxi_client_ctx *ctx, struct taxi *taxi);
+extern int update_taxi_locations_ctx(struct taxi_client_ctx *ctx, struct taxi *taxis, int num_taxis);
+extern int delete_taxi_ctx(struct taxi_client_ctx *ctx, struct taxi *taxi);
+extern int get_nearest_taxis_ctx(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                                 struct taxi **taxis, int *num_taxis);
+extern int get_nearest_taxis_async_ctx(struct taxi_client_ctx *ctx, double latitude, double longitude,
+                                       taxi_fetch_hook_t hook, void *arg);
+extern int ping_nearby_taxis_ctx(struct taxi_client_ctx *ctx, struct taxi *customer,
+                                 struct taxi *taxis, int num_taxis);
+extern int fetch_and_ping_nearby_taxis_ctx(struct taxi_client_ctx *ctx, struct taxi *customer,
+                                           struct taxi **taxis, int *num_taxis);
+extern int taxi_client_connect_stream_ctx(struct taxi_client_ctx *ctx);
+extern int taxi_client_set_compact_ctx(struct taxi_client_ctx *ctx, int compact);
+extern int taxi_client_set_compress_ctx(struct taxi_client_ctx *ctx, int compress);
+extern int taxi_client_register_hook_ctx(struct taxi_client_ctx *ctx, taxi_hook_t hook);
+extern int get_taxi_server_stats_ctx(struct taxi_client_ctx *ctx, struct taxi_server_stats *stats);
+extern int subscribe_taxi_region_ctx(struct taxi_client_ctx *ctx,
+                                     double latitude_min, double longitude_min,
+                                     double latitude_max, double longitude_max,
+                                     int lease, taxi_region_hook_t hook, unsigned int *p_sub_id);
+extern int renew_taxi_region_ctx(struct taxi_client_ctx *ctx, unsigned int sub_id);
+extern int unsubscribe_taxi_region_ctx(struct taxi_client_ctx *ctx, unsigned int sub_id);
 
 #ifdef __cplusplus
 }
@@ -20,13 +20,13 @@
 }while(0)
 
 #define __FIND_CUSTOMER(ID, LEN, LIST, FIELD) do {                      \
-    if(!g_num_customers) return NULL;                                   \
+    if(!map->num_customers) return NULL;                                   \
     if(!(ID) || !(LEN))                                                 \
-        return g_customer;                                              \
-    int cmp = g_customer->taxi.id_len - (LEN);                          \
+        return map->customer;                                              \
+    int cmp = map->customer->taxi.id_len - (LEN);                          \
     if(!cmp)                                                            \
-        cmp = memcmp(g_customer->taxi.id, (ID), (LEN));                 \
-    if(!cmp) return g_customer;                                         \
+        cmp = memcmp(map->customer->taxi.id, (ID), (LEN));                 \
+    if(!cmp) return map->customer;                                         \
     struct list_head *__iter ;                                          \
     list_for_each(__iter, list)                                         \
     {                                                                   \
@@ -39,15 +39,8 @@
     return NULL;                                                        \
 }while(0)
 
-static DECLARE_LIST_HEAD(g_customer_list);
-static DECLARE_LIST_HEAD(g_taxi_list);
-static int g_num_customers;
-static int g_num_taxis;
-static struct taxi_customer *g_customer;
-static unsigned char *g_customer_id;
-static unsigned char *g_taxi_id;
-static int g_customer_id_len;
-static int g_taxi_id_len;
+#define CUSTOMER_LOCK(map) do { pthread_mutex_lock(&(map)->lock); }while(0)
+#define CUSTOMER_UNLOCK(map) do { pthread_mutex_unlock(&(map)->lock); }while(0)
 
 struct customer_handle
 {
@@ -61,11 +54,11 @@ struct taxi_handle
     struct list_head taxi_list; /* customers taxi list */
 };
 
-struct taxi *__find_taxi_customer(struct taxi_customer *customer, 
+struct taxi *__find_taxi_customer(struct taxi_customer_map *map, struct taxi_customer *customer, 
                                   unsigned char *id, int id_len,
                                   struct taxi_handle **r_taxi_handle)
 {
-    struct list_head *list = customer ? &customer->taxi_list : &g_taxi_list;
+    struct list_head *list = customer ? &customer->taxi_list : &map->taxi_list;
     if(!customer)
     {
         __FIND_TAXI(id, id_len, list, list);
@@ -86,10 +79,10 @@ struct taxi *__find_taxi_customer(struct taxi_customer *customer,
     return NULL;
 }
 
-static struct taxi_customer *__find_customer_taxi(struct taxi *taxi, unsigned char *id, int id_len,
+static struct taxi_customer *__find_customer_taxi(struct taxi_customer_map *map, struct taxi *taxi, unsigned char *id, int id_len,
                                                   struct customer_handle **r_customer_handle)
 {
-    struct list_head *list = taxi ? &taxi->customer_list : &g_customer_list;
+    struct list_head *list = taxi ? &taxi->customer_list : &map->customer_list;
     if(!taxi)
     {
         __FIND_CUSTOMER(id, id_len, list, list);
@@ -110,14 +103,14 @@ static struct taxi_customer *__find_customer_taxi(struct taxi *taxi, unsigned ch
     return NULL;
 }
 
-static struct taxi_customer *__find_customer(unsigned char *id, int id_len)
+static struct taxi_customer *__find_customer(struct taxi_customer_map *map, unsigned char *id, int id_len)
 {
-    return __find_customer_taxi(NULL, id, id_len, NULL);
+    return __find_customer_taxi(map, NULL, id, id_len, NULL);
 }
 
-static struct taxi *__update_taxi(struct taxi *taxi)
+static struct taxi *__update_taxi(struct taxi_customer_map *map, struct taxi *taxi)
 {
-    struct taxi *loc = __find_taxi_customer(NULL, taxi->id, taxi->id_len, NULL);
+    struct taxi *loc = __find_taxi_customer(map, NULL, taxi->id, taxi->id_len, NULL);
     if(!loc)
     {
         loc = calloc(1, sizeof(*loc));
@@ -125,8 +118,8 @@ static struct taxi *__update_taxi(struct taxi *taxi)
         memcpy(loc, taxi, sizeof(*loc));
         LIST_HEAD_INIT(&loc->customer_list);
         loc->state = _TAXI_STATE_IDLE;
-        list_add_tail(&loc->list, &g_taxi_list);
-        ++g_num_taxis;
+        list_add_tail(&loc->list, &map->taxi_list);
+        ++map->num_taxis;
     }
     else
     {
@@ -142,10 +135,10 @@ static struct taxi *__update_taxi(struct taxi *taxi)
     return loc;
 }
 
-static int __add_taxi(struct taxi *taxi, struct taxi *customer_taxi)
+static int __add_taxi(struct taxi_customer_map *map, struct taxi *taxi, struct taxi *customer_taxi)
 {
-    struct taxi *loc = __update_taxi(taxi);
-    struct taxi_customer *customer = __find_customer(customer_taxi->id, customer_taxi->id_len);
+    struct taxi *loc = __update_taxi(map, taxi);
+    struct taxi_customer *customer = __find_customer(map, customer_taxi->id, customer_taxi->id_len);
     assert(loc != NULL);
     if(!customer)
     {
@@ -153,8 +146,8 @@ static int __add_taxi(struct taxi *taxi, struct taxi *customer_taxi)
         assert(customer != NULL);
         memcpy(&customer->taxi, customer_taxi, sizeof(customer->taxi));
         LIST_HEAD_INIT(&customer->taxi_list);
-        list_add_tail(&customer->list, &g_customer_list);
-        ++g_num_customers;
+        list_add_tail(&customer->list, &map->customer_list);
+        ++map->num_customers;
         struct taxi_handle *taxi_handle = calloc(1, sizeof(*taxi_handle));
         assert(taxi_handle);
         taxi_handle->taxi = loc;
@@ -165,13 +158,13 @@ static int __add_taxi(struct taxi *taxi, struct taxi *customer_taxi)
         customer_handle->customer = customer;
         list_add_tail(&customer_handle->customer_list, &loc->customer_list);
         ++loc->num_customers;
-        if(!g_customer) g_customer = customer;
+        if(!map->customer) map->customer = customer;
     }
     else
     {
         memcpy(&customer->taxi, customer_taxi, sizeof(customer->taxi));
         struct taxi_customer *customer_loc = 
-            __find_customer_taxi(loc, customer_taxi->id, customer_taxi->id_len, NULL);
+            __find_customer_taxi(map, loc, customer_taxi->id, customer_taxi->id_len, NULL);
         if(!customer_loc)
         {
             struct taxi_handle *taxi_handle = calloc(1, sizeof(*taxi_handle));
@@ -189,21 +182,23 @@ static int __add_taxi(struct taxi *taxi, struct taxi *customer_taxi)
     return 0;
 }
 
-int add_taxis_customer(struct taxi *taxi, struct taxi *taxis, int num_taxis)
+int add_taxis_customer(struct taxi_customer_map *map, struct taxi *taxi, struct taxi *taxis, int num_taxis)
 {
+    CUSTOMER_LOCK(map);
     for(int i = 0; i < num_taxis; ++i)
     {
-        __add_taxi(&taxis[i], taxi);
+        __add_taxi(map, &taxis[i], taxi);
     }
+    CUSTOMER_UNLOCK(map);
     return 0;
 }
 
-static int __unlink_customer_taxi(struct taxi *taxi,
+static int __unlink_customer_taxi(struct taxi_customer_map *map, struct taxi *taxi,
                                   struct taxi_customer *customer)
 {
     struct customer_handle *customer_handle = NULL;
     struct taxi_customer *customer_loc = NULL;
-    customer_loc = __find_customer_taxi(taxi, customer->taxi.id, customer->taxi.id_len, &customer_handle);
+    customer_loc = __find_customer_taxi(map, taxi, customer->taxi.id, customer->taxi.id_len, &customer_handle);
     if(!customer_loc) return -1;
     list_del(&customer_handle->customer_list);
     --taxi->num_customers;
@@ -211,12 +206,12 @@ static int __unlink_customer_taxi(struct taxi *taxi,
     return 0;
 }
 
-static int __unlink_taxi_customer(struct taxi_customer *customer,
+static int __unlink_taxi_customer(struct taxi_customer_map *map, struct taxi_customer *customer,
                                   struct taxi *taxi)
 {
     struct taxi_handle *taxi_handle = NULL;
     struct taxi *taxi_loc;
-    taxi_loc = __find_taxi_customer(customer, taxi->id, taxi->id_len, &taxi_handle);
+    taxi_loc = __find_taxi_customer(map, customer, taxi->id, taxi->id_len, &taxi_handle);
     if(!taxi_loc) return -1;
     list_del(&taxi_handle->taxi_list);
     --customer->num_taxis;
@@ -224,7 +219,7 @@ static int __unlink_taxi_customer(struct taxi_customer *customer,
     return 0;
 }
 
-static int __unlink_taxi(struct taxi *taxi)
+static int __unlink_taxi(struct taxi_customer_map *map, struct taxi *taxi)
 {
     struct list_head *iter;
     struct customer_handle *customer_handle = NULL;
@@ -232,7 +227,7 @@ static int __unlink_taxi(struct taxi *taxi)
     {
         iter = taxi->customer_list.next;
         customer_handle = list_entry(iter, struct customer_handle, customer_list);
-        __unlink_taxi_customer(customer_handle->customer, taxi);
+        __unlink_taxi_customer(map, customer_handle->customer, taxi);
         list_del(iter);
         free(customer_handle);
         --taxi->num_customers;
@@ -241,7 +236,7 @@ static int __unlink_taxi(struct taxi *taxi)
     return 0;
 }
 
-static int __unlink_customer(struct taxi_customer *customer)
+static int __unlink_customer(struct taxi_customer_map *map, struct taxi_customer *customer)
 {
     struct list_head *iter;
     struct taxi_handle *taxi_handle = NULL;
@@ -249,7 +244,7 @@ static int __unlink_customer(struct taxi_customer *customer)
     {
         iter = customer->taxi_list.next;
         taxi_handle = list_entry(iter, struct taxi_handle, taxi_list);
-        __unlink_customer_taxi(taxi_handle->taxi, customer);
+        __unlink_customer_taxi(map, taxi_handle->taxi, customer);
         list_del(iter);
         free(taxi_handle);
         --customer->num_taxis;
@@ -258,19 +253,21 @@ static int __unlink_customer(struct taxi_customer *customer)
     return 0;
 }
 
-int del_taxi_customer(unsigned char *taxi_id, int taxi_id_len,
+int del_taxi_customer(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len,
                       unsigned char *customer_id, int customer_id_len,
                       struct taxi *result)
 {
+    int err = -1;
     struct taxi_customer *customer = NULL;
     struct taxi_handle *taxi_handle = NULL;
+    CUSTOMER_LOCK(map);
     if(customer_id && customer_id_len)
     {
-        customer = __find_customer(customer_id, customer_id_len);
-        if(!customer) return -1;
+        customer = __find_customer(map, customer_id, customer_id_len);
+        if(!customer) goto out_unlock;
     }
-    struct taxi *taxi = __find_taxi_customer(customer, taxi_id, taxi_id_len, &taxi_handle);
-    if(!taxi) return -1;
+    struct taxi *taxi = __find_taxi_customer(map, customer, taxi_id, taxi_id_len, &taxi_handle);
+    if(!taxi) goto out_unlock;
 
     if(result)
     {
@@ -283,40 +280,46 @@ int del_taxi_customer(unsigned char *taxi_id, int taxi_id_len,
         assert(taxi_handle != NULL && taxi_handle->taxi == taxi);
         list_del(&taxi_handle->taxi_list);
         free(taxi_handle);
-        __unlink_customer_taxi(taxi, customer);
+        __unlink_customer_taxi(map, taxi, customer);
     }
     else
     {
-        __unlink_taxi(taxi);
+        __unlink_taxi(map, taxi);
         list_del(&taxi->list);
-        --g_num_taxis;
+        --map->num_taxis;
         free(taxi);
     }
-    return 0;
+    err = 0;
+
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
+    return err;
 }
 
-int find_taxi_customer(unsigned char *taxi_id, int id_len,
+int find_taxi_customer(struct taxi_customer_map *map, unsigned char *taxi_id, int id_len,
                        unsigned char *customer_id, int customer_id_len, struct taxi *result)
 {
     int err = -1;
     struct taxi *taxi = NULL;
     struct taxi_customer *customer = NULL;
+    CUSTOMER_LOCK(map);
     if(customer_id && customer_id_len > 0)
     {
-        customer = __find_customer(customer_id, customer_id_len);
-        if(!customer) goto out;
+        customer = __find_customer(map, customer_id, customer_id_len);
+        if(!customer) goto out_unlock;
     }
-    taxi = __find_taxi_customer(customer, taxi_id, id_len, NULL);
-    if(!taxi) goto out;
+    taxi = __find_taxi_customer(map, customer, taxi_id, id_len, NULL);
+    if(!taxi) goto out_unlock;
     if(result)
         memcpy(result, taxi, sizeof(*result));
     err = 0;
 
-    out:
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
     return err;
 }
 
-int find_taxi_by_hint(short port, struct taxi *res)
+int find_taxi_by_hint(struct taxi_customer_map *map, short port, struct taxi *res)
 {
     int err = -1;
     if(!port || !res) goto out;
@@ -324,7 +327,8 @@ int find_taxi_by_hint(short port, struct taxi *res)
     int num_addrs = 0;
     get_if_addrs(&addrs, &num_addrs);
     struct list_head *iter;
-    list_for_each(iter, &g_taxi_list)
+    CUSTOMER_LOCK(map);
+    list_for_each(iter, &map->taxi_list)
     {
         struct taxi *taxi = list_entry(iter, struct taxi, list);
         if(taxi->addr.sin_port != port) continue;
@@ -341,31 +345,35 @@ int find_taxi_by_hint(short port, struct taxi *res)
     }
 
     out_free:
+    CUSTOMER_UNLOCK(map);
     if(addrs) free(addrs);
     out:
     return err;
 }
 
-int find_customer_taxi(unsigned char *taxi_id, int taxi_id_len,
+int find_customer_taxi(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len,
                        unsigned char *customer_id, int customer_id_len,
                        struct taxi_customer *r_customer)
 {
     int err = -1;
     if(!taxi_id || !taxi_id_len) goto out;
     if(!customer_id || !customer_id_len) goto out;
-    struct taxi_customer *customer = __find_customer(customer_id, customer_id_len);
-    if(!customer) goto out;
-    struct taxi *taxi = __find_taxi_customer(customer, taxi_id, taxi_id_len, NULL);
-    if(!taxi) goto out;
+    CUSTOMER_LOCK(map);
+    struct taxi_customer *customer = __find_customer(map, customer_id, customer_id_len);
+    if(!customer) goto out_unlock;
+    struct taxi *taxi = __find_taxi_customer(map, customer, taxi_id, taxi_id_len, NULL);
+    if(!taxi) goto out_unlock;
     if(r_customer)
         memcpy(r_customer, customer, sizeof(*r_customer));
 
     err = 0;
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
     out:
     return err;
 }
 
-int update_taxi_state_customer(unsigned char *taxi_id, int taxi_id_len, 
+int update_taxi_state_customer(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len, 
                                unsigned char *customer_id, int customer_id_len, int new_state)
 {
     int err = -1;
@@ -373,13 +381,14 @@ int update_taxi_state_customer(unsigned char *taxi_id, int taxi_id_len,
         goto out;
     struct taxi *taxi = NULL;
     struct taxi_customer *customer = NULL;
+    CUSTOMER_LOCK(map);
     if(customer_id && customer_id_len > 0)
     {
-        customer = __find_customer(customer_id, customer_id_len);
-        if(!customer) goto out;
+        customer = __find_customer(map, customer_id, customer_id_len);
+        if(!customer) goto out_unlock;
     }
-    taxi = __find_taxi_customer(customer, taxi_id, taxi_id_len, NULL);
-    if(!taxi) goto out;
+    taxi = __find_taxi_customer(map, customer, taxi_id, taxi_id_len, NULL);
+    if(!taxi) goto out_unlock;
     int old_state = taxi->state;
     if(old_state == _TAXI_STATE_IDLE
        &&
@@ -397,44 +406,51 @@ int update_taxi_state_customer(unsigned char *taxi_id, int taxi_id_len,
     taxi->state = new_state;
     err = 0;
 
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
     out:
     return err;
 }
 
-int get_taxi_state(unsigned char *id, int id_len, int *r_state)
+int get_taxi_state(struct taxi_customer_map *map, unsigned char *id, int id_len, int *r_state)
 {
     struct taxi *taxi = NULL;
     int err = -1;
     if(!r_state) goto out;
-    taxi = __find_taxi_customer(NULL, id, id_len, NULL);
-    if(!taxi) goto out;
+    CUSTOMER_LOCK(map);
+    taxi = __find_taxi_customer(map, NULL, id, id_len, NULL);
+    if(!taxi) goto out_unlock;
 
     *r_state = taxi->state;
     err = 0;
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
     out:
     return err;
 }
 
-int del_customer(unsigned char *id, int id_len)
+int del_customer(struct taxi_customer_map *map, unsigned char *id, int id_len)
 {
     int err = -1;
-    struct taxi_customer *customer = __find_customer(id, id_len);
-    if(!customer) goto out;
-    __unlink_customer(customer);
+    CUSTOMER_LOCK(map);
+    struct taxi_customer *customer = __find_customer(map, id, id_len);
+    if(!customer) goto out_unlock;
+    __unlink_customer(map, customer);
     list_del(&customer->list);
-    --g_num_customers;
-    if(g_num_customers > 0)
+    --map->num_customers;
+    if(map->num_customers > 0)
     {
-        if(customer == g_customer)
+        if(customer == map->customer)
         {
-            g_customer = list_entry(g_customer_list.next, struct taxi_customer, list);
+            map->customer = list_entry(map->customer_list.next, struct taxi_customer, list);
         }
     }
-    else g_customer = NULL;
+    else map->customer = NULL;
     free(customer);
     err = 0;
 
-    out:
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
     return err;
 }
 
@@ -461,27 +477,37 @@ static int __set_id(unsigned char *id, int id_len,
 /*
  * Not expected to change 
  */
-int set_customer_id(unsigned char *customer_id, int customer_id_len)
+int set_customer_id(struct taxi_customer_map *map, unsigned char *customer_id, int customer_id_len)
 {
+    int err = -1;
     if(customer_id && customer_id_len > 0)
-        return __set_id(customer_id, customer_id_len, &g_customer_id, &g_customer_id_len);
-    return -1;
+    {
+        CUSTOMER_LOCK(map);
+        err = __set_id(customer_id, customer_id_len, &map->customer_id, &map->customer_id_len);
+        CUSTOMER_UNLOCK(map);
+    }
+    return err;
 }
 
 /*
  * Not expected to change. 
  */
-int set_taxi_id(unsigned char *taxi_id, int taxi_id_len)
+int set_taxi_id(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len)
 {
+    int err = -1;
     if(taxi_id && taxi_id_len > 0)
-        return __set_id(taxi_id, taxi_id_len, &g_taxi_id, &g_taxi_id_len);
-    return -1;
+    {
+        CUSTOMER_LOCK(map);
+        err = __set_id(taxi_id, taxi_id_len, &map->taxi_id, &map->taxi_id_len);
+        CUSTOMER_UNLOCK(map);
+    }
+    return err;
 }
 
 /*
  * Filter is 0 for match and -1 for no match based on the hint.
  */
-static int get_taxis_customer_filter(unsigned char *id, int id_len,
+static int get_taxis_customer_filter(struct taxi_customer_map *map, unsigned char *id, int id_len,
                                      short port,
                                      int filter,
                                      struct taxi **p_taxis, int *p_num_taxis)
@@ -491,11 +517,12 @@ static int get_taxis_customer_filter(unsigned char *id, int id_len,
     struct taxi_customer *customer = NULL;
     struct taxi *taxis = NULL;
     int num_taxis = 0;
-    customer = __find_customer(id, id_len);
-    if(!customer) goto out;
     struct list_head *iter;
     struct sockaddr *addrs = NULL;
     int num_addrs = 0;
+    CUSTOMER_LOCK(map);
+    customer = __find_customer(map, id, id_len);
+    if(!customer) goto out_unlock;
 
     list_for_each(iter, &customer->taxi_list)
     {
@@ -506,7 +533,7 @@ static int get_taxis_customer_filter(unsigned char *id, int id_len,
         if(!port)
             goto do_copy;
 
-        if(!g_taxi_id  || !g_taxi_id_len)
+        if(!map->taxi_id  || !map->taxi_id_len)
         {
             if(!addrs)
             {
@@ -532,9 +559,9 @@ static int get_taxis_customer_filter(unsigned char *id, int id_len,
         }
         else
         {
-            cmp = g_taxi_id_len - target->id_len;
+            cmp = map->taxi_id_len - target->id_len;
             if(!cmp)
-                cmp = memcmp(g_taxi_id, target->id, g_taxi_id_len);
+                cmp = memcmp(map->taxi_id, target->id, map->taxi_id_len);
             if(cmp) cmp = -1;
         }
 
@@ -552,31 +579,33 @@ static int get_taxis_customer_filter(unsigned char *id, int id_len,
     *p_taxis = taxis;
     *p_num_taxis = num_taxis;
     if(addrs) free(addrs);
-    
+
+    out_unlock:
+    CUSTOMER_UNLOCK(map);
     out:
     return err;
 }
 
-int get_taxis_excluding_self_customer(unsigned char *id, int id_len, short hint,
+int get_taxis_excluding_self_customer(struct taxi_customer_map *map, unsigned char *id, int id_len, short hint,
                                       struct taxi **p_taxis, int *p_num_taxis)
 {
-    return get_taxis_customer_filter(id, id_len, hint, -1, p_taxis, p_num_taxis);
+    return get_taxis_customer_filter(map, id, id_len, hint, -1, p_taxis, p_num_taxis);
 }
 
-int get_taxis_customer(unsigned char *id, int id_len, 
+int get_taxis_customer(struct taxi_customer_map *map, unsigned char *id, int id_len, 
                        struct taxi **p_taxis, int *p_num_taxis)
 {
-    return get_taxis_customer_filter(id, id_len, 0, -1, p_taxis, p_num_taxis);
+    return get_taxis_customer_filter(map, id, id_len, 0, -1, p_taxis, p_num_taxis);
 }
 
-int get_taxi_matching_self_customer(unsigned char *id, int id_len, 
+int get_taxi_matching_self_customer(struct taxi_customer_map *map, unsigned char *id, int id_len, 
                                     short hint, struct taxi *self)
 {
     int err = -1;
     if(!self) goto out;
     struct taxi *taxis = NULL;
     int num_taxis = 0;
-    err = get_taxis_customer_filter(id, id_len, hint, 0, &taxis, &num_taxis);
+    err = get_taxis_customer_filter(map, id, id_len, hint, 0, &taxis, &num_taxis);
     if(err < 0) goto out;
     if(!num_taxis) 
     {
@@ -590,14 +619,47 @@ int get_taxi_matching_self_customer(unsigned char *id, int id_len,
     return err;
 }
 
-int get_taxis_approaching_customer(unsigned char *id, int id_len)
+int get_taxis_approaching_customer(struct taxi_customer_map *map, unsigned char *id, int id_len)
 {
     int num_approaching = 0;
     struct taxi_customer *customer;
     if(!id || !id_len) goto out;
-    customer = __find_customer(id, id_len);
-    if(!customer) goto out;
-    num_approaching = customer->num_approaching;
+    CUSTOMER_LOCK(map);
+    customer = __find_customer(map, id, id_len);
+    if(customer)
+        num_approaching = customer->num_approaching;
+    CUSTOMER_UNLOCK(map);
     out:
     return num_approaching;
 }
+
+int taxi_customer_map_init(struct taxi_customer_map *map)
+{
+    memset(map, 0, sizeof(*map));
+    LIST_HEAD_INIT(&map->customer_list);
+    LIST_HEAD_INIT(&map->taxi_list);
+    pthread_mutex_init(&map->lock, NULL);
+    return 0;
+}
+
+void taxi_customer_map_destroy(struct taxi_customer_map *map)
+{
+    CUSTOMER_LOCK(map);
+    while(!LIST_EMPTY(&map->customer_list))
+    {
+        struct taxi_customer *customer = list_entry(map->customer_list.next, struct taxi_customer, list);
+        __unlink_customer(map, customer);
+        list_del(&customer->list);
+        free(customer);
+    }
+    while(!LIST_EMPTY(&map->taxi_list))
+    {
+        struct taxi *taxi = list_entry(map->taxi_list.next, struct taxi, list);
+        list_del(&taxi->list);
+        free(taxi);
+    }
+    if(map->customer_id) free(map->customer_id);
+    if(map->taxi_id) free(map->taxi_id);
+    CUSTOMER_UNLOCK(map);
+    pthread_mutex_destroy(&map->lock);
+}
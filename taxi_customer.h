@@ -1,6 +1,7 @@
 #ifndef _TAXI_CUSTOMER_H_
 #define _TAXI_CUSTOMER_H_
 
+#include <pthread.h>
 #include "taxi.h"
 #include "list.h"
 
@@ -18,36 +19,56 @@ struct taxi_customer
     int num_approaching;
 };
 
-extern int add_taxis_customer(struct taxi *customer, struct taxi *taxis, int num_taxis);
-extern int del_taxi_customer(unsigned char *taxi_id, int taxi_id_len,
+/*
+ * The customers and the taxis matched for them, of a client context.
+ */
+struct taxi_customer_map
+{
+    struct list_head customer_list;
+    struct list_head taxi_list;
+    int num_customers;
+    int num_taxis;
+    struct taxi_customer *customer;
+    unsigned char *customer_id;
+    unsigned char *taxi_id;
+    int customer_id_len;
+    int taxi_id_len;
+    pthread_mutex_t lock;
+};
+
+extern int taxi_customer_map_init(struct taxi_customer_map *map);
+extern void taxi_customer_map_destroy(struct taxi_customer_map *map);
+
+extern int add_taxis_customer(struct taxi_customer_map *map, struct taxi *customer, struct taxi *taxis, int num_taxis);
+extern int del_taxi_customer(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len,
                              unsigned char *id, int id_len, struct taxi *result);
-extern int find_taxi_customer(unsigned char *taxi_id, int taxi_id_len,
+extern int find_taxi_customer(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len,
                               unsigned char *id, int id_len, struct taxi *result);
 
-extern int find_taxi_by_hint(short port, struct taxi *result);
+extern int find_taxi_by_hint(struct taxi_customer_map *map, short port, struct taxi *result);
 
-extern int find_customer_taxi(unsigned char *taxi_id, int taxi_id_len,
+extern int find_customer_taxi(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len,
                               unsigned char *customer_id, int customer_id_len,
                               struct taxi_customer *r_customer);
 
-extern int update_taxi_state_customer(unsigned char *taxi_id, int taxi_id_len,
+extern int update_taxi_state_customer(struct taxi_customer_map *map, unsigned char *taxi_id, int taxi_id_len,
                                       unsigned char *customer_id, int customer_id_len, int new_state);
-extern int get_taxi_state(unsigned char *id, int id_len, int *r_state);
+extern int get_taxi_state(struct taxi_customer_map *map, unsigned char *id, int id_len, int *r_state);
 
-extern int del_customer(unsigned char *id, int id_len);
+extern int del_customer(struct taxi_customer_map *map, unsigned char *id, int id_len);
 
-extern int get_taxis_excluding_self_customer(unsigned char *id, int id_len, short hint,
+extern int get_taxis_excluding_self_customer(struct taxi_customer_map *map, unsigned char *id, int id_len, short hint,
                                              struct taxi **p_taxis, int *p_num_taxis);
 
-extern int get_taxis_customer(unsigned char *id, int id_len, struct taxi **p_taxis, int *p_num_taxis);
+extern int get_taxis_customer(struct taxi_customer_map *map, unsigned char *id, int id_len, struct taxi **p_taxis, int *p_num_taxis);
 
-extern int get_taxi_matching_self_customer(unsigned char *id, int id_len, short hint, struct taxi *self);
+extern int get_taxi_matching_self_customer(struct taxi_customer_map *map, unsigned char *id, int id_len, short hint, struct taxi *self);
 
-extern int set_taxi_id(unsigned char *id, int id_len);
+extern int set_taxi_id(struct taxi_customer_map *map, unsigned char *id, int id_len);
 
-extern int set_customer_id(unsigned char *id, int id_len);
+extern int set_customer_id(struct taxi_customer_map *map, unsigned char *id, int id_len);
 
-extern int get_taxis_approaching_customer(unsigned char *id, int id_len);
+extern int get_taxis_approaching_customer(struct taxi_customer_map *map, unsigned char *id, int id_len);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <getopt.h>
+#include "taxi.h"
+#include "taxi_pack.h"
+#include "taxi_stats.h"
+#include "taxi_lz.h"
+
+/*
+ * Malformed buffers through every unpack entry point. Built with the sanitizers
+ * it mutates valid encodings for the given rounds or replays the corpus files given.
+ * Built with -fsanitize=fuzzer -DTAXI_LIBFUZZER libFuzzer drives the same entry.
+ * Unpacking may fail but must stay within the buffer and agree with itself.
+ */
+#define _FUZZ_ROUNDS (200000)
+#define _FUZZ_MAX_LEN (__MAX_PACKET_LEN)
+
+static struct taxi_server_stats fuzz_stats;
+static unsigned char fuzz_out[_FUZZ_MAX_LEN];
+
+static void fuzz_view(struct taxi_view *view)
+{
+    struct taxi_view_entry entry;
+    struct taxi taxi;
+    int n = 0;
+    while(taxi_view_next(view, &entry))
+    {
+        taxi_view_entry_copy(&entry, &taxi);
+        assert(taxi.id_len >= 0 && taxi.id_len <= MAX_ID_LEN);
+        ++n;
+    }
+    assert(n == view->num_taxis);
+}
+
+static void fuzz_taxis(struct taxi *taxis, int num_taxis, int len, int p_len)
+{
+    assert(p_len >= 0 && p_len <= len);
+    assert(num_taxis >= 0 && num_taxis <= len);
+    for(int i = 0; i < num_taxis; ++i)
+        assert(taxis[i].id_len >= 0 && taxis[i].id_len <= MAX_ID_LEN);
+    if(taxis) free(taxis);
+}
+
+static void fuzz_one(unsigned char *buf, int len)
+{
+    struct taxi taxi, *taxis;
+    struct taxi_view view;
+    struct taxi_region_delta delta;
+    int num_taxis, p_len;
+
+    /*
+     * Unpacking a taxi only fills in the fields found, like the callers expect.
+     */
+    memset(&taxi, 0, sizeof(taxi));
+    p_len = len;
+    if(!taxi_unpack(buf, &p_len, &taxi))
+    {
+        assert(p_len >= 0 && p_len <= len);
+        assert(taxi.id_len >= 0 && taxi.id_len <= MAX_ID_LEN);
+    }
+    for(int compact = 0; compact < 2; ++compact)
+    {
+        p_len = len;
+        taxis = NULL;
+        num_taxis = 0;
+        if(!(compact ? taxis_v2_unpack : taxis_unpack)(buf, &p_len, &taxis, &num_taxis))
+            fuzz_taxis(taxis, num_taxis, len, p_len);
+        p_len = len;
+        if(!taxis_view_init(&view, buf, &p_len, compact))
+        {
+            fuzz_view(&view);
+            taxi_view_rewind(&view);
+            fuzz_view(&view);
+        }
+    }
+    p_len = len;
+    taxis = NULL;
+    num_taxis = 0;
+    if(!taxi_list_unpack(buf, &p_len, &taxis, &num_taxis))
+        fuzz_taxis(taxis, num_taxis, len, p_len);
+    memset(&taxi, 0, sizeof(taxi));
+    p_len = len;
+    taxis = NULL;
+    num_taxis = 0;
+    if(!taxis_ping_unpack(buf, &p_len, &taxi, &taxis, &num_taxis))
+        fuzz_taxis(taxis, num_taxis, len, p_len);
+    p_len = len;
+    if(!taxi_list_view_init(&view, buf, &p_len))
+        fuzz_view(&view);
+    p_len = len;
+    if(!taxis_ping_view_init(&view, buf, &p_len, &taxi))
+        fuzz_view(&view);
+    p_len = len;
+    if(!taxi_region_delta_unpack(buf, &p_len, &delta))
+    {
+        assert(p_len >= 0 && p_len <= len);
+        taxi_region_delta_free(&delta);
+    }
+    p_len = len;
+    if(!taxi_stats_unpack(buf, &p_len, &fuzz_stats))
+        assert(p_len >= 0 && p_len <= len && fuzz_stats.num_cmds <= _TAXI_STATS_MAX_CMDS);
+    if(len > 0)
+        assert(taxi_lz_decompress(buf, len, fuzz_out, sizeof(fuzz_out)) <= (int)sizeof(fuzz_out));
+}
+
+/*
+ * The input goes into a buffer of its own size for the sanitizers to catch overreads.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(size > _FUZZ_MAX_LEN) return 0;
+    unsigned char *buf = malloc(size ? size : 1);
+    assert(buf);
+    memcpy(buf, data, size);
+    fuzz_one(buf, size);
+    free(buf);
+    return 0;
+}
+
+#ifndef TAXI_LIBFUZZER
+
+struct fuzz_seed
+{
+    unsigned char *buf;
+    int len;
+};
+
+static uint64_t fuzz_state = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int fuzz_rand(void)
+{
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 7;
+    fuzz_state ^= fuzz_state << 17;
+    return (unsigned int)(fuzz_state >> 16);
+}
+
+static void add_seed(struct fuzz_seed *seeds, int *num_seeds, unsigned char *buf, int len)
+{
+    seeds[*num_seeds].buf = buf;
+    seeds[*num_seeds].len = len;
+    ++*num_seeds;
+}
+
+/*
+ * Valid encodings of every kind for the mutations to start from.
+ */
+static int make_seeds(struct fuzz_seed *seeds)
+{
+    static struct taxi taxis[16];
+    struct taxi customer = { .latitude = 37.75, .longitude = -122.45 };
+    struct taxi_region_delta delta;
+    struct taxi_server_stats *stats = calloc(1, sizeof(*stats));
+    int num_seeds = 0, len;
+    unsigned char *buf;
+    assert(stats);
+    for(int i = 0; i < 16; ++i)
+    {
+        taxis[i].id_len = snprintf((char*)taxis[i].id, sizeof(taxis[i].id), "taxi%d", i * 7919);
+        taxis[i].latitude = 37.7 + i / 1000.0;
+        taxis[i].longitude = -122.4 - i / 1000.0;
+        taxis[i].state = _TAXI_STATE_IDLE;
+        taxis[i].addr.sin_addr.s_addr = htonl(0x7f000001);
+        taxis[i].addr.sin_port = htons(20000 + i);
+    }
+    taxis[3].id_len = 0; /* location only */
+    customer.id_len = snprintf((char*)customer.id, sizeof(customer.id), "customer");
+
+    len = 0;
+    add_seed(seeds, &num_seeds, taxi_pack_with_buf(&taxis[0], NULL, &len, 0), len);
+    len = sizeof(unsigned int) + taxis_packed_size(taxis, 16);
+    buf = malloc(len);
+    assert(buf);
+    *(unsigned int*)buf = htonl(16);
+    taxis_encode(taxis, 16, buf + sizeof(unsigned int));
+    add_seed(seeds, &num_seeds, buf, len);
+    len = 0;
+    add_seed(seeds, &num_seeds, taxi_list_pack_with_buf(taxis, 16, NULL, &len, 0), len);
+    len = 0;
+    add_seed(seeds, &num_seeds, taxis_ping_pack_with_buf(&customer, taxis, 16, NULL, &len, 0), len);
+
+    buf = malloc(sizeof(unsigned int) * 2 + _TAXI_V2_HEADER_LEN + 16 * _TAXI_V2_MAX_ENTRY_LEN);
+    assert(buf);
+    int ref_latitude = taxi_v2_coord(customer.latitude);
+    int ref_longitude = taxi_v2_coord(customer.longitude);
+    unsigned char *s = buf;
+    *(unsigned int*)s = htonl(_TAXI_LIST_CMD | _TAXI_CMD_V2);
+    *(unsigned int*)(s + sizeof(unsigned int)) = htonl(16);
+    *(unsigned int*)(s + 2*sizeof(unsigned int)) = htonl(ref_latitude);
+    *(unsigned int*)(s + 3*sizeof(unsigned int)) = htonl(ref_longitude);
+    s += 2*sizeof(unsigned int) + _TAXI_V2_HEADER_LEN;
+    for(int i = 0; i < 16; ++i)
+        s += taxi_v2_pack_entry(&taxis[i], ref_latitude, ref_longitude, s);
+    add_seed(seeds, &num_seeds, buf, s - buf);
+    /*
+     * The compact list without its command word for the bare v2 entry points.
+     */
+    len = s - buf - sizeof(unsigned int);
+    unsigned char *v2 = malloc(len);
+    assert(v2);
+    memcpy(v2, buf + sizeof(unsigned int), len);
+    add_seed(seeds, &num_seeds, v2, len);
+
+    memset(&delta, 0, sizeof(delta));
+    delta.sub_id = 1;
+    delta.seq = 2;
+    delta.entered = taxis;
+    delta.num_entered = 4;
+    delta.moved = taxis + 4;
+    delta.num_moved = 4;
+    delta.left = taxis + 8;
+    delta.num_left = 2;
+    len = 0;
+    add_seed(seeds, &num_seeds, taxi_region_delta_pack_with_buf(&delta, NULL, &len, 0), len);
+
+    stats->uptime = 1000;
+    stats->num_cmds = 2;
+    stats->cmds[0].cmd = _TAXI_LOCATION_CMD;
+    taxi_hist_record(&stats->cmds[0].latency, 42);
+    stats->cmds[1].cmd = _TAXI_FETCH_CMD;
+    taxi_hist_record(&stats->cmds[1].latency, 4242);
+    len = 0;
+    add_seed(seeds, &num_seeds, taxi_stats_pack_with_buf(stats, NULL, &len, 0), len);
+    free(stats);
+
+    buf = malloc(_FUZZ_MAX_LEN);
+    assert(buf);
+    len = taxi_lz_compress(seeds[2].buf, seeds[2].len, buf, _FUZZ_MAX_LEN);
+    assert(len > 0);
+    add_seed(seeds, &num_seeds, buf, len);
+    return num_seeds;
+}
+
+/*
+ * Flip bits, stomp words with tags, lengths and counts that have bitten before
+ * and cut or grow the buffer.
+ */
+static int mutate(unsigned char *buf, int len, int max_len)
+{
+    static const unsigned int words[] = {
+        0, 1, 2, 3, 4, 0x7fffffff, 0x80000000, 0xfffffffc, 0xffffffff, MAX_ID_LEN + 1,
+        _TAXI_LIST_CMD, _TAXI_LIST_CMD | _TAXI_CMD_V2,
+    };
+    int mutations = 1 + fuzz_rand() % 4;
+    for(int m = 0; m < mutations; ++m)
+    {
+        switch(fuzz_rand() % 5)
+        {
+        case 0:
+            if(len) buf[fuzz_rand() % len] ^= 1 << (fuzz_rand() % 8);
+            break;
+
+        case 1:
+            if(len) buf[fuzz_rand() % len] = fuzz_rand();
+            break;
+
+        case 2:
+            if(len >= (int)sizeof(unsigned int))
+            {
+                int offset = (fuzz_rand() % (len / sizeof(unsigned int))) * sizeof(unsigned int);
+                unsigned int word = words[fuzz_rand() % (sizeof(words)/sizeof(words[0]))];
+                if(fuzz_rand() & 1) word = len - offset + (int)(fuzz_rand() % 9) - 4;
+                *(unsigned int*)(buf + offset) = htonl(word);
+            }
+            break;
+
+        case 3:
+            if(len) len = fuzz_rand() % len;
+            break;
+
+        case 4:
+            {
+                int grow = fuzz_rand() % 64;
+                if(len + grow > max_len) grow = max_len - len;
+                for(int i = 0; i < grow; ++i)
+                    buf[len + i] = fuzz_rand();
+                len += grow;
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static int replay(const char *fname)
+{
+    static unsigned char buf[_FUZZ_MAX_LEN];
+    FILE *fptr = fopen(fname, "r");
+    if(!fptr)
+    {
+        output("Unable to open file [%s]\n", fname);
+        return -1;
+    }
+    int len = fread(buf, 1, sizeof(buf), fptr);
+    fclose(fptr);
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+static char *prog;
+
+static void usage(void)
+{
+    fprintf(stderr, "%s [ -n | rounds ] [ -s | seed ] [ -h | this help ] [ corpus files ]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct fuzz_seed seeds[16];
+    static unsigned char buf[_FUZZ_MAX_LEN];
+    int rounds = _FUZZ_ROUNDS;
+    int c;
+    char *s;
+    prog = argv[0];
+    if( (s = strrchr(prog, '/') ) )
+        prog = s+1;
+    opterr = 0;
+    while( (c = getopt(argc, argv, "n:s:h") ) != EOF )
+    {
+        switch(c)
+        {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+
+        case 's':
+            fuzz_state = strtoull(optarg, NULL, 0);
+            if(!fuzz_state) usage();
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            usage();
+        }
+    }
+    if(optind != argc)
+    {
+        for(int i = optind; i < argc; ++i)
+            if(replay(argv[i]) < 0) return 1;
+        printf("Replayed [%d] inputs\n", argc - optind);
+        return 0;
+    }
+    int num_seeds = make_seeds(seeds);
+    for(int i = 0; i < num_seeds; ++i)
+        LLVMFuzzerTestOneInput(seeds[i].buf, seeds[i].len);
+    for(int i = 0; i < rounds; ++i)
+    {
+        struct fuzz_seed *seed = &seeds[fuzz_rand() % num_seeds];
+        memcpy(buf, seed->buf, seed->len);
+        int len = mutate(buf, seed->len, sizeof(buf));
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("Fuzzed [%d] rounds over [%d] seeds\n", rounds, num_seeds);
+    for(int i = 0; i < num_seeds; ++i)
+        free(seeds[i].buf);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "taxi_lz.h"
+
+#define _LZ_MIN_MATCH (4)
+#define _LZ_MAX_OFFSET (0xffff)
+#define _LZ_HASH_BITS (12)
+#define _LZ_LEN_MASK (0xf)
+
+static uint32_t read32(const unsigned char *s)
+{
+    uint32_t v;
+    memcpy(&v, s, sizeof(v));
+    return v;
+}
+
+static unsigned int lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - _LZ_HASH_BITS);
+}
+
+/*
+ * Lengths past the token nibble continue in bytes of 255 and a final remainder.
+ */
+static int put_length(unsigned char **d, unsigned char *end, int len)
+{
+    for(; len >= 0xff; len -= 0xff)
+    {
+        if(*d >= end) return -1;
+        *(*d)++ = 0xff;
+    }
+    if(*d >= end) return -1;
+    *(*d)++ = len;
+    return 0;
+}
+
+static int get_length(const unsigned char **s, const unsigned char *end, int *p_len)
+{
+    unsigned int b;
+    do
+    {
+        if(*s >= end) return -1;
+        b = *(*s)++;
+        *p_len += b;
+        if(*p_len < 0) return -1;
+    } while(b == 0xff);
+    return 0;
+}
+
+static int put_sequence(unsigned char **d, unsigned char *end,
+                        const unsigned char *literals, int num_literals,
+                        int offset, int match_len)
+{
+    unsigned char *token = *d;
+    if(*d >= end) return -1;
+    ++*d;
+    *token = (num_literals < _LZ_LEN_MASK ? num_literals : _LZ_LEN_MASK) << 4;
+    if(num_literals >= _LZ_LEN_MASK
+       &&
+       put_length(d, end, num_literals - _LZ_LEN_MASK) < 0)
+        return -1;
+    if(end - *d < num_literals) return -1;
+    memcpy(*d, literals, num_literals);
+    *d += num_literals;
+    if(!match_len) return 0; /* last sequence */
+    if(end - *d < 2) return -1;
+    *(*d)++ = offset & 0xff;
+    *(*d)++ = offset >> 8;
+    match_len -= _LZ_MIN_MATCH;
+    *token |= match_len < _LZ_LEN_MASK ? match_len : _LZ_LEN_MASK;
+    if(match_len >= _LZ_LEN_MASK
+       &&
+       put_length(d, end, match_len - _LZ_LEN_MASK) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Greedy match against the last position with the same hash of 4 bytes.
+ */
+int taxi_lz_compress(const unsigned char *src, int len, unsigned char *dst, int cap)
+{
+    int table[1 << _LZ_HASH_BITS];
+    unsigned char *d = dst, *end = dst + cap;
+    int anchor = 0, i = 0;
+    if(len < 0 || cap < 0) return -1;
+    memset(table, 0xff, sizeof(table));
+    while(i + _LZ_MIN_MATCH <= len)
+    {
+        uint32_t seq = read32(src + i);
+        unsigned int h = lz_hash(seq);
+        int candidate = table[h];
+        table[h] = i;
+        if(candidate < 0 || i - candidate > _LZ_MAX_OFFSET || read32(src + candidate) != seq)
+        {
+            ++i;
+            continue;
+        }
+        int match_len = _LZ_MIN_MATCH;
+        while(i + match_len < len && src[candidate + match_len] == src[i + match_len])
+            ++match_len;
+        if(put_sequence(&d, end, src + anchor, i - anchor, i - candidate, match_len) < 0)
+            return -1;
+        i += match_len;
+        anchor = i;
+    }
+    if(put_sequence(&d, end, src + anchor, len - anchor, 0, 0) < 0)
+        return -1;
+    return d - dst;
+}
+
+int taxi_lz_decompress(const unsigned char *src, int len, unsigned char *dst, int cap)
+{
+    const unsigned char *s = src, *end = src + len;
+    unsigned char *d = dst;
+    if(len <= 0 || cap < 0) return -1;
+    while(s < end)
+    {
+        unsigned int token = *s++;
+        int num_literals = token >> 4;
+        if(num_literals == _LZ_LEN_MASK && get_length(&s, end, &num_literals) < 0)
+            return -1;
+        if(end - s < num_literals || dst + cap - d < num_literals)
+            return -1;
+        memcpy(d, s, num_literals);
+        s += num_literals;
+        d += num_literals;
+        if(s == end) break; /* last sequence */
+        if(end - s < 2) return -1;
+        int offset = s[0] | s[1] << 8;
+        s += 2;
+        int match_len = token & _LZ_LEN_MASK;
+        if(match_len == _LZ_LEN_MASK && get_length(&s, end, &match_len) < 0)
+            return -1;
+        match_len += _LZ_MIN_MATCH;
+        if(!offset || offset > d - dst || dst + cap - d < match_len)
+            return -1;
+        /*
+         * Byte by byte as the match may overlap what it produces.
+         */
+        const unsigned char *match = d - offset;
+        for(int i = 0; i < match_len; ++i)
+            d[i] = match[i];
+        d += match_len;
+    }
+    return d - dst;
+}
@@ -0,0 +1,22 @@
+#ifndef _TAXI_LZ_H_
+#define _TAXI_LZ_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Byte oriented LZ77 in the style of LZ4 for the repetitive taxi lists.
+ * A sequence is a token of literal and match lengths, the literals and a
+ * 2 byte offset of the match. The last sequence has only literals.
+ * Both return the length of the output or -1 if it doesn't fit the capacity
+ * or the input is malformed.
+ */
+extern int taxi_lz_compress(const unsigned char *src, int len, unsigned char *dst, int cap);
+extern int taxi_lz_decompress(const unsigned char *src, int len, unsigned char *dst, int cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
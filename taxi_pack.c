@@ -12,70 +12,99 @@
 #define _TAXI_TYPE_CUSTOMERS (0x5)
 #define _TAXI_TYPE_ADDR (0x6)
 
+static int __taxis_view_unpack(unsigned char *buf, int *p_len, int compact,
+                               struct taxi **p_taxis, int *p_num_taxis);
+
+#define _BUF_SPACE (1024)
+#define _ALIGN_WORD(n) ( ((n) + sizeof(unsigned int) - 1) & ~(sizeof(unsigned int) - 1) )
+
+static int id_len_of(struct taxi *taxi)
+{
+    return taxi->id_len > MAX_ID_LEN ? MAX_ID_LEN : taxi->id_len;
+}
+
 /*
- * Pack the result into a buffer for sending over the wire.
+ * Exact bytes of the packed taxi: start marker and length, the optional id,
+ * location, state, customers and address.
  */
-static unsigned char *__taxis_pack(struct taxi *taxis, int num_taxis,
-                                   unsigned char **r_buf,
-                                   int *p_len, int offset)
+int taxi_packed_size(struct taxi *taxi)
 {
-#define _BUF_SPACE (1024)
-#define _CHECK_SPACE(sp) do {                           \
-        if( (space - (sp) ) < 0 )                       \
-        {                                               \
-            ++extents;                                  \
-            int _len_span = s - buf;                    \
-            int _marker_span = taxi_len_marker - buf;   \
-            buf = realloc(buf, extents * len);          \
-            assert(buf);                                \
-            space = len;                                \
-            s = buf + _len_span;                        \
-            taxi_len_marker = buf + _marker_span;       \
-        }                                               \
-        space -= (sp);                                  \
-    }while(0)
-
-    int len = _BUF_SPACE;
-    if(p_len && *p_len) len = *p_len;
-    unsigned char *buf = r_buf ? *r_buf : NULL;
-    if(!buf) buf = calloc(1, len);
-    unsigned char *s = buf + offset;
-    unsigned char *taxi_len_marker = s;
-    int space = len - offset, extents = 1;
-    assert(buf);
+    int len = _TAXI_OVERHEAD;
+    int id_len = id_len_of(taxi);
+    if(id_len > 0)
+        len += 2*sizeof(unsigned int) + _ALIGN_WORD(id_len);
+    len += sizeof(unsigned int) + 2*sizeof(double);
+    len += 4*sizeof(unsigned int);
+    len += 3*sizeof(unsigned int);
+    return len;
+}
 
+/*
+ * Batched taxis leave out the address.
+ */
+int taxi_batch_packed_size(struct taxi *taxi)
+{
+    return taxi_packed_size(taxi) - 3*sizeof(unsigned int);
+}
+
+int taxis_packed_size(struct taxi *taxis, int num_taxis)
+{
+    int len = 0;
+    for(int i = 0; i < num_taxis; ++i)
+        len += taxi_packed_size(&taxis[i]);
+    return len;
+}
+
+/*
+ * Taxis of the list that fit in a packet.
+ */
+static int taxi_list_count(struct taxi *taxis, int num_taxis)
+{
+    int len = 2*sizeof(unsigned int);
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        len += taxi_packed_size(&taxis[i]);
+        if(len > __MAX_PACKET_LEN) return i;
+    }
+    return num_taxis;
+}
+
+int taxi_list_packed_size(struct taxi *taxis, int num_taxis)
+{
+    return 2*sizeof(unsigned int) + taxis_packed_size(taxis, taxi_list_count(taxis, num_taxis));
+}
+
+int taxis_ping_packed_size(struct taxi *customer, struct taxi *taxis, int num_taxis)
+{
+    return taxi_packed_size(customer) + taxi_list_packed_size(taxis, num_taxis);
+}
+
+static int __taxis_encode(struct taxi *taxis, int num_taxis, unsigned char *buf, int with_addr)
+{
+    unsigned char *s = buf;
     for(int i = 0; i < num_taxis; ++i)
     {
-        _CHECK_SPACE(sizeof(unsigned int)*2);
+        unsigned char *entry = s;
         *(unsigned int*)s = htonl(_TAXI_TYPE_START); /*start marker*/
-        s += sizeof(unsigned int);
-        taxi_len_marker = s;
-        s += sizeof(unsigned int); /* step over len*/
-        if(taxis[i].id && taxis[i].id_len > 0)
+        s += _TAXI_OVERHEAD; /* step over len*/
+        int id_len = id_len_of(&taxis[i]);
+        if(id_len > 0)
         {
-            _CHECK_SPACE(sizeof(unsigned int)*2);
+            int alen = _ALIGN_WORD(id_len);
             *(unsigned int*)s = htonl(_TAXI_TYPE_ID);
             s += sizeof(unsigned int);
-            int len = taxis[i].id_len;
-            int alen = (len+sizeof(unsigned int)-1) & ~(sizeof(unsigned int)-1);
-            *(unsigned int*)s = htonl(len);
+            *(unsigned int*)s = htonl(id_len);
             s += sizeof(unsigned int);
-            _CHECK_SPACE(alen);
-            memcpy(s, taxis[i].id, len);
+            memcpy(s, taxis[i].id, id_len);
+            memset(s + id_len, 0, alen - id_len);
             s += alen;
         }
-        _CHECK_SPACE(sizeof(unsigned int));
         *(unsigned int*)s = htonl(_TAXI_TYPE_LOCATION);
         s += sizeof(unsigned int);
-        double latitude =  taxis[i].latitude;
-        double longitude = taxis[i].longitude;
-        _CHECK_SPACE(2*sizeof(double));
-        *(double *)s = latitude;
+        memcpy(s, &taxis[i].latitude, sizeof(double));
         s += sizeof(double);
-        *(double *)s = longitude;
+        memcpy(s, &taxis[i].longitude, sizeof(double));
         s += sizeof(double);
-
-        _CHECK_SPACE(4*sizeof(unsigned int));
         *(unsigned int*)s = htonl(_TAXI_TYPE_STATE);
         s += sizeof(unsigned int);
         *(int*)s = htonl(taxis[i].state);
@@ -84,32 +113,79 @@ static unsigned char *__taxis_pack(struct taxi *taxis, int num_taxis,
         s += sizeof(unsigned int);
         *(int*)s = htonl(taxis[i].num_customers);
         s += sizeof(int);
-
         /*
          * Address already in network order
          */
-        _CHECK_SPACE(3*sizeof(unsigned int));
-        *(unsigned int*)s = htonl(_TAXI_TYPE_ADDR);
-        s += sizeof(unsigned int);
-        *(unsigned int *)s = taxis[i].addr.sin_addr.s_addr;
-        s += sizeof(unsigned int);
-        unsigned int port = (unsigned int)taxis[i].addr.sin_port;
-        *(unsigned int *)s = port;
-        s += sizeof(unsigned int);
+        if(with_addr)
+        {
+            *(unsigned int*)s = htonl(_TAXI_TYPE_ADDR);
+            s += sizeof(unsigned int);
+            *(unsigned int *)s = taxis[i].addr.sin_addr.s_addr;
+            s += sizeof(unsigned int);
+            *(unsigned int *)s = (unsigned int)taxis[i].addr.sin_port;
+            s += sizeof(unsigned int);
+        }
         /*
          * Update entry len
          */
-        *(unsigned int*)taxi_len_marker = 
-            htonl((unsigned int)(s - (unsigned char*)taxi_len_marker - sizeof(unsigned int)));
+        *(unsigned int*)(entry + sizeof(unsigned int)) = htonl((unsigned int)(s - entry - _TAXI_OVERHEAD));
     }
+    return s - buf;
+}
+
+/*
+ * Encode into a buffer of at least the packed size. Returns the bytes written.
+ */
+int taxis_encode(struct taxi *taxis, int num_taxis, unsigned char *buf)
+{
+    return __taxis_encode(taxis, num_taxis, buf, 1);
+}
 
+int taxis_batch_encode(struct taxi *taxis, int num_taxis, unsigned char *buf)
+{
+    return __taxis_encode(taxis, num_taxis, buf, 0);
+}
+
+int taxi_list_encode(struct taxi *taxis, int num_taxis, unsigned char *buf)
+{
+    num_taxis = taxi_list_count(taxis, num_taxis);
+    *(unsigned int*)buf = htonl(_TAXI_LIST_CMD);
+    *(unsigned int*)(buf + sizeof(unsigned int)) = htonl(num_taxis);
+    return 2*sizeof(unsigned int) + taxis_encode(taxis, num_taxis, buf + 2*sizeof(unsigned int));
+}
+
+int taxis_ping_encode(struct taxi *customer, struct taxi *taxis, int num_taxis, unsigned char *buf)
+{
+    int len = taxis_encode(customer, 1, buf);
+    return len + taxi_list_encode(taxis, num_taxis, buf + len);
+}
+
+/*
+ * Make room for the bytes needed in the callers buffer of *p_len bytes,
+ * or allocate one, in a single step.
+ */
+static unsigned char *reserve_buf(unsigned char **r_buf, int *p_len, int need)
+{
+    unsigned char *buf = r_buf ? *r_buf : NULL;
+    int space = p_len && *p_len ? *p_len : _BUF_SPACE;
+    if(!buf)
+        buf = calloc(1, space > need ? space : need);
+    else if(space < need)
+        buf = realloc(buf, need);
+    assert(buf != NULL);
+    return buf;
+}
+
+static unsigned char *__taxis_pack(struct taxi *taxis, int num_taxis,
+                                   unsigned char **r_buf,
+                                   int *p_len, int offset)
+{
+    unsigned char *buf = reserve_buf(r_buf, p_len, offset + taxis_packed_size(taxis, num_taxis));
+    int len = taxis_encode(taxis, num_taxis, buf + offset);
     if(r_buf)
         *r_buf = buf;
-    if(p_len) *p_len = s - buf - offset; /* bytes packed */
+    if(p_len) *p_len = len; /* bytes packed */
     return buf;
-
-#undef _CHECK_SPACE
-#undef _BUF_SPACE
 }
 
 unsigned char *taxis_pack(struct taxi *taxis, int num_taxis)
@@ -150,52 +226,13 @@ unsigned char *taxi_location_pack_with_buf(double latitude, double longitude,
 unsigned char *taxi_list_pack_with_buf(struct taxi *taxis, int num_taxis,
                                        unsigned char **r_buf, int *p_len, int offset)
 {
-#define _CHECK_SPACE(sp) do { len -= (sp); if(len < 0) goto out_free; } while(0)
-
-    int space = 1024, len = space;
-    unsigned char *buf; 
-    unsigned char *s;
-
-    if(!r_buf || !(buf = *r_buf))
-    {
-        buf = calloc(1, space);
-        assert(buf != NULL);
-    }
-    if(p_len) len = *p_len;
-
-    s = buf + offset;
-    
-    _CHECK_SPACE(2 * sizeof(unsigned int));
-    *(unsigned int *)s = htonl(_TAXI_LIST_CMD);
-    s += sizeof(unsigned int);
-    *(unsigned int*)s = htonl(num_taxis);
-    int max_taxis =  __MAX_PACKET_LEN/(sizeof(struct taxi)  + _TAXI_OVERHEAD);
-    if(num_taxis > max_taxis) 
-    {
-        num_taxis = max_taxis;
-        *(unsigned int*)s = htonl(num_taxis);
-    }
-    s += sizeof(unsigned int);
-    offset += 2 * sizeof(unsigned int);
-    buf = taxis_pack_with_buf(taxis, num_taxis, &buf, &len, offset);
-    assert(buf);
-    len += 2 * sizeof(unsigned int);
+    unsigned char *buf = reserve_buf(r_buf, p_len, offset + taxi_list_packed_size(taxis, num_taxis));
+    int len = taxi_list_encode(taxis, num_taxis, buf + offset);
     if(r_buf)
         *r_buf = buf;
     if(p_len)
         *p_len = len;
-    goto out;
-
-    out_free:
-    if(buf && (!r_buf || !*r_buf))
-    {
-        free(buf);
-        buf = NULL;
-    }
-
-    out:
     return buf;
-#undef _CHECK_SPACE
 }
 
 unsigned char *taxi_list_pack(struct taxi *taxis, int num_taxis)
@@ -207,24 +244,11 @@ unsigned char *taxis_ping_pack_with_buf(struct taxi *customer, struct taxi *taxi
                                         unsigned char **r_buf, int *p_len, int offset)
 {
     if(!taxis || !num_taxis || !customer) return NULL;
-    unsigned char *buf = NULL;
-    int space = 1024;
-    if(!r_buf || !(buf = *r_buf))
-    {
-        buf = calloc(1, space);
-        assert(buf);
-    }
-    if(p_len) space = *p_len;
-    int len = space;
-    buf = taxi_pack_with_buf(customer, &buf, &len, offset);
-    assert(buf != NULL);
-    int cur_packed = len;
-    len = space;
-    buf = taxi_list_pack_with_buf(taxis, num_taxis, &buf, &len, cur_packed + offset);
-    assert(buf != NULL);
-    cur_packed += len;
+    unsigned char *buf = reserve_buf(r_buf, p_len,
+                                     offset + taxis_ping_packed_size(customer, taxis, num_taxis));
+    int len = taxis_ping_encode(customer, taxis, num_taxis, buf + offset);
     if(r_buf) *r_buf = buf;
-    if(p_len) *p_len = cur_packed; /* total packed by this routine */
+    if(p_len) *p_len = len; /* total packed by this routine */
     return buf;
 }
 
@@ -248,9 +272,13 @@ static int __taxi_unpack(unsigned char *buf, int len, struct taxi *taxi)
         case _TAXI_TYPE_ID:
             {
                 _CHECK_SPACE(sizeof(unsigned int));
-                int id_len = ntohl(*(unsigned int*)s);
-                int alen = (id_len + sizeof(unsigned int)-1) & ~(sizeof(unsigned int)-1);
+                unsigned int id_len = ntohl(*(unsigned int*)s);
                 s += sizeof(unsigned int);
+                /*
+                 * Check the length before aligning it so that it can't wrap around.
+                 */
+                if(id_len > (unsigned int)len) goto out;
+                int alen = (id_len + sizeof(unsigned int)-1) & ~(sizeof(unsigned int)-1);
                 _CHECK_SPACE(alen);
                 memset(taxi->id, 0, sizeof(taxi->id));
                 if(id_len > sizeof(taxi->id)) id_len = sizeof(taxi->id);
@@ -263,9 +291,9 @@ static int __taxi_unpack(unsigned char *buf, int len, struct taxi *taxi)
         case _TAXI_TYPE_LOCATION:
             {
                 _CHECK_SPACE(2*sizeof(taxi->latitude));
-                taxi->latitude = *(double*)s;
+                memcpy(&taxi->latitude, s, sizeof(taxi->latitude));
                 s += sizeof(taxi->latitude);
-                taxi->longitude = *(double*)s;
+                memcpy(&taxi->longitude, s, sizeof(taxi->longitude));
                 s += sizeof(taxi->longitude);
             }
             break;
@@ -302,7 +330,6 @@ static int __taxi_unpack(unsigned char *buf, int len, struct taxi *taxi)
             goto out;
         }
     }
-    assert(len == 0);
     err = 0;
 
     out:
@@ -326,7 +353,7 @@ int taxi_unpack(unsigned char *buf, int *p_len, struct taxi *taxi)
 
     unsigned int entry_len = ntohl(*(unsigned int*)s);
     s += sizeof(unsigned int);
-    if(entry_len > len) goto out;
+    if(entry_len > (unsigned int)len) goto out;
 
     err = __taxi_unpack(s, entry_len, taxi);
     if(err == 0)
@@ -341,50 +368,7 @@ int taxi_unpack(unsigned char *buf, int *p_len, struct taxi *taxi)
 
 int taxis_unpack(unsigned char *buf, int *p_len, struct taxi **p_taxis, int *p_num_taxis)
 {
-#define _CHECK_SPACE(sp) do { len -= (sp); if(len < 0) goto out; }while(0)
-    struct taxi *taxis = NULL;
-    int num_taxis = 0;
-    unsigned char *s = buf;
-    int err = -1;
-
-    if(!buf || !p_len || !p_taxis || !p_num_taxis)
-        goto out;
-
-    int len = *p_len;
-    *p_taxis = NULL;
-    *p_num_taxis = 0;
-    
-    _CHECK_SPACE(sizeof(unsigned int));
-    num_taxis = ntohl(*(unsigned int*)s);
-    s += sizeof(unsigned int);
-    if(!num_taxis) 
-    {
-        *p_len = len;
-        err = 0;
-        goto out;
-    }
-    taxis = calloc(num_taxis, sizeof(*taxis));
-    assert(taxis);
-    for(int i = 0; i < num_taxis; ++i)
-    {
-        int save_len = len;
-        err = taxi_unpack(s, &len, &taxis[i]);
-        if(err < 0)
-            goto out_free;
-        s += save_len - len;
-    }
-    *p_len = len;
-    *p_taxis = taxis;
-    *p_num_taxis = num_taxis;
-    err = 0;
-    goto out;
-
-    out_free:
-    if(taxis) free(taxis);
-    out:
-    return err;
-
-#undef _CHECK_SPACE
+    return __taxis_view_unpack(buf, p_len, 0, p_taxis, p_num_taxis);
 }
 
 int taxi_list_unpack(unsigned char *buf, int *p_len, 
@@ -399,12 +383,15 @@ int taxi_list_unpack(unsigned char *buf, int *p_len,
     len = *p_len;
     _CHECK_SPACE(sizeof(unsigned int));
     unsigned int cmd = ntohl(*(unsigned int*)s);
-    if(cmd != _TAXI_LIST_CMD)
+    if(_TAXI_CMD(cmd) != _TAXI_LIST_CMD)
     {
         goto out;
     }
     s += sizeof(unsigned int);
-    err = taxis_unpack(s, &len, taxis, num_taxis);
+    if(cmd & _TAXI_CMD_V2)
+        err = taxis_v2_unpack(s, &len, taxis, num_taxis);
+    else
+        err = taxis_unpack(s, &len, taxis, num_taxis);
     if(err < 0)
         goto out;
     *p_len = len;
@@ -435,3 +422,448 @@ int taxis_ping_unpack(unsigned char *buf, int *p_len,
     out:
     return err;
 }
+
+static unsigned char *put_varint(unsigned char *s, unsigned int v)
+{
+    while(v >= 0x80)
+    {
+        *s++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *s++ = (unsigned char)v;
+    return s;
+}
+
+/*
+ * Returns the bytes consumed or -1 on a truncated or over long varint.
+ */
+static int get_varint(unsigned char *s, int len, unsigned int *v)
+{
+    unsigned int r = 0;
+    for(int i = 0; i < len && i < 5; ++i)
+    {
+        r |= (unsigned int)(s[i] & 0x7f) << (7*i);
+        if(!(s[i] & 0x80))
+        {
+            *v = r;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+#define _ZIGZAG(v) ( ((unsigned int)(v) << 1) ^ (unsigned int)((v) >> 31) )
+#define _UNZIGZAG(v) ( (int)((v) >> 1) ^ -(int)((v) & 1) )
+
+/*
+ * Coordinates are clamped to a turn of longitude so that the fixed point
+ * and its difference from the reference point stay in range.
+ */
+int taxi_v2_coord(double degrees)
+{
+    if(degrees != degrees) degrees = 0; /* NaN */
+    else if(degrees < -180) degrees = -180;
+    else if(degrees > 180) degrees = 180;
+    double fixed = degrees * _TAXI_V2_COORD_SCALE;
+    return (int)(fixed < 0 ? fixed - 0.5 : fixed + 0.5);
+}
+
+/*
+ * Pack a taxi in the compact encoding relative to the fixed point reference.
+ * The buffer needs _TAXI_V2_MAX_ENTRY_LEN bytes. Returns the bytes packed.
+ */
+int taxi_v2_pack_entry(struct taxi *taxi, int ref_latitude, int ref_longitude, unsigned char *buf)
+{
+    unsigned char *s = buf + 1;
+    unsigned char present = _TAXI_V2_HAS_LOCATION;
+    int id_len = taxi->id_len > MAX_ID_LEN ? MAX_ID_LEN : taxi->id_len;
+    if(id_len > 0)
+    {
+        present |= _TAXI_V2_HAS_ID;
+        s = put_varint(s, id_len);
+        memcpy(s, taxi->id, id_len);
+        s += id_len;
+    }
+    int latitude = taxi_v2_coord(taxi->latitude) - ref_latitude;
+    int longitude = taxi_v2_coord(taxi->longitude) - ref_longitude;
+    s = put_varint(s, _ZIGZAG(latitude));
+    s = put_varint(s, _ZIGZAG(longitude));
+    if(taxi->state)
+    {
+        present |= _TAXI_V2_HAS_STATE;
+        s = put_varint(s, taxi->state);
+    }
+    if(taxi->num_customers)
+    {
+        present |= _TAXI_V2_HAS_CUSTOMERS;
+        s = put_varint(s, taxi->num_customers);
+    }
+    /*
+     * Address already in network order
+     */
+    if(taxi->addr.sin_addr.s_addr || taxi->addr.sin_port)
+    {
+        present |= _TAXI_V2_HAS_ADDR;
+        memcpy(s, &taxi->addr.sin_addr.s_addr, 4);
+        s += 4;
+        memcpy(s, &taxi->addr.sin_port, 2);
+        s += 2;
+    }
+    buf[0] = present;
+    return s - buf;
+}
+
+/*
+ * Parse the taxi at buf into the view entry. Returns the bytes taken or -1 if the
+ * entry is malformed or runs past len.
+ */
+static int __taxi_view_entry(struct taxi_view *view, unsigned char *buf, int len,
+                             struct taxi_view_entry *entry)
+{
+#define _CHECK_VIEW_SPACE(sp) do { if(len < (int)(sp)) goto out; } while(0)
+#define _GET_VARINT(v) do {                     \
+        int _n = get_varint(s, len, &(v));      \
+        if(_n < 0) goto out;                    \
+        s += _n;                                \
+        len -= _n;                              \
+    } while(0)
+    unsigned char *s = buf;
+    memset(entry, 0, sizeof(*entry));
+    if(!view->compact)
+    {
+        _CHECK_VIEW_SPACE(2*sizeof(unsigned int));
+        if(ntohl(*(unsigned int*)s) != _TAXI_TYPE_START) goto out;
+        unsigned int entry_len = ntohl(*(unsigned int*)(s + sizeof(unsigned int)));
+        s += 2*sizeof(unsigned int);
+        len -= 2*sizeof(unsigned int);
+        if(entry_len > (unsigned int)len) goto out;
+        len = entry_len;
+        while(len > 0)
+        {
+            _CHECK_VIEW_SPACE(sizeof(unsigned int));
+            unsigned int type = ntohl(*(unsigned int*)s);
+            s += sizeof(unsigned int);
+            len -= sizeof(unsigned int);
+            switch(type)
+            {
+            case _TAXI_TYPE_ID:
+                {
+                    _CHECK_VIEW_SPACE(sizeof(unsigned int));
+                    unsigned int id_len = ntohl(*(unsigned int*)s);
+                    s += sizeof(unsigned int);
+                    len -= sizeof(unsigned int);
+                    if(id_len > (unsigned int)len) goto out;
+                    int alen = (id_len + sizeof(unsigned int)-1) & ~(sizeof(unsigned int)-1);
+                    _CHECK_VIEW_SPACE(alen);
+                    entry->id = s;
+                    entry->id_len = id_len;
+                    s += alen;
+                    len -= alen;
+                }
+                break;
+
+            case _TAXI_TYPE_LOCATION:
+                _CHECK_VIEW_SPACE(2*sizeof(double));
+                memcpy(&entry->latitude, s, sizeof(double));
+                memcpy(&entry->longitude, s + sizeof(double), sizeof(double));
+                s += 2*sizeof(double);
+                len -= 2*sizeof(double);
+                break;
+
+            case _TAXI_TYPE_STATE:
+                _CHECK_VIEW_SPACE(sizeof(unsigned int));
+                entry->state = ntohl(*(int*)s);
+                s += sizeof(int);
+                len -= sizeof(int);
+                break;
+
+            case _TAXI_TYPE_CUSTOMERS:
+                _CHECK_VIEW_SPACE(sizeof(unsigned int));
+                entry->num_customers = ntohl(*(int*)s);
+                s += sizeof(int);
+                len -= sizeof(int);
+                break;
+
+            case _TAXI_TYPE_ADDR:
+                _CHECK_VIEW_SPACE(2*sizeof(unsigned int));
+                entry->addr.sin_family = PF_INET;
+                entry->addr.sin_addr.s_addr = *(unsigned int*)s;
+                entry->addr.sin_port = (unsigned short)*(unsigned int*)(s + sizeof(unsigned int));
+                s += 2*sizeof(unsigned int);
+                len -= 2*sizeof(unsigned int);
+                break;
+
+            default:
+                goto out;
+            }
+        }
+        return s - buf;
+    }
+
+    unsigned int v;
+    _CHECK_VIEW_SPACE(1);
+    unsigned char present = *s++;
+    --len;
+    if(present & ~_TAXI_V2_HAS_ALL) goto out;
+    if(present & _TAXI_V2_HAS_ID)
+    {
+        _GET_VARINT(v);
+        if(v > MAX_ID_LEN) goto out;
+        _CHECK_VIEW_SPACE(v);
+        entry->id = s;
+        entry->id_len = v;
+        s += v;
+        len -= v;
+    }
+    if(present & _TAXI_V2_HAS_LOCATION)
+    {
+        _GET_VARINT(v);
+        entry->latitude = ((double)view->ref_latitude + _UNZIGZAG(v)) / _TAXI_V2_COORD_SCALE;
+        _GET_VARINT(v);
+        entry->longitude = ((double)view->ref_longitude + _UNZIGZAG(v)) / _TAXI_V2_COORD_SCALE;
+    }
+    if(present & _TAXI_V2_HAS_STATE)
+    {
+        _GET_VARINT(v);
+        entry->state = v;
+    }
+    if(present & _TAXI_V2_HAS_CUSTOMERS)
+    {
+        _GET_VARINT(v);
+        entry->num_customers = v;
+    }
+    if(present & _TAXI_V2_HAS_ADDR)
+    {
+        _CHECK_VIEW_SPACE(6);
+        entry->addr.sin_family = PF_INET;
+        memcpy(&entry->addr.sin_addr.s_addr, s, 4);
+        memcpy(&entry->addr.sin_port, s + 4, 2);
+        s += 6;
+    }
+    return s - buf;
+
+    out:
+    return -1;
+#undef _GET_VARINT
+#undef _CHECK_VIEW_SPACE
+}
+
+/*
+ * Set up a view over the count and the taxis at buf, preceded by the reference point
+ * when compact. All the taxis are validated here so that walking the view can't fail.
+ * On success p_len is left with the bytes past the list.
+ */
+int taxis_view_init(struct taxi_view *view, unsigned char *buf, int *p_len, int compact)
+{
+    struct taxi_view_entry entry;
+    if(!view || !buf || !p_len) return -1;
+    int len = *p_len;
+    unsigned char *s = buf;
+    memset(view, 0, sizeof(*view));
+    view->compact = compact;
+    if(len < (int)sizeof(unsigned int)) return -1;
+    int num_taxis = ntohl(*(unsigned int*)s);
+    s += sizeof(unsigned int);
+    len -= sizeof(unsigned int);
+    if(compact)
+    {
+        if(len < (int)_TAXI_V2_HEADER_LEN) return -1;
+        view->ref_latitude = (int)ntohl(*(unsigned int*)s);
+        view->ref_longitude = (int)ntohl(*(unsigned int*)(s + sizeof(unsigned int)));
+        s += _TAXI_V2_HEADER_LEN;
+        len -= _TAXI_V2_HEADER_LEN;
+    }
+    /*
+     * Every taxi takes at least a byte.
+     */
+    if(num_taxis < 0 || num_taxis > len) return -1;
+    view->buf = s;
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        int n = __taxi_view_entry(view, s, len, &entry);
+        if(n < 0) return -1;
+        s += n;
+        len -= n;
+    }
+    view->len = s - view->buf;
+    view->num_taxis = num_taxis;
+    view->next = view->buf;
+    *p_len = len;
+    return 0;
+}
+
+/*
+ * View over a list command in either encoding.
+ */
+int taxi_list_view_init(struct taxi_view *view, unsigned char *buf, int *p_len)
+{
+    if(!buf || !p_len || *p_len < (int)sizeof(unsigned int)) return -1;
+    unsigned int cmd = ntohl(*(unsigned int*)buf);
+    if(_TAXI_CMD(cmd) != _TAXI_LIST_CMD) return -1;
+    int len = *p_len - sizeof(unsigned int);
+    if(taxis_view_init(view, buf + sizeof(unsigned int), &len, !!(cmd & _TAXI_CMD_V2)) < 0)
+        return -1;
+    *p_len = len;
+    return 0;
+}
+
+/*
+ * The customer of a ping is unpacked while its taxi list is viewed in place.
+ */
+int taxis_ping_view_init(struct taxi_view *view, unsigned char *buf, int *p_len, struct taxi *customer)
+{
+    if(!view || !buf || !p_len || !customer) return -1;
+    int len = *p_len;
+    if(taxi_unpack(buf, &len, customer) < 0) return -1;
+    buf += *p_len - len;
+    if(taxi_list_view_init(view, buf, &len) < 0) return -1;
+    *p_len = len;
+    return 0;
+}
+
+/*
+ * Returns 1 with the next taxi in the entry and 0 past the last one.
+ * The entry id points into the buffer under the view.
+ */
+int taxi_view_next(struct taxi_view *view, struct taxi_view_entry *entry)
+{
+    if(view->index >= view->num_taxis) return 0;
+    int n = __taxi_view_entry(view, view->next, view->buf + view->len - view->next, entry);
+    assert(n > 0);
+    view->next += n;
+    ++view->index;
+    return 1;
+}
+
+void taxi_view_rewind(struct taxi_view *view)
+{
+    view->next = view->buf;
+    view->index = 0;
+}
+
+void taxi_view_entry_copy(struct taxi_view_entry *entry, struct taxi *taxi)
+{
+    memset(taxi->id, 0, sizeof(taxi->id));
+    taxi->id_len = entry->id_len > sizeof(taxi->id) ? sizeof(taxi->id) : entry->id_len;
+    if(taxi->id_len) memcpy(taxi->id, entry->id, taxi->id_len);
+    taxi->latitude = entry->latitude;
+    taxi->longitude = entry->longitude;
+    taxi->state = entry->state;
+    taxi->num_customers = entry->num_customers;
+    memcpy(&taxi->addr, &entry->addr, sizeof(taxi->addr));
+}
+
+static int __taxis_view_unpack(unsigned char *buf, int *p_len, int compact,
+                               struct taxi **p_taxis, int *p_num_taxis)
+{
+    struct taxi_view view;
+    struct taxi_view_entry entry;
+    struct taxi *taxis = NULL;
+    if(!buf || !p_len || !p_taxis || !p_num_taxis)
+        return -1;
+    *p_taxis = NULL;
+    *p_num_taxis = 0;
+    if(taxis_view_init(&view, buf, p_len, compact) < 0)
+        return -1;
+    if(view.num_taxis > 0)
+    {
+        taxis = calloc(view.num_taxis, sizeof(*taxis));
+        assert(taxis);
+    }
+    for(int i = 0; taxi_view_next(&view, &entry); ++i)
+        taxi_view_entry_copy(&entry, &taxis[i]);
+    *p_taxis = taxis;
+    *p_num_taxis = view.num_taxis;
+    return 0;
+}
+
+/*
+ * Unpack the count, the reference point and the taxis in the compact encoding.
+ */
+int taxis_v2_unpack(unsigned char *buf, int *p_len, struct taxi **p_taxis, int *p_num_taxis)
+{
+    return __taxis_view_unpack(buf, p_len, 1, p_taxis, p_num_taxis);
+}
+
+/*
+ * A region delta is the subscription id and sequence followed by the counted lists
+ * of taxis that entered, moved within and left the region.
+ */
+int taxi_region_delta_packed_size(struct taxi_region_delta *delta)
+{
+    return 5 * sizeof(unsigned int) + taxis_packed_size(delta->entered, delta->num_entered)
+        + taxis_packed_size(delta->moved, delta->num_moved) + taxis_packed_size(delta->left, delta->num_left);
+}
+
+int taxi_region_delta_encode(struct taxi_region_delta *delta, unsigned char *buf)
+{
+    struct taxi *lists[3] = { delta->entered, delta->moved, delta->left };
+    int counts[3] = { delta->num_entered, delta->num_moved, delta->num_left };
+    unsigned char *s = buf;
+    *(unsigned int*)s = htonl(delta->sub_id);
+    s += sizeof(unsigned int);
+    *(unsigned int*)s = htonl(delta->seq);
+    s += sizeof(unsigned int);
+    for(int i = 0; i < 3; ++i)
+    {
+        *(unsigned int*)s = htonl(counts[i]);
+        s += sizeof(unsigned int);
+        s += taxis_encode(lists[i], counts[i], s);
+    }
+    return s - buf;
+}
+
+unsigned char *taxi_region_delta_pack_with_buf(struct taxi_region_delta *delta,
+                                               unsigned char **r_buf, int *p_len, int offset)
+{
+    unsigned char *buf = reserve_buf(r_buf, p_len, offset + taxi_region_delta_packed_size(delta));
+    int len = taxi_region_delta_encode(delta, buf + offset);
+    if(r_buf) *r_buf = buf;
+    if(p_len) *p_len = len;
+    return buf;
+}
+
+int taxi_region_delta_unpack(unsigned char *buf, int *p_len, struct taxi_region_delta *delta)
+{
+#define _CHECK_DELTA_SPACE(sp) do { len -= (sp); if(len < 0) goto out_free; } while(0)
+    struct taxi **lists[3];
+    int *counts[3];
+    int err = -1;
+    if(!buf || !p_len || !delta) return -1;
+    int len = *p_len;
+    unsigned char *s = buf;
+    memset(delta, 0, sizeof(*delta));
+    lists[0] = &delta->entered; counts[0] = &delta->num_entered;
+    lists[1] = &delta->moved; counts[1] = &delta->num_moved;
+    lists[2] = &delta->left; counts[2] = &delta->num_left;
+    _CHECK_DELTA_SPACE(2 * sizeof(unsigned int));
+    delta->sub_id = ntohl(*(unsigned int*)s);
+    s += sizeof(unsigned int);
+    delta->seq = ntohl(*(unsigned int*)s);
+    s += sizeof(unsigned int);
+    for(int i = 0; i < 3; ++i)
+    {
+        int save_len = len;
+        if(taxis_unpack(s, &len, lists[i], counts[i]) < 0)
+            goto out_free;
+        s += save_len - len;
+    }
+    *p_len = len;
+    err = 0;
+    goto out;
+
+    out_free:
+    taxi_region_delta_free(delta);
+    out:
+    return err;
+#undef _CHECK_DELTA_SPACE
+}
+
+void taxi_region_delta_free(struct taxi_region_delta *delta)
+{
+    if(delta->entered) free(delta->entered);
+    if(delta->moved) free(delta->moved);
+    if(delta->left) free(delta->left);
+    delta->entered = delta->moved = delta->left = NULL;
+    delta->num_entered = delta->num_moved = delta->num_left = 0;
+}
@@ -9,7 +9,21 @@ extern "C" {
 
 #define __MAX_PACKET_LEN (64000)
 #define _TAXI_OVERHEAD (sizeof(unsigned int)*2) /*per entry overhead of 2 words for len and start marker*/
+#define _TAXI_MAX_ENTRY_LEN (_TAXI_OVERHEAD + 2*sizeof(unsigned int) + MAX_ID_LEN \
+                             + sizeof(unsigned int) + 2*sizeof(double) + 7*sizeof(unsigned int))
 #define _TAXI_CMD_BASE (0x1000)
+/*
+ * Flag bits above the command in the command word. Fetches flagged _TAXI_CMD_V2
+ * are answered with a list or fragments flagged the same, carrying the compact encoding.
+ * Fetches flagged _TAXI_CMD_LZ take replies with the taxi entries compressed
+ * once they exceed _TAXI_LZ_THRESHOLD bytes. A compressed reply is flagged the same
+ * and has a word of the uncompressed length of the entries after its header.
+ */
+#define _TAXI_CMD_MASK (0xffff)
+#define _TAXI_CMD_V2   (0x10000)
+#define _TAXI_CMD_LZ   (0x20000)
+#define _TAXI_LZ_THRESHOLD (256)
+#define _TAXI_CMD(word) ((word) & _TAXI_CMD_MASK)
 #define __TAXI_CMD(off) (_TAXI_CMD_BASE + (off))
 #define _TAXI_LOCATION_CMD __TAXI_CMD(1)
 #define _TAXI_DELETE_CMD   __TAXI_CMD(2)
@@ -18,6 +32,100 @@ extern "C" {
 #define _TAXI_PING_CMD     __TAXI_CMD(5)
 #define _TAXI_PING_REPLY_CMD __TAXI_CMD(6)
 #define _TAXI_PING_INTIMATION_CMD __TAXI_CMD(7)
+#define _TAXI_FETCH_PING_CMD __TAXI_CMD(8)
+#define _TAXI_FETCH_FRAG_CMD __TAXI_CMD(9)
+#define _TAXI_LIST_FRAG_CMD  __TAXI_CMD(10)
+#define _TAXI_STATS_CMD      __TAXI_CMD(11) /* request id in, request id and stats out */
+#define _TAXI_SUBSCRIBE_CMD  __TAXI_CMD(12)
+#define _TAXI_REGION_DELTA_CMD __TAXI_CMD(13)
+#define _TAXI_LOCATION_BATCH_CMD __TAXI_CMD(14)
+
+/*
+ * Fetch requests answered in fragments carry a header of
+ * request id and the 64 bit mask of fragments wanted (0 for all) before the taxi.
+ * Each fragment reply carries the request id, fragment sequence and total count
+ * before its own taxi list.
+ */
+#define _TAXI_MAX_FRAGS (64)
+#define _TAXI_FETCH_FRAG_HEADER_LEN (sizeof(unsigned int)*3)
+#define _TAXI_LIST_FRAG_HEADER_LEN  (sizeof(unsigned int)*4)
+#define _TAXI_FRAG_PAYLOAD (1400) /* fits an ethernet frame with room for tunnel headers */
+
+/*
+ * Region subscriptions carry the subscription id, the lease in msecs (0 unsubscribes)
+ * and flags before the counted list of the 2 corners of the bounding box.
+ * The server pushes region deltas to the subscriber per tick. Sequence 0 is the
+ * snapshot of the region sent on a new or reset subscription.
+ */
+#define _TAXI_SUBSCRIBE_HEADER_LEN (sizeof(unsigned int)*3)
+#define _TAXI_SUBSCRIBE_RESET (0x1) /* resend the snapshot */
+
+/*
+ * Batched location updates carry the datagram port of the sender followed by a
+ * counted list of taxis packed without an address, as many as fit a datagram of
+ * _TAXI_FRAG_PAYLOAD. Every batched taxi is reached at the sender's address,
+ * at the port in the header when the batch comes over a stream.
+ */
+#define _TAXI_LOCATION_BATCH_HEADER_LEN (sizeof(unsigned int)*3)
+#define _TAXI_LOCATION_BATCH_LEN _TAXI_FRAG_PAYLOAD
+
+/*
+ * Compact encoding of a taxi list. The count of taxis is followed by the reference
+ * point, the fetch location as 2 words of fixed point coordinates. Each taxi then has
+ * a byte of presence bits for the fields that follow in this order:
+ * the id as a varint length and the bytes, latitude and longitude as zigzag varints
+ * of the fixed point delta from the reference, the state and customer count as varints
+ * and the address and port as 6 bytes in network order.
+ */
+#define _TAXI_V2_COORD_SCALE (1e6) /* fixed point units per degree, about 11 cms */
+#define _TAXI_V2_HEADER_LEN (sizeof(unsigned int)*2) /* reference point after the count */
+#define _TAXI_V2_HAS_ID        (0x1)
+#define _TAXI_V2_HAS_LOCATION  (0x2)
+#define _TAXI_V2_HAS_STATE     (0x4)
+#define _TAXI_V2_HAS_CUSTOMERS (0x8)
+#define _TAXI_V2_HAS_ADDR      (0x10)
+#define _TAXI_V2_HAS_ALL       (0x1f)
+#define _TAXI_V2_MAX_ENTRY_LEN (1 + 5 + MAX_ID_LEN + 4*5 + 6)
+
+/*
+ * Read only view over a packed list of taxis in a received buffer in either encoding.
+ * The list is validated once when the view is set up and is then walked an entry at
+ * a time, with the entry ids pointing into the buffer.
+ */
+struct taxi_view
+{
+    unsigned char *buf; /* first taxi */
+    int len; /* bytes of taxis */
+    int num_taxis;
+    int compact;
+    int ref_latitude;
+    int ref_longitude;
+    unsigned char *next;
+    int index;
+};
+
+struct taxi_view_entry
+{
+    const unsigned char *id;
+    int id_len;
+    double latitude;
+    double longitude;
+    int state;
+    int num_customers;
+    struct sockaddr_in addr;
+};
+
+struct taxi_region_delta
+{
+    unsigned int sub_id;
+    unsigned int seq;
+    struct taxi *entered;
+    int num_entered;
+    struct taxi *moved;
+    int num_moved;
+    struct taxi *left;
+    int num_left;
+};
 
 extern unsigned char *taxis_pack(struct taxi *taxis, int num_taxis);
 extern unsigned char *taxi_pack(struct taxi *taxi);
@@ -36,6 +144,16 @@ extern unsigned char *taxi_list_pack(struct taxi *taxis, int num_taxis);
 extern unsigned char *taxis_ping_pack_with_buf(struct taxi *customer, struct taxi *taxis, int num_taxis, 
                                                unsigned char **r_buf, int *p_len, int offset);
 extern unsigned char *taxis_ping_pack(struct taxi *customer, struct taxi *taxis, int num_taxis);
+extern int taxi_packed_size(struct taxi *taxi);
+extern int taxis_packed_size(struct taxi *taxis, int num_taxis);
+extern int taxi_list_packed_size(struct taxi *taxis, int num_taxis);
+extern int taxis_ping_packed_size(struct taxi *customer, struct taxi *taxis, int num_taxis);
+extern int taxis_encode(struct taxi *taxis, int num_taxis, unsigned char *buf);
+extern int taxi_batch_packed_size(struct taxi *taxi);
+extern int taxis_batch_encode(struct taxi *taxis, int num_taxis, unsigned char *buf);
+extern int taxi_list_encode(struct taxi *taxis, int num_taxis, unsigned char *buf);
+extern int taxis_ping_encode(struct taxi *customer, struct taxi *taxis, int num_taxis,
+                             unsigned char *buf);
 extern int taxi_unpack(unsigned char *buf, int *p_len, struct taxi *taxi);
 extern int taxis_unpack(unsigned char *buf, int *p_len, 
                         struct taxi **p_taxis, int *p_num_taxis);
@@ -43,6 +161,23 @@ extern int taxi_list_unpack(unsigned char *buf, int *p_len,
                             struct taxi **p_taxis, int *p_num_taxis);
 extern int taxis_ping_unpack(unsigned char *buf, int *p_len, struct taxi *customer,
                              struct taxi **p_taxis, int *p_num_taxis);
+extern int taxi_v2_coord(double degrees);
+extern int taxi_v2_pack_entry(struct taxi *taxi, int ref_latitude, int ref_longitude, unsigned char *buf);
+extern int taxis_v2_unpack(unsigned char *buf, int *p_len,
+                           struct taxi **p_taxis, int *p_num_taxis);
+extern int taxis_view_init(struct taxi_view *view, unsigned char *buf, int *p_len, int compact);
+extern int taxi_list_view_init(struct taxi_view *view, unsigned char *buf, int *p_len);
+extern int taxis_ping_view_init(struct taxi_view *view, unsigned char *buf, int *p_len,
+                                struct taxi *customer);
+extern int taxi_view_next(struct taxi_view *view, struct taxi_view_entry *entry);
+extern void taxi_view_rewind(struct taxi_view *view);
+extern void taxi_view_entry_copy(struct taxi_view_entry *entry, struct taxi *taxi);
+extern int taxi_region_delta_packed_size(struct taxi_region_delta *delta);
+extern int taxi_region_delta_encode(struct taxi_region_delta *delta, unsigned char *buf);
+extern unsigned char *taxi_region_delta_pack_with_buf(struct taxi_region_delta *delta,
+                                                      unsigned char **r_buf, int *p_len, int offset);
+extern int taxi_region_delta_unpack(unsigned char *buf, int *p_len, struct taxi_region_delta *delta);
+extern void taxi_region_delta_free(struct taxi_region_delta *delta);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "taxi_ring.h"
+
+#define _CACHE_LINE (64)
+
+/*
+ * Head is only written by the consumer and tail only by the producer.
+ * Each side keeps a cached copy of the other index on its own cache line
+ * so the shared indexes are touched only when the cached view runs out.
+ */
+struct taxi_ring
+{
+    unsigned int head __attribute__((aligned(_CACHE_LINE)));
+    unsigned int cached_tail;
+    unsigned int tail __attribute__((aligned(_CACHE_LINE)));
+    unsigned int cached_head;
+    unsigned int mask __attribute__((aligned(_CACHE_LINE)));
+    unsigned int slot_size;
+    unsigned char *slots;
+};
+
+struct taxi_ring *taxi_ring_create(int num_slots, int slot_size)
+{
+    struct taxi_ring *ring = NULL;
+    int slots = 1;
+    if(num_slots <= 0 || slot_size <= 0) goto out;
+    while(slots < num_slots) slots <<= 1;
+    if(posix_memalign((void**)&ring, _CACHE_LINE, sizeof(*ring)))
+        ring = NULL;
+    assert(ring != NULL);
+    memset(ring, 0, sizeof(*ring));
+    ring->mask = slots - 1;
+    ring->slot_size = (slot_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    ring->slots = calloc(slots, ring->slot_size);
+    assert(ring->slots != NULL);
+
+    out:
+    return ring;
+}
+
+void taxi_ring_destroy(struct taxi_ring *ring)
+{
+    if(!ring) return;
+    free(ring->slots);
+    free(ring);
+}
+
+void *taxi_ring_reserve(struct taxi_ring *ring)
+{
+    unsigned int tail = ring->tail;
+    if(tail - ring->cached_head > ring->mask)
+    {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if(tail - ring->cached_head > ring->mask)
+            return NULL; /* full */
+    }
+    return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+void taxi_ring_commit(struct taxi_ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+void *taxi_ring_peek(struct taxi_ring *ring)
+{
+    unsigned int head = ring->head;
+    if(head == ring->cached_tail)
+    {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if(head == ring->cached_tail)
+            return NULL; /* empty */
+    }
+    return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+void taxi_ring_release(struct taxi_ring *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Approximate depth as seen from either side.
+ */
+int taxi_ring_count(struct taxi_ring *ring)
+{
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return (int)(tail - head);
+}
@@ -0,0 +1,27 @@
+#ifndef _TAXI_RING_H_
+#define _TAXI_RING_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Lock-free single producer/single consumer ring of fixed size slots.
+ * The producer reserves a slot, fills it in place and commits it.
+ * The consumer peeks the oldest slot, processes it in place and releases it.
+ */
+struct taxi_ring;
+
+extern struct taxi_ring *taxi_ring_create(int num_slots, int slot_size);
+extern void taxi_ring_destroy(struct taxi_ring *ring);
+extern void *taxi_ring_reserve(struct taxi_ring *ring);
+extern void taxi_ring_commit(struct taxi_ring *ring);
+extern void *taxi_ring_peek(struct taxi_ring *ring);
+extern void taxi_ring_release(struct taxi_ring *ring);
+extern int taxi_ring_count(struct taxi_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
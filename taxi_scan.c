@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <math.h>
 #include "rbtree.h"
+#include "taxi_pack.h"
 #include "taxi_server.h"
 
 struct taxi_location
@@ -21,6 +22,8 @@ struct taxi_location
     struct taxi_location *taxi_parent;
     struct rbtree map;
     struct rbtree id_map; 
+    unsigned char *entry; /* wire encoding of the taxi, refreshed on every update */
+    int entry_len;
 };
 
 struct taxi_db
@@ -32,6 +35,23 @@ struct taxi_db
 
 static struct taxi_db taxi_db;
 
+static void refresh_entry(struct taxi_location *taxi_location)
+{
+    struct taxi taxi;
+    memset(&taxi, 0, sizeof(taxi));
+    taxi.id_len = taxi_location->id_len > sizeof(taxi.id) ? sizeof(taxi.id) : taxi_location->id_len;
+    memcpy(taxi.id, taxi_location->id, taxi.id_len);
+    taxi.latitude = taxi_location->latitude;
+    taxi.longitude = taxi_location->longitude;
+    memcpy(&taxi.addr, &taxi_location->addr, sizeof(taxi.addr));
+    if(!taxi_location->entry)
+    {
+        taxi_location->entry = malloc(_TAXI_MAX_ENTRY_LEN);
+        assert(taxi_location->entry != NULL);
+    }
+    taxi_location->entry_len = taxis_encode(&taxi, 1, taxi_location->entry);
+}
+
 static int taxi_near_locations_cmp(const void *a, const void *b)
 {
     struct taxi_location *l1 = *(struct taxi_location**)a;
@@ -48,7 +68,27 @@ static int taxi_near_locations_cmp(const void *a, const void *b)
     return memcmp(l1->id, l2->id, l1->id_len);
 }
 
-static int __add_taxi_by_location(struct taxi_location *taxi)
+/*
+ * The near list is kept sorted for the lookups on unlink. Batched adds sort it
+ * once they are done.
+ */
+static void add_near_location(struct taxi_location *taxi_parent, struct taxi_location *taxi, int sort)
+{
+    output("Adding %s taxi [%.*s] with parent [%.*s]\n", taxi_parent == taxi ? "new":"child",
+           taxi->id_len, taxi->id,
+           taxi_parent->id_len, taxi_parent->id);
+    taxi->taxi_parent = taxi_parent;
+    taxi_parent->taxi_near_locations = realloc(taxi_parent->taxi_near_locations,
+                                                 sizeof(*taxi_parent->taxi_near_locations)
+                                                 * (taxi_parent->num_taxis+1));
+    assert(taxi_parent->taxi_near_locations != NULL);
+    taxi_parent->taxi_near_locations[taxi_parent->num_taxis++] = taxi;
+    if(sort)
+        qsort(taxi_parent->taxi_near_locations, taxi_parent->num_taxis,
+              sizeof(*taxi_parent->taxi_near_locations), taxi_near_locations_cmp);
+}
+
+static int add_taxi_by_location(struct taxi_location *taxi, int sort)
 {
     struct rbtree **link = &taxi_db.taxi_map.root;
     struct taxi_location *taxi_location = NULL;
@@ -66,7 +106,7 @@ static int __add_taxi_by_location(struct taxi_location *taxi)
            fabs(taxi->longitude - taxi_location->longitude) <= TAXI_DISTANCE_BIAS)
         {
             taxi_parent = taxi_location;
-            goto add_near_location;
+            goto add_near;
         }
         if(taxi->latitude <= taxi_location->latitude)
             link = &parent->left;
@@ -82,21 +122,16 @@ static int __add_taxi_by_location(struct taxi_location *taxi)
     rbtree_insert_colour(&taxi_db.taxi_map, &taxi->map);
     taxi->num_taxis = 0;
 
-    add_near_location:
-    output("Adding %s taxi [%.*s] with parent [%.*s]\n", taxi_parent == taxi ? "new":"child",
-           taxi->id_len, taxi->id,
-           taxi_parent->id_len, taxi_parent->id);
-    taxi->taxi_parent = taxi_parent;
-    taxi_parent->taxi_near_locations = realloc(taxi_parent->taxi_near_locations,
-                                                 sizeof(*taxi_parent->taxi_near_locations)
-                                                 * (taxi_parent->num_taxis+1));
-    assert(taxi_parent->taxi_near_locations != NULL);
-    taxi_parent->taxi_near_locations[taxi_parent->num_taxis++] = taxi;
-    qsort(taxi_parent->taxi_near_locations, taxi_parent->num_taxis,
-          sizeof(*taxi_parent->taxi_near_locations), taxi_near_locations_cmp);
+    add_near:
+    add_near_location(taxi_parent, taxi, sort);
     return 0;
 }
 
+static int __add_taxi_by_location(struct taxi_location *taxi)
+{
+    return add_taxi_by_location(taxi, 1);
+}
+
 /*
  * Each taxi has a unique id to locate
  */
@@ -185,71 +220,82 @@ static int unlink_child(struct taxi_location *parent, struct taxi_location *chil
 }
 
 /*
- * Check if the taxi location is being updated and if yes, reparent or readjust the
+ * The taxi location is being updated, so reparent or readjust the
  * taxi location.
  */
-
-static int __add_taxi(struct taxi_location *taxi)
+static int __update_taxi(struct taxi_location *entry, struct taxi_location *taxi)
 {
-    struct taxi_location *entry = find_taxi_by_id(taxi, 1);
+    struct taxi_location *parent  = entry->taxi_parent;
+    if(taxi->latitude == entry->latitude
+       &&
+       taxi->longitude == entry->longitude)
+    {
+        return -1; /*match*/
+    }
     /*
-     * Check if its a new taxi or an update to an existing one.
+     * IF this is a contained taxi within a parent taxi, then 
+     * move or update its current location based on the distance relocated.
      */
-    if(entry != taxi)
+    if(parent != entry)
     {
-        struct taxi_location *parent  = entry->taxi_parent;
-        if(taxi->latitude == entry->latitude
+        assert(parent->num_taxis > 1);
+        if(fabs(taxi->latitude - parent->latitude) <= TAXI_DISTANCE_BIAS
            &&
-           taxi->longitude == entry->longitude)
-        {
-            return -1; /*match*/
-        }
-        /*
-         * IF this is a contained taxi within a parent taxi, then 
-         * move or update its current location based on the distance relocated.
-         */
-        if(parent != entry)
+           fabs(taxi->longitude - parent->longitude) <= TAXI_DISTANCE_BIAS)
         {
-            assert(parent->num_taxis > 1);
-            if(fabs(taxi->latitude - parent->latitude) <= TAXI_DISTANCE_BIAS
-               &&
-               fabs(taxi->longitude - parent->longitude) <= TAXI_DISTANCE_BIAS)
-            {
-                entry->latitude = taxi->latitude;
-                entry->longitude = taxi->longitude;
-                return -1; /*distance match and updated*/
-            }
-            /*
-             * If the taxi has moved outside the radius of the parent,
-             * then unlink and re-add
-             */
-            unlink_child(parent, entry);
-            entry->taxi_parent = NULL;
-            /*
-             * New latitude and longitude
-             */
             entry->latitude = taxi->latitude;
             entry->longitude = taxi->longitude;
+            refresh_entry(entry);
             /*
-             * Now add into the location map
+             * Keep the near list sorted for the lookups on unlink.
              */
-            entry->num_taxis = 0;
-            __add_taxi_by_location(entry);
-            return -1;  /*match*/
+            qsort(parent->taxi_near_locations, parent->num_taxis,
+                  sizeof(*parent->taxi_near_locations), taxi_near_locations_cmp);
+            return -1; /*distance match and updated*/
         }
         /*
-         * This is a parent entry that is relocating. Unlink from the location map
-         * and re-add the children back as well.
+         * If the taxi has moved outside the radius of the parent,
+         * then unlink and re-add
+         */
+        unlink_child(parent, entry);
+        entry->taxi_parent = NULL;
+        /*
+         * New latitude and longitude
          */
         entry->latitude = taxi->latitude;
         entry->longitude = taxi->longitude;
-        reparent_taxi(entry, 1);
-        return -1;
+        refresh_entry(entry);
+        /*
+         * Now add into the location map
+         */
+        entry->num_taxis = 0;
+        __add_taxi_by_location(entry);
+        return -1;  /*match*/
     }
+    /*
+     * This is a parent entry that is relocating. Unlink from the location map
+     * and re-add the children back as well.
+     */
+    entry->latitude = taxi->latitude;
+    entry->longitude = taxi->longitude;
+    refresh_entry(entry);
+    reparent_taxi(entry, 1);
+    return -1;
+}
+
+static int __add_taxi(struct taxi_location *taxi)
+{
+    struct taxi_location *entry = find_taxi_by_id(taxi, 1);
+    /*
+     * Check if its a new taxi or an update to an existing one.
+     */
+    if(entry != taxi)
+        return __update_taxi(entry, taxi);
 
     /*
      * A new entry was added into the id map. Add this guy to the location map as well.
      */
+    refresh_entry(taxi);
     return __add_taxi_by_location(taxi);
 }
 
@@ -281,6 +327,7 @@ static int __del_taxi(struct taxi_location *taxi)
     rbtree_erase(&taxi_db.taxi_id_map, &entry->id_map);
     --taxi_db.num_taxis;
     free(entry->id);
+    free(entry->entry);
     free(entry);
     err = 0;
 
@@ -288,12 +335,9 @@ static int __del_taxi(struct taxi_location *taxi)
     return err;
 }
 
-int add_taxi(struct taxi *taxi)
+static struct taxi_location *new_taxi_location(struct taxi *taxi)
 {
-    struct taxi_location *taxi_location = NULL;
-    int err = -1;
-    if(!taxi) goto out;
-    taxi_location = calloc(1, sizeof(*taxi_location));
+    struct taxi_location *taxi_location = calloc(1, sizeof(*taxi_location));
     assert(taxi_location);
     taxi_location->latitude = taxi->latitude;
     taxi_location->longitude = taxi->longitude;
@@ -302,6 +346,15 @@ int add_taxi(struct taxi *taxi)
     taxi_location->id_len = taxi->id_len;
     memcpy(taxi_location->id, taxi->id, taxi->id_len);
     memcpy(&taxi_location->addr, &taxi->addr, sizeof(taxi_location->addr));
+    return taxi_location;
+}
+
+int add_taxi(struct taxi *taxi)
+{
+    struct taxi_location *taxi_location = NULL;
+    int err = -1;
+    if(!taxi) goto out;
+    taxi_location = new_taxi_location(taxi);
     if((err = __add_taxi(taxi_location))< 0)
     {
         free(taxi_location->id);
@@ -311,6 +364,53 @@ int add_taxi(struct taxi *taxi)
     return err;
 }
 
+static void sort_near_locations(struct taxi_location **parents, int num_parents)
+{
+    for(int i = 0; i < num_parents; ++i)
+        qsort(parents[i]->taxi_near_locations, parents[i]->num_taxis,
+              sizeof(*parents[i]->taxi_near_locations), taxi_near_locations_cmp);
+}
+
+/*
+ * Add or update many taxis in one pass, given grouped by location. The new
+ * taxis join their clusters unsorted and each near list grown that way is
+ * sorted once instead of on every add. Updates look up the near lists, so
+ * those are sorted first.
+ * Returns the number of taxis new to the index.
+ */
+int add_taxis(struct taxi *taxis, int num_taxis)
+{
+    struct taxi_location **grown = NULL;
+    int num_grown = 0;
+    int added = 0;
+    if(!taxis || num_taxis <= 0) return 0;
+    grown = malloc(num_taxis * sizeof(*grown));
+    assert(grown);
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        struct taxi_location *taxi_location = new_taxi_location(&taxis[i]);
+        struct taxi_location *entry = find_taxi_by_id(taxi_location, 1);
+        if(entry != taxi_location)
+        {
+            sort_near_locations(grown, num_grown);
+            num_grown = 0;
+            __update_taxi(entry, taxi_location);
+            free(taxi_location->id);
+            free(taxi_location);
+            continue;
+        }
+        refresh_entry(taxi_location);
+        add_taxi_by_location(taxi_location, 0);
+        struct taxi_location *parent = taxi_location->taxi_parent;
+        if(parent != taxi_location && (!num_grown || grown[num_grown-1] != parent))
+            grown[num_grown++] = parent;
+        ++added;
+    }
+    sort_near_locations(grown, num_grown);
+    free(grown);
+    return added;
+}
+
 int del_taxi(struct taxi *taxi)
 {
     int err = -1;
@@ -461,3 +561,115 @@ int find_taxis_by_location(double latitude, double longitude,
     if(taxis) free(taxis);
     return err;
 }
+
+/*
+ * Same as above but hands out the cached wire encodings of the taxis instead of copies.
+ */
+int find_taxi_entries_by_location(double latitude, double longitude,
+                                  struct taxi_entry **matched_entries, int *num_matches)
+{
+    struct taxi_location taxi_location = {.id = NULL, .id_len = 0,
+                                          .latitude = latitude, .longitude = longitude };
+    struct taxi_location **taxis = NULL;
+    int num_taxis = 0;
+
+    if(!matched_entries || !num_matches) return -1;
+    *matched_entries = NULL;
+    *num_matches = 0;
+    int err = __find_taxis_by_location(&taxi_location, NULL, &taxis, &num_taxis);
+    if(err < 0)
+    {
+        output("No taxis found near location [%G:%G]\n", latitude, longitude);
+        return err;
+    }
+    struct taxi_entry *entries = calloc(num_taxis, sizeof(*entries));
+    assert(entries);
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        entries[i].buf = taxis[i]->entry;
+        entries[i].len = taxis[i]->entry_len;
+        entries[i].addr = &taxis[i]->addr;
+        entries[i].id = taxis[i]->id;
+        entries[i].id_len = taxis[i]->id_len > MAX_ID_LEN ? MAX_ID_LEN : taxis[i]->id_len;
+        entries[i].latitude = taxis[i]->latitude;
+        entries[i].longitude = taxis[i]->longitude;
+    }
+    *matched_entries = entries;
+    *num_matches = num_taxis;
+    free(taxis);
+    return err;
+}
+
+/*
+ * Find taxis within the bounding box. Children stay within the distance bias
+ * of their parent, so clusters further out than that are skipped.
+ */
+int find_taxis_in_region(double latitude_min, double longitude_min,
+                         double latitude_max, double longitude_max,
+                         struct taxi **matched_taxis, int *num_matches)
+{
+    struct taxi *result = NULL;
+    int num_taxis = 0, max_taxis = 0;
+    struct rbtree *iter;
+    if(!matched_taxis || !num_matches) return -1;
+    rbtree_for_each(iter, &taxi_db.taxi_map)
+    {
+        struct taxi_location *parent = rbtree_entry(iter, struct taxi_location, map);
+        if(parent->latitude < latitude_min - TAXI_DISTANCE_BIAS
+           ||
+           parent->latitude > latitude_max + TAXI_DISTANCE_BIAS
+           ||
+           parent->longitude < longitude_min - TAXI_DISTANCE_BIAS
+           ||
+           parent->longitude > longitude_max + TAXI_DISTANCE_BIAS)
+            continue;
+        for(int i = 0; i < parent->num_taxis; ++i)
+        {
+            struct taxi_location *taxi = parent->taxi_near_locations[i];
+            if(taxi->latitude < latitude_min || taxi->latitude > latitude_max
+               ||
+               taxi->longitude < longitude_min || taxi->longitude > longitude_max)
+                continue;
+            if(num_taxis == max_taxis)
+            {
+                max_taxis = max_taxis ? max_taxis << 1 : 16;
+                result = realloc(result, sizeof(*result) * max_taxis);
+                assert(result);
+            }
+            memset(&result[num_taxis], 0, sizeof(result[num_taxis]));
+            int len = taxi->id_len > sizeof(result[num_taxis].id) ? sizeof(result[num_taxis].id) : taxi->id_len;
+            result[num_taxis].id_len = len;
+            memcpy(result[num_taxis].id, taxi->id, len);
+            result[num_taxis].latitude = taxi->latitude;
+            result[num_taxis].longitude = taxi->longitude;
+            memcpy(&result[num_taxis].addr, &taxi->addr, sizeof(result[num_taxis].addr));
+            ++num_taxis;
+        }
+    }
+    *matched_taxis = result;
+    *num_matches = num_taxis;
+    return 0;
+}
+
+/*
+ * Walk the clusters in the location map. Every taxi is in its parents near list.
+ */
+int get_taxi_index_stats(struct taxi_index_stats *stats)
+{
+    struct rbtree *iter;
+    if(!stats) return -1;
+    memset(stats, 0, sizeof(*stats));
+    stats->num_taxis = taxi_db.num_taxis;
+    rbtree_for_each(iter, &taxi_db.taxi_map)
+    {
+        struct taxi_location *parent = rbtree_entry(iter, struct taxi_location, map);
+        ++stats->num_clusters;
+        if(parent->num_taxis > stats->max_cluster)
+            stats->max_cluster = parent->num_taxis;
+        stats->memory += parent->num_taxis * sizeof(*parent->taxi_near_locations);
+        for(int i = 0; i < parent->num_taxis; ++i)
+            stats->memory += sizeof(struct taxi_location) + parent->taxi_near_locations[i]->id_len
+                + _TAXI_MAX_ENTRY_LEN;
+    }
+    return 0;
+}
@@ -5,163 +5,2174 @@
 #include <unistd.h>
 #include <assert.h>
 #include <getopt.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "taxi_utils.h"
 #include "taxi_pack.h"
+#include "taxi_ring.h"
+#include "taxi_stats.h"
+#include "taxi_lz.h"
 #include "taxi_server.h"
 
+#define _TAXI_SERVER_RCVBUF (4 << 20)
+#define _TAXI_CACHE_LINE (64)
+
 static struct server_args
 {
-    int port;
-    int verbose;
-} server_args = {.port = _TAXI_SERVER_PORT, .verbose = 0, };
+    int port;
+    int verbose;
+    int receivers;
+    int ring_slots;
+    int coalesce_window; /* msecs to hold location updates. 0 coalesces per batch */
+    int frag_payload; /* max datagram payload of fragmented replies */
+    int stream; /* accept framed requests over tcp on the same port */
+    int shed_depth; /* queued updates past which location updates are shed. 0 is 3/4 of the ring */
+    int shed_age; /* msecs after which queued location updates are shed. 0 never sheds */
+    int sub_tick; /* msecs between region deltas pushed to subscribers */
+} server_args = {.port = _TAXI_SERVER_PORT, .verbose = 0, .receivers = 1, .ring_slots = 8192,
+                 .coalesce_window = 0, .frag_payload = _TAXI_FRAG_PAYLOAD, .stream = 0,
+                 .shed_depth = 0, .shed_age = 0, .sub_tick = 100, };
+
+/*
+ * Decoded form of a datagram as handed over from a receiver to the index owner.
+ */
+struct taxi_request
+{
+#define _TAXI_EXIT_CMD (0) /* internal: server exit request */
+    unsigned int cmd;
+    int id_len;
+    unsigned char id[MAX_ID_LEN];
+    unsigned short peer_port; /* fetch and ping: customer port taking the ping replies */
+    double latitude;
+    double longitude;
+    struct sockaddr_in addr;
+    unsigned int req_id; /* fragmented fetches */
+    uint64_t frag_mask;
+    int conn; /* stream connection of the request or -1 for datagrams */
+    unsigned int conn_gen;
+    uint64_t received; /* usecs the request was read off the socket */
+    unsigned int barrier; /* fetches: updates queued ahead on the receiver */
+    double latitude_max; /* subscriptions: far corner of the region */
+    double longitude_max;
+    unsigned int lease; /* subscriptions: msecs */
+    unsigned int flags; /* subscriptions: reset, fetches: command word flags */
+};
+
+/*
+ * Counters of a single thread padded out to cache lines of their own.
+ * The index owner only reads them to answer stats requests.
+ */
+struct taxi_counters
+{
+    unsigned long requests[_TAXI_STATS_MAX_CMDS];
+    unsigned long shed[_TAXI_STATS_MAX_CMDS];
+    unsigned long stalls; /* times the ring was found full */
+} __attribute__((aligned(_TAXI_CACHE_LINE)));
+
+/*
+ * Fetches and control requests go on the receivers ring and are served
+ * ahead of the location updates and deletes on its updates ring.
+ */
+struct taxi_receiver
+{
+    int sd;
+    pthread_t tid;
+    struct taxi_ring *ring;
+    struct taxi_ring *updates;
+    unsigned int updates_queued; /* receiver side count of updates */
+    unsigned int updates_done; /* owner side count of updates */
+    void (*stall)(struct taxi_receiver *receiver); /* work to do while stalled */
+    struct taxi_counters counters;
+};
+
+static struct taxi_pipeline
+{
+    struct taxi_receiver *receivers;
+    int num_receivers;
+    int waiting; /* owner is asleep on the wakeup semaphore */
+    sem_t wakeup;
+} taxi_pipeline;
+
+/*
+ * Owned by the index owner: updates shed on age and the latency from receipt to reply.
+ */
+static struct taxi_owner_stats
+{
+    struct taxi_counters counters;
+    struct taxi_histogram latency[_TAXI_STATS_MAX_CMDS];
+    uint64_t started;
+} taxi_owner_stats;
+
+static int stats_slot(unsigned int cmd)
+{
+    unsigned int slot = cmd - _TAXI_CMD_BASE;
+    return slot < _TAXI_STATS_MAX_CMDS ? slot : 0;
+}
+
+static int stream_queue_reply(struct taxi_request *req, unsigned char *buf, int len);
+
+/*
+ * Send a packed reply back to the requester. Takes over the buffer.
+ */
+static int send_reply(struct taxi_receiver *receiver, struct taxi_request *req,
+                      unsigned char *buf, int len)
+{
+    if(req->conn >= 0)
+        return stream_queue_reply(req, buf, len);
+    int nbytes = sendto(receiver->sd, buf, len, 0, (struct sockaddr*)&req->addr, sizeof(req->addr));
+    free(buf);
+    if(nbytes != len)
+    {
+        printf("Couldn't send [%d] bytes to destination\n", len);
+        return -1;
+    }
+    return 0;
+}
+
+static void fetch_taxi_list(struct taxi *taxi_location, struct taxi_entry **entries, int *num_entries)
+{
+    find_taxi_entries_by_location(taxi_location->latitude, taxi_location->longitude,
+                                  entries, num_entries);
+    if(server_args.verbose)
+        printf("Matched [%d] taxis for location [%lg:%lg]\n", *num_entries,
+               taxi_location->latitude, taxi_location->longitude);
+}
+
+/*
+ * Entries in the encoding asked for by the fetch. Compact fetches get the taxis
+ * encoded against the fetch location, with the entries and their encodings
+ * sharing a single allocation.
+ */
+static struct taxi_entry *encode_entries(struct taxi_entry *entries, int num_entries,
+                                         struct taxi_request *req)
+{
+    if(!(req->flags & _TAXI_CMD_V2)) return entries;
+    struct taxi_entry *compact = malloc(num_entries * (sizeof(*compact) + _TAXI_V2_MAX_ENTRY_LEN) + 1);
+    assert(compact);
+    unsigned char *s = (unsigned char*)(compact + num_entries);
+    int ref_latitude = taxi_v2_coord(req->latitude);
+    int ref_longitude = taxi_v2_coord(req->longitude);
+    for(int i = 0; i < num_entries; ++i)
+    {
+        struct taxi taxi;
+        memset(&taxi, 0, sizeof(taxi));
+        taxi.id_len = entries[i].id_len;
+        memcpy(taxi.id, entries[i].id, taxi.id_len);
+        taxi.latitude = entries[i].latitude;
+        taxi.longitude = entries[i].longitude;
+        memcpy(&taxi.addr, entries[i].addr, sizeof(taxi.addr));
+        compact[i] = entries[i];
+        compact[i].buf = s;
+        compact[i].len = taxi_v2_pack_entry(&taxi, ref_latitude, ref_longitude, s);
+        s += compact[i].len;
+    }
+    return compact;
+}
+
+/*
+ * Compress the entries into a reply behind the header. Returns NULL if they don't shrink.
+ */
+static unsigned char *compress_entries(struct taxi_entry *entries, int num_entries, int entries_len,
+                                       unsigned int *header, int header_len, int *p_len)
+{
+    int offset = header_len + sizeof(unsigned int);
+    unsigned char *raw = malloc(entries_len);
+    unsigned char *buf = malloc(offset + entries_len);
+    assert(raw && buf);
+    for(int i = 0, s = 0; i < num_entries; s += entries[i++].len)
+        memcpy(raw + s, entries[i].buf, entries[i].len);
+    int len = taxi_lz_compress(raw, entries_len, buf + offset, entries_len - sizeof(unsigned int));
+    free(raw);
+    if(len < 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    memcpy(buf, header, header_len);
+    *(unsigned int*)buf = htonl(ntohl(header[0]) | _TAXI_CMD_LZ);
+    *(unsigned int*)(buf + header_len) = htonl(entries_len);
+    *p_len = offset + len;
+    return buf;
+}
+
+/*
+ * Send back the taxi list straight out of the entries cached by the index.
+ * Datagrams gather the entries with sendmsg, streams get them copied into one buffer.
+ * Lists compressed for the fetch always go out of a buffer of their own.
+ */
+static int send_taxi_list(struct taxi_entry *entries, int num_entries,
+                          struct taxi_receiver *receiver, struct taxi_request *req)
+{
+    unsigned int header[(_TAXI_LIST_FRAG_HEADER_LEN + _TAXI_V2_HEADER_LEN)/sizeof(unsigned int) + 1];
+    unsigned int v2 = req->flags & _TAXI_CMD_V2;
+    int n = 0;
+    /*
+     * A fetch with a request id gets its reply over a stream as the single
+     * fragment of the reply, so the client can match it to the request.
+     */
+    if(req->conn >= 0 && (req->cmd == _TAXI_FETCH_FRAG_CMD || req->cmd == _TAXI_FETCH_PING_CMD))
+    {
+        header[n++] = htonl(_TAXI_LIST_FRAG_CMD | v2);
+        header[n++] = htonl(req->req_id);
+        header[n++] = htonl(0);
+        header[n++] = htonl(1);
+    }
+    else
+        header[n++] = htonl(_TAXI_LIST_CMD | v2);
+    int count = n++;
+    if(v2)
+    {
+        header[n++] = htonl(taxi_v2_coord(req->latitude));
+        header[n++] = htonl(taxi_v2_coord(req->longitude));
+    }
+    int header_len = n * sizeof(unsigned int);
+    int len = header_len, num_taxis = 0;
+    while(num_taxis < num_entries && len + entries[num_taxis].len <= __MAX_PACKET_LEN)
+        len += entries[num_taxis++].len;
+    header[count] = htonl(num_taxis);
+    if((req->flags & _TAXI_CMD_LZ) && len - header_len > _TAXI_LZ_THRESHOLD)
+    {
+        int lz_len = 0;
+        unsigned char *buf = compress_entries(entries, num_taxis, len - header_len,
+                                              header, header_len, &lz_len);
+        if(buf)
+            return send_reply(receiver, req, buf, lz_len);
+    }
+    if(req->conn < 0 && num_taxis < IOV_MAX)
+    {
+        struct iovec iovs[IOV_MAX];
+        struct msghdr msg;
+        iovs[0].iov_base = header;
+        iovs[0].iov_len = header_len;
+        for(int i = 0; i < num_taxis; ++i)
+        {
+            iovs[i+1].iov_base = (void*)entries[i].buf;
+            iovs[i+1].iov_len = entries[i].len;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &req->addr;
+        msg.msg_namelen = sizeof(req->addr);
+        msg.msg_iov = iovs;
+        msg.msg_iovlen = num_taxis + 1;
+        if(sendmsg(receiver->sd, &msg, 0) != len)
+        {
+            printf("Couldn't send [%d] bytes to destination\n", len);
+            return -1;
+        }
+        return 0;
+    }
+    unsigned char *buf = malloc(len);
+    assert(buf);
+    unsigned char *s = buf;
+    memcpy(s, header, header_len);
+    s += header_len;
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        memcpy(s, entries[i].buf, entries[i].len);
+        s += entries[i].len;
+    }
+    return send_reply(receiver, req, buf, len);
+}
+
+/*
+ * Ping the matched taxis on behalf of the customer straight from the server.
+ * The same packet goes out to every taxi in batches of sendmmsg.
+ */
+static int send_taxis_ping(struct taxi *customer, struct taxi_entry *entries, int num_entries, int sd)
+{
+#define _SEND_BATCH (64)
+    int err = -1;
+    if(!num_entries) return 0;
+    int offset = sizeof(unsigned int) + taxi_packed_size(customer);
+    int num_taxis = 0;
+    int len = offset + 2 * sizeof(unsigned int);
+    while(num_taxis < num_entries && len + entries[num_taxis].len <= __MAX_PACKET_LEN)
+        len += entries[num_taxis++].len;
+    unsigned char *buf = malloc(len);
+    assert(buf);
+    *(unsigned int*)buf = htonl(_TAXI_PING_CMD);
+    taxis_encode(customer, 1, buf + sizeof(unsigned int));
+    unsigned char *s = buf + offset;
+    *(unsigned int*)s = htonl(_TAXI_LIST_CMD);
+    s += sizeof(unsigned int);
+    *(unsigned int*)s = htonl(num_taxis);
+    s += sizeof(unsigned int);
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        memcpy(s, entries[i].buf, entries[i].len);
+        s += entries[i].len;
+    }
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct mmsghdr msgs[_SEND_BATCH];
+    for(int i = 0; i < num_taxis; )
+    {
+        int batch = num_taxis - i;
+        if(batch > _SEND_BATCH) batch = _SEND_BATCH;
+        memset(msgs, 0, sizeof(*msgs) * batch);
+        for(int j = 0; j < batch; ++j)
+        {
+            msgs[j].msg_hdr.msg_name = (void*)entries[i+j].addr;
+            msgs[j].msg_hdr.msg_namelen = sizeof(*entries[i+j].addr);
+            msgs[j].msg_hdr.msg_iov = &iov;
+            msgs[j].msg_hdr.msg_iovlen = 1;
+        }
+        int sent = sendmmsg(sd, msgs, batch, 0);
+        if(sent <= 0)
+        {
+            if(sent < 0 && errno == EINTR) continue;
+            printf("Error sending ping for customer [%.*s] to taxi at [%s:%d]\n",
+                   customer->id_len, customer->id, inet_ntoa(entries[i].addr->sin_addr),
+                   ntohs(entries[i].addr->sin_port));
+            sent = 1; /* skip the taxi */
+        }
+        i += sent;
+    }
+    if(server_args.verbose)
+        printf("Pinged [%d] taxis for customer [%.*s]\n", num_taxis, customer->id_len, customer->id);
+    err = 0;
+    free(buf);
+    return err;
+#undef _SEND_BATCH
+}
+
+/*
+ * Recently sent fragmented replies kept around for re-requests of lost fragments.
+ */
+static struct taxi_reply_cache
+{
+#define _TAXI_REPLY_CACHE (64)
+    struct reply_entry
+    {
+        struct sockaddr_in addr;
+        unsigned int req_id;
+        unsigned char *entries; /* packed taxi entries of the whole reply */
+        unsigned char *lz; /* compressed fragments at the offsets of the entries */
+        unsigned int flags; /* command word flags of the fetch */
+        int ref_latitude; /* compact encoding reference point */
+        int ref_longitude;
+        int offsets[_TAXI_MAX_FRAGS+1]; /* fragment boundaries within the entries */
+        int counts[_TAXI_MAX_FRAGS]; /* taxis per fragment */
+        int lz_lens[_TAXI_MAX_FRAGS]; /* compressed length or 0 to send the entries */
+        int num_frags;
+    } replies[_TAXI_REPLY_CACHE];
+    int next;
+} taxi_reply_cache;
+
+static struct reply_entry *find_reply(struct sockaddr_in *addr, unsigned int req_id)
+{
+    for(int i = 0; i < _TAXI_REPLY_CACHE; ++i)
+    {
+        struct reply_entry *reply = &taxi_reply_cache.replies[i];
+        if(reply->entries && reply->req_id == req_id
+           &&
+           reply->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+           &&
+           reply->addr.sin_port == addr->sin_port)
+            return reply;
+    }
+    return NULL;
+}
+
+/*
+ * Compress the fragments once for all the sends of the reply.
+ * Each fragment either shrinks in place of its entries or goes out as is.
+ */
+static void compress_frags(struct reply_entry *reply)
+{
+    int compressed = 0;
+    reply->lz = malloc(reply->offsets[reply->num_frags] + 1);
+    assert(reply->lz);
+    for(int i = 0; i < reply->num_frags; ++i)
+    {
+        int offset = reply->offsets[i];
+        int len = reply->offsets[i+1] - offset;
+        if(len <= _TAXI_LZ_THRESHOLD) continue;
+        len = taxi_lz_compress(reply->entries + offset, len, reply->lz + offset,
+                               len - sizeof(unsigned int));
+        if(len < 0) continue;
+        reply->lz_lens[i] = len;
+        ++compressed;
+    }
+    if(!compressed)
+    {
+        free(reply->lz);
+        reply->lz = NULL;
+    }
+}
+
+/*
+ * Copy the entries once and split them into fragments on entry boundaries.
+ */
+static struct reply_entry *add_reply(struct taxi_request *req,
+                                     struct taxi_entry *entries, int num_taxis)
+{
+    struct reply_entry *reply = &taxi_reply_cache.replies[taxi_reply_cache.next];
+    taxi_reply_cache.next = (taxi_reply_cache.next + 1) % _TAXI_REPLY_CACHE;
+    if(reply->entries) free(reply->entries);
+    if(reply->lz) free(reply->lz);
+    memset(reply, 0, sizeof(*reply));
+    memcpy(&reply->addr, &req->addr, sizeof(reply->addr));
+    reply->req_id = req->req_id;
+    reply->flags = req->flags & _TAXI_CMD_V2;
+    reply->ref_latitude = taxi_v2_coord(req->latitude);
+    reply->ref_longitude = taxi_v2_coord(req->longitude);
+    int len = 0;
+    for(int i = 0; i < num_taxis; ++i)
+        len += entries[i].len;
+    reply->entries = malloc(len ? len : 1);
+    assert(reply->entries);
+    for(int i = 0, offset = 0; i < num_taxis; offset += entries[i++].len)
+        memcpy(reply->entries + offset, entries[i].buf, entries[i].len);
+
+    int space = server_args.frag_payload - _TAXI_LIST_FRAG_HEADER_LEN - sizeof(unsigned int);
+    if(reply->flags & _TAXI_CMD_V2)
+        space -= _TAXI_V2_HEADER_LEN;
+    int offset = 0;
+    reply->num_frags = 1;
+    for(int i = 0; i < num_taxis; ++i)
+    {
+        int entry_len = entries[i].len;
+        int frag = reply->num_frags - 1;
+        if(reply->counts[frag] > 0
+           &&
+           offset + entry_len - reply->offsets[frag] > space)
+        {
+            if(reply->num_frags == _TAXI_MAX_FRAGS)
+                break; /* truncate the reply */
+            reply->offsets[++frag] = offset;
+            ++reply->num_frags;
+        }
+        ++reply->counts[frag];
+        offset += entry_len;
+    }
+    reply->offsets[reply->num_frags] = offset;
+    if(req->flags & _TAXI_CMD_LZ)
+        compress_frags(reply);
+    return reply;
+}
+
+/*
+ * Send the fragments in the mask (all if 0) in one sendmmsg.
+ */
+static int send_reply_frags(struct reply_entry *reply, uint64_t frag_mask, int sd)
+{
+    unsigned int headers[_TAXI_MAX_FRAGS][(_TAXI_LIST_FRAG_HEADER_LEN + _TAXI_V2_HEADER_LEN)/sizeof(unsigned int) + 2];
+    int header_len = _TAXI_LIST_FRAG_HEADER_LEN + sizeof(unsigned int);
+    if(reply->flags & _TAXI_CMD_V2)
+        header_len += _TAXI_V2_HEADER_LEN;
+    struct iovec iovs[_TAXI_MAX_FRAGS][2];
+    struct mmsghdr msgs[_TAXI_MAX_FRAGS];
+    int num_msgs = 0;
+    for(int i = 0; i < reply->num_frags; ++i)
+    {
+        if(frag_mask && !(frag_mask & (1ULL << i))) continue;
+        headers[num_msgs][0] = htonl(_TAXI_LIST_FRAG_CMD | reply->flags);
+        headers[num_msgs][1] = htonl(reply->req_id);
+        headers[num_msgs][2] = htonl(i);
+        headers[num_msgs][3] = htonl(reply->num_frags);
+        headers[num_msgs][4] = htonl(reply->counts[i]);
+        headers[num_msgs][5] = htonl(reply->ref_latitude);
+        headers[num_msgs][6] = htonl(reply->ref_longitude);
+        iovs[num_msgs][0].iov_base = headers[num_msgs];
+        iovs[num_msgs][0].iov_len = header_len;
+        iovs[num_msgs][1].iov_base = reply->entries + reply->offsets[i];
+        iovs[num_msgs][1].iov_len = reply->offsets[i+1] - reply->offsets[i];
+        if(reply->lz_lens[i])
+        {
+            headers[num_msgs][0] = htonl(_TAXI_LIST_FRAG_CMD | reply->flags | _TAXI_CMD_LZ);
+            headers[num_msgs][header_len/sizeof(unsigned int)] = htonl(iovs[num_msgs][1].iov_len);
+            iovs[num_msgs][0].iov_len += sizeof(unsigned int);
+            iovs[num_msgs][1].iov_base = reply->lz + reply->offsets[i];
+            iovs[num_msgs][1].iov_len = reply->lz_lens[i];
+        }
+        memset(&msgs[num_msgs], 0, sizeof(msgs[num_msgs]));
+        msgs[num_msgs].msg_hdr.msg_name = &reply->addr;
+        msgs[num_msgs].msg_hdr.msg_namelen = sizeof(reply->addr);
+        msgs[num_msgs].msg_hdr.msg_iov = iovs[num_msgs];
+        msgs[num_msgs].msg_hdr.msg_iovlen = 2;
+        ++num_msgs;
+    }
+    for(int sent = 0; sent < num_msgs; )
+    {
+        int err = sendmmsg(sd, msgs + sent, num_msgs - sent, 0);
+        if(err <= 0)
+        {
+            if(err < 0 && errno == EINTR) continue;
+            printf("Couldn't send fragment [%d] of request [%u] to destination\n",
+                   sent, reply->req_id);
+            return -1;
+        }
+        sent += err;
+    }
+    return 0;
+}
+
+static void taxi_pipeline_wakeup(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&taxi_pipeline.waiting, 0, __ATOMIC_SEQ_CST))
+        sem_post(&taxi_pipeline.wakeup);
+}
+
+static int taxi_pipeline_pending(void)
+{
+    for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+    {
+        if(taxi_ring_count(taxi_pipeline.receivers[i].ring) > 0
+           ||
+           taxi_ring_count(taxi_pipeline.receivers[i].updates) > 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sleep till a receiver queues work or the deadline (usecs since epoch) expires.
+ */
+static void taxi_pipeline_wait(uint64_t deadline)
+{
+    __atomic_store_n(&taxi_pipeline.waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!taxi_pipeline_pending())
+    {
+        if(!deadline)
+        {
+            while(sem_wait(&taxi_pipeline.wakeup) < 0 && errno == EINTR);
+        }
+        else
+        {
+            struct timespec ts = { .tv_sec = deadline / 1000000, .tv_nsec = (deadline % 1000000) * 1000 };
+            while(sem_timedwait(&taxi_pipeline.wakeup, &ts) < 0 && errno == EINTR);
+        }
+    }
+    __atomic_store_n(&taxi_pipeline.waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Get a free slot in one of the receivers rings. Stall till the owner catches up
+ * leaving the overflow in the socket buffer.
+ */
+static struct taxi_request *reserve_request(struct taxi_receiver *receiver, struct taxi_ring *ring)
+{
+    struct taxi_request *req;
+    while(!(req = taxi_ring_reserve(ring)))
+    {
+        ++receiver->counters.stalls;
+        taxi_pipeline_wakeup();
+        if(receiver->stall)
+            receiver->stall(receiver);
+        sched_yield();
+    }
+    return req;
+}
+
+static int is_update(unsigned int cmd)
+{
+    return cmd == _TAXI_LOCATION_CMD || cmd == _TAXI_DELETE_CMD;
+}
+
+/*
+ * Admit a request into the ring of its class. Location updates are shed
+ * rather than held once the updates queue is too deep, so that the socket
+ * buffer keeps draining and fetches behind them are not dropped.
+ * Fetches remember how many updates were queued ahead of them.
+ */
+static struct taxi_request *admit_request(struct taxi_receiver *receiver, unsigned int cmd)
+{
+    struct taxi_request *req;
+    ++receiver->counters.requests[stats_slot(cmd)];
+    if(!is_update(cmd))
+    {
+        req = reserve_request(receiver, receiver->ring);
+        req->barrier = receiver->updates_queued;
+        return req;
+    }
+    if(cmd == _TAXI_LOCATION_CMD
+       &&
+       taxi_ring_count(receiver->updates) >= server_args.shed_depth)
+    {
+        ++receiver->counters.shed[stats_slot(cmd)];
+        return NULL;
+    }
+    req = reserve_request(receiver, receiver->updates);
+    ++receiver->updates_queued;
+    return req;
+}
+
+static void commit_request(struct taxi_receiver *receiver, struct taxi_request *req)
+{
+    taxi_ring_commit(is_update(req->cmd) ? receiver->updates : receiver->ring);
+}
+
+/*
+ * Decode a datagram or a stream frame into a request record on the receivers rings.
+ * Returns the number of records queued.
+ */
+static int decode_request(struct taxi_receiver *receiver, unsigned char *buf, int bytes,
+                          struct sockaddr_in *dest, int conn, unsigned int conn_gen,
+                          uint64_t now)
+{
+    if(server_args.verbose)
+        printf("Got [%d] bytes of data from dest [%s], port [%d]\n", 
+               bytes, inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
+    unsigned char *s = buf;
+    struct taxi_request *req;
+    if(bytes < sizeof(unsigned int))
+    {
+        printf("Request too short\n");
+        return 0;
+    }
+    if(bytes == sizeof(unsigned int))
+    {
+        /*
+         * exit request.
+         */
+        req = admit_request(receiver, _TAXI_EXIT_CMD);
+        unsigned int barrier = req->barrier;
+        memset(req, 0, sizeof(*req));
+        req->cmd = _TAXI_EXIT_CMD;
+        req->conn = -1;
+        req->barrier = barrier;
+        commit_request(receiver, req);
+        return 1;
+    }
+    unsigned int cmd = ntohl(*(unsigned int*)s);
+    unsigned int flags = cmd & ~_TAXI_CMD_MASK;
+    cmd = _TAXI_CMD(cmd);
+    bytes -= sizeof(unsigned int);
+    s += sizeof(unsigned int);
+
+    switch(cmd)
+    {
+    case _TAXI_LOCATION_CMD:
+    case _TAXI_DELETE_CMD:
+    case _TAXI_FETCH_CMD:
+    case _TAXI_FETCH_PING_CMD:
+    case _TAXI_FETCH_FRAG_CMD:
+        {
+            unsigned int req_id = 0;
+            uint64_t frag_mask = 0;
+            if(cmd == _TAXI_FETCH_PING_CMD || cmd == _TAXI_FETCH_FRAG_CMD)
+            {
+                if(bytes < _TAXI_FETCH_FRAG_HEADER_LEN)
+                {
+                    printf("Fetch request header too short\n");
+                    return 0;
+                }
+                req_id = ntohl(*(unsigned int*)s);
+                frag_mask = (uint64_t)ntohl(*(unsigned int*)(s + sizeof(unsigned int))) << 32;
+                frag_mask |= ntohl(*(unsigned int*)(s + 2*sizeof(unsigned int)));
+                s += _TAXI_FETCH_FRAG_HEADER_LEN;
+                bytes -= _TAXI_FETCH_FRAG_HEADER_LEN;
+            }
+            struct taxi taxi = {0};
+            if(taxi_unpack(s, &bytes, &taxi) < 0)
+            {
+                printf("Error unpacking taxi data for command [%#x]\n", cmd);
+                return 0;
+            }
+            req = admit_request(receiver, cmd);
+            if(!req) return 0;
+            req->cmd = cmd;
+            req->id_len = taxi.id_len;
+            memcpy(req->id, taxi.id, sizeof(req->id));
+            req->latitude = taxi.latitude;
+            req->longitude = taxi.longitude;
+            req->peer_port = taxi.addr.sin_port;
+            memcpy(&req->addr, dest, sizeof(req->addr));
+            req->req_id = req_id;
+            req->frag_mask = frag_mask;
+            req->flags = flags;
+            req->conn = conn;
+            req->conn_gen = conn_gen;
+            req->received = now;
+            /*
+             * Taxis reporting over a stream are reached on the datagram port they pack.
+             */
+            if(conn >= 0 && req->peer_port)
+                req->addr.sin_port = req->peer_port;
+            commit_request(receiver, req);
+        }
+        return 1;
+
+    case _TAXI_LOCATION_BATCH_CMD:
+        {
+            struct taxi_view view;
+            struct taxi_view_entry entry;
+            int queued = 0;
+            if(bytes < sizeof(unsigned int))
+            {
+                printf("Location batch header too short\n");
+                return 0;
+            }
+            unsigned short peer_port = (unsigned short)*(unsigned int*)s; /* network order */
+            s += sizeof(unsigned int);
+            bytes -= sizeof(unsigned int);
+            if(taxis_view_init(&view, s, &bytes, 0) < 0)
+            {
+                printf("Error unpacking the location batch\n");
+                return 0;
+            }
+            ++receiver->counters.requests[stats_slot(cmd)];
+            /*
+             * Each taxi is admitted as a location update of its own so that
+             * shedding, coalescing and the fetch barriers treat them alike.
+             */
+            while(taxi_view_next(&view, &entry) > 0)
+            {
+                struct taxi taxi;
+                req = admit_request(receiver, _TAXI_LOCATION_CMD);
+                if(!req) continue;
+                taxi_view_entry_copy(&entry, &taxi);
+                req->cmd = _TAXI_LOCATION_CMD;
+                req->id_len = taxi.id_len;
+                memcpy(req->id, taxi.id, sizeof(req->id));
+                req->latitude = taxi.latitude;
+                req->longitude = taxi.longitude;
+                req->peer_port = peer_port;
+                memcpy(&req->addr, dest, sizeof(req->addr));
+                if(conn >= 0 && req->peer_port)
+                    req->addr.sin_port = req->peer_port;
+                req->req_id = 0;
+                req->frag_mask = 0;
+                req->flags = 0;
+                req->conn = conn;
+                req->conn_gen = conn_gen;
+                req->received = now;
+                commit_request(receiver, req);
+                ++queued;
+            }
+            return queued;
+        }
+
+    case _TAXI_SUBSCRIBE_CMD:
+        {
+            struct taxi *corners = NULL;
+            int num_corners = 0;
+            if(bytes < _TAXI_SUBSCRIBE_HEADER_LEN)
+            {
+                printf("Subscribe request header too short\n");
+                return 0;
+            }
+            unsigned int *header = (unsigned int*)s;
+            bytes -= _TAXI_SUBSCRIBE_HEADER_LEN;
+            if(taxis_unpack(s + _TAXI_SUBSCRIBE_HEADER_LEN, &bytes, &corners, &num_corners) < 0
+               ||
+               num_corners != 2)
+            {
+                printf("Error unpacking the subscription region\n");
+                if(corners) free(corners);
+                return 0;
+            }
+            req = admit_request(receiver, cmd);
+            req->cmd = cmd;
+            req->req_id = ntohl(header[0]);
+            req->lease = ntohl(header[1]);
+            req->flags = ntohl(header[2]);
+            req->latitude = corners[0].latitude < corners[1].latitude ? corners[0].latitude : corners[1].latitude;
+            req->latitude_max = corners[0].latitude < corners[1].latitude ? corners[1].latitude : corners[0].latitude;
+            req->longitude = corners[0].longitude < corners[1].longitude ? corners[0].longitude : corners[1].longitude;
+            req->longitude_max = corners[0].longitude < corners[1].longitude ? corners[1].longitude : corners[0].longitude;
+            memcpy(&req->addr, dest, sizeof(req->addr));
+            req->conn = conn;
+            req->conn_gen = conn_gen;
+            req->received = now;
+            commit_request(receiver, req);
+            free(corners);
+        }
+        return 1;
+
+    case _TAXI_STATS_CMD:
+        if(bytes < sizeof(unsigned int))
+        {
+            printf("Stats request too short\n");
+            return 0;
+        }
+        req = admit_request(receiver, cmd);
+        req->cmd = cmd;
+        req->req_id = ntohl(*(unsigned int*)s);
+        memcpy(&req->addr, dest, sizeof(req->addr));
+        req->conn = conn;
+        req->conn_gen = conn_gen;
+        req->received = now;
+        commit_request(receiver, req);
+        return 1;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+static void *taxi_receiver_thread(void *arg)
+{
+#define _RECV_BATCH (32)
+    struct taxi_receiver *receiver = arg;
+    struct mmsghdr msgs[_RECV_BATCH];
+    struct iovec iovecs[_RECV_BATCH];
+    struct sockaddr_in addrs[_RECV_BATCH];
+    unsigned char *bufs = calloc(_RECV_BATCH, 0xffff+1);
+    assert(bufs != NULL);
+    for(;;)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i = 0; i < _RECV_BATCH; ++i)
+        {
+            iovecs[i].iov_base = bufs + i * (0xffff+1);
+            iovecs[i].iov_len = 0xffff+1;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        int nmsgs = recvmmsg(receiver->sd, msgs, _RECV_BATCH, MSG_WAITFORONE, NULL);
+        if(nmsgs <= 0)
+        {
+            if(nmsgs == 0 || errno == EINTR) continue;
+            perror("recvmmsg server error. receiver exiting:");
+            break;
+        }
+        int queued = 0;
+        uint64_t now = forward_clock();
+        for(int i = 0; i < nmsgs; ++i)
+        {
+            if(!msgs[i].msg_len) continue;
+            queued += decode_request(receiver, iovecs[i].iov_base, msgs[i].msg_len, &addrs[i], -1, 0, now);
+        }
+        if(queued)
+            taxi_pipeline_wakeup();
+    }
+    free(bufs);
+    return NULL;
+#undef _RECV_BATCH
+}
+
+/*
+ * Stream transport. One thread owns the listener and every connection,
+ * decodes length prefixed frames carrying the datagram encoding onto its ring
+ * and writes back the replies the owner queues on the reply ring.
+ * Replies for a connection are batched into one write per loop.
+ */
+struct taxi_conn
+{
+    int fd;
+    unsigned int gen;
+    struct sockaddr_in addr;
+    unsigned char *in;
+    int in_len;
+    int in_size;
+    unsigned char *out;
+    int out_off;
+    int out_len;
+    int out_size;
+    int dirty; /* output queued since the last flush */
+    int want_out; /* waiting for the socket to drain */
+};
+
+struct stream_reply
+{
+    int conn;
+    unsigned int gen;
+    unsigned char *buf;
+    int len;
+};
+
+static struct taxi_stream
+{
+    int listen_sd;
+    int epfd;
+    int evfd;
+    unsigned int gen;
+    struct taxi_receiver *receiver;
+    struct taxi_ring *replies;
+    struct taxi_conn **conns; /* indexed by fd */
+    int max_conns;
+    int *dirty; /* fds to flush */
+    int num_dirty;
+    int replies_queued; /* owner side: replies queued since the last kick */
+} taxi_stream = { .listen_sd = -1, .epfd = -1, .evfd = -1, };
+
+/*
+ * Owner side. The stream thread is kicked once per drained batch.
+ */
+static int stream_queue_reply(struct taxi_request *req, unsigned char *buf, int len)
+{
+    struct stream_reply *reply;
+    while(!(reply = taxi_ring_reserve(taxi_stream.replies)))
+    {
+        uint64_t v = 1;
+        write(taxi_stream.evfd, &v, sizeof(v));
+        sched_yield();
+    }
+    reply->conn = req->conn;
+    reply->gen = req->conn_gen;
+    reply->buf = buf;
+    reply->len = len;
+    taxi_ring_commit(taxi_stream.replies);
+    ++taxi_stream.replies_queued;
+    return 0;
+}
+
+static void stream_kick(void)
+{
+    if(!taxi_stream.replies_queued) return;
+    taxi_stream.replies_queued = 0;
+    uint64_t v = 1;
+    write(taxi_stream.evfd, &v, sizeof(v));
+}
+
+static void stream_mark_dirty(struct taxi_conn *conn)
+{
+    if(conn->dirty) return;
+    conn->dirty = 1;
+    taxi_stream.dirty = realloc(taxi_stream.dirty, sizeof(*taxi_stream.dirty) * (taxi_stream.num_dirty+1));
+    assert(taxi_stream.dirty != NULL);
+    taxi_stream.dirty[taxi_stream.num_dirty++] = conn->fd;
+}
+
+/*
+ * Move the queued replies into the connection output buffers.
+ * Safe to call while stalled in the middle of decoding a connection.
+ */
+static void stream_drain_replies(void)
+{
+    struct stream_reply *reply;
+    while((reply = taxi_ring_peek(taxi_stream.replies)))
+    {
+        struct taxi_conn *conn = NULL;
+        if(reply->conn < taxi_stream.max_conns)
+            conn = taxi_stream.conns[reply->conn];
+        if(conn && conn->gen == reply->gen)
+        {
+            int need = conn->out_len + sizeof(unsigned int) + reply->len;
+            if(need > conn->out_size)
+            {
+                while(conn->out_size < need)
+                    conn->out_size = conn->out_size ? conn->out_size << 1 : 4096;
+                conn->out = realloc(conn->out, conn->out_size);
+                assert(conn->out != NULL);
+            }
+            *(unsigned int*)(conn->out + conn->out_len) = htonl(reply->len);
+            memcpy(conn->out + conn->out_len + sizeof(unsigned int), reply->buf, reply->len);
+            conn->out_len += sizeof(unsigned int) + reply->len;
+            stream_mark_dirty(conn);
+        }
+        free(reply->buf);
+        taxi_ring_release(taxi_stream.replies);
+    }
+}
+
+static void stream_stall(struct taxi_receiver *receiver)
+{
+    stream_drain_replies();
+}
+
+static void stream_close(struct taxi_conn *conn)
+{
+    if(server_args.verbose)
+        printf("Closing stream from [%s:%d]\n", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+    epoll_ctl(taxi_stream.epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    taxi_stream.conns[conn->fd] = NULL;
+    close(conn->fd);
+    if(conn->in) free(conn->in);
+    if(conn->out) free(conn->out);
+    free(conn);
+}
+
+static void stream_accept(void)
+{
+    for(;;)
+    {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept4(taxi_stream.listen_sd, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK);
+        if(fd < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept stream error:");
+            return;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if(fd >= taxi_stream.max_conns)
+        {
+            int max_conns = taxi_stream.max_conns ? taxi_stream.max_conns : 64;
+            while(max_conns <= fd) max_conns <<= 1;
+            taxi_stream.conns = realloc(taxi_stream.conns, sizeof(*taxi_stream.conns) * max_conns);
+            assert(taxi_stream.conns != NULL);
+            memset(taxi_stream.conns + taxi_stream.max_conns, 0,
+                   sizeof(*taxi_stream.conns) * (max_conns - taxi_stream.max_conns));
+            taxi_stream.max_conns = max_conns;
+        }
+        struct taxi_conn *conn = calloc(1, sizeof(*conn));
+        assert(conn != NULL);
+        conn->fd = fd;
+        conn->gen = ++taxi_stream.gen;
+        memcpy(&conn->addr, &addr, sizeof(conn->addr));
+        taxi_stream.conns[fd] = conn;
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+        if(epoll_ctl(taxi_stream.epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            perror("epoll_ctl stream error:");
+            stream_close(conn);
+            continue;
+        }
+        if(server_args.verbose)
+            printf("Accepted stream from [%s:%d]\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    }
+}
+
+/*
+ * Read what is available and decode every complete frame.
+ * Returns the number of requests queued or -1 if the connection is done.
+ */
+static int stream_read(struct taxi_conn *conn)
+{
+    int queued = 0, done = 0;
+    for(;;)
+    {
+        if(conn->in_size - conn->in_len < 4096)
+        {
+            conn->in_size = conn->in_size ? conn->in_size << 1 : 8192;
+            conn->in = realloc(conn->in, conn->in_size);
+            assert(conn->in != NULL);
+        }
+        int nbytes = read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+        if(nbytes < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) done = 1;
+            break;
+        }
+        if(!nbytes)
+        {
+            done = 1;
+            break;
+        }
+        conn->in_len += nbytes;
+        if(conn->in_len < conn->in_size) break;
+    }
+    unsigned char *s = conn->in;
+    int len = conn->in_len;
+    uint64_t now = forward_clock();
+    while(len >= sizeof(unsigned int))
+    {
+        unsigned int frame_len = ntohl(*(unsigned int*)s);
+        if(frame_len < sizeof(unsigned int) || frame_len > __MAX_PACKET_LEN)
+        {
+            printf("Bad frame length [%u] on stream from [%s]\n", frame_len, inet_ntoa(conn->addr.sin_addr));
+            return -1;
+        }
+        if(len < sizeof(unsigned int) + frame_len) break;
+        queued += decode_request(taxi_stream.receiver, s + sizeof(unsigned int), frame_len,
+                                 &conn->addr, conn->fd, conn->gen, now);
+        s += sizeof(unsigned int) + frame_len;
+        len -= sizeof(unsigned int) + frame_len;
+    }
+    if(len > 0 && s != conn->in)
+        memmove(conn->in, s, len);
+    conn->in_len = len;
+    if(done)
+    {
+        if(queued) taxi_pipeline_wakeup();
+        return -1;
+    }
+    return queued;
+}
+
+static void stream_flush(void)
+{
+    for(int i = 0; i < taxi_stream.num_dirty; ++i)
+    {
+        int fd = taxi_stream.dirty[i];
+        struct taxi_conn *conn = taxi_stream.conns[fd];
+        if(!conn || !conn->dirty) continue;
+        conn->dirty = 0;
+        while(conn->out_off < conn->out_len)
+        {
+            int nbytes = send(fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+            if(nbytes < 0)
+            {
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                stream_close(conn);
+                conn = NULL;
+                break;
+            }
+            conn->out_off += nbytes;
+        }
+        if(!conn) continue;
+        int want_out = conn->out_off < conn->out_len;
+        if(!want_out)
+            conn->out_off = conn->out_len = 0;
+        if(want_out != conn->want_out)
+        {
+            struct epoll_event event = { .events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.fd = fd };
+            epoll_ctl(taxi_stream.epfd, EPOLL_CTL_MOD, fd, &event);
+            conn->want_out = want_out;
+        }
+    }
+    taxi_stream.num_dirty = 0;
+}
+
+static void *taxi_stream_thread(void *arg)
+{
+#define _STREAM_EVENTS (64)
+    struct epoll_event events[_STREAM_EVENTS];
+    for(;;)
+    {
+        int nevents = epoll_wait(taxi_stream.epfd, events, _STREAM_EVENTS, -1);
+        if(nevents < 0)
+        {
+            if(errno == EINTR) continue;
+            perror("epoll_wait stream error. stream exiting:");
+            break;
+        }
+        int queued = 0;
+        for(int i = 0; i < nevents; ++i)
+        {
+            int fd = events[i].data.fd;
+            if(fd == taxi_stream.listen_sd)
+            {
+                stream_accept();
+                continue;
+            }
+            if(fd == taxi_stream.evfd)
+            {
+                uint64_t v;
+                read(fd, &v, sizeof(v));
+                continue;
+            }
+            struct taxi_conn *conn = fd < taxi_stream.max_conns ? taxi_stream.conns[fd] : NULL;
+            if(!conn) continue;
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                int err = stream_read(conn);
+                if(err < 0)
+                {
+                    stream_close(conn);
+                    continue;
+                }
+                queued += err;
+            }
+            if(events[i].events & EPOLLOUT)
+                stream_mark_dirty(conn);
+        }
+        if(queued)
+            taxi_pipeline_wakeup();
+        stream_drain_replies();
+        stream_flush();
+    }
+    return NULL;
+#undef _STREAM_EVENTS
+}
+
+static int taxi_stream_start(const char *ip, int port, struct taxi_receiver *receiver)
+{
+    int err = -1;
+    struct sockaddr_in addr;
+    int sd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(sd < 0)
+        goto out;
+    int on = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(port);
+    if(ip)
+        get_server_addr(ip, &addr);
+    else
+        addr.sin_addr.s_addr = INADDR_ANY;
+    if(bind(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sd, 128) < 0)
+    {
+        perror("stream listen error:");
+        goto out_close;
+    }
+    taxi_stream.listen_sd = sd;
+    taxi_stream.receiver = receiver;
+    /*
+     * Pings on behalf of stream customers go out on a datagram socket.
+     */
+    receiver->sd = taxi_pipeline.receivers[0].sd;
+    receiver->stall = stream_stall;
+    taxi_stream.replies = taxi_ring_create(server_args.ring_slots, sizeof(struct stream_reply));
+    assert(taxi_stream.replies != NULL);
+    taxi_stream.evfd = eventfd(0, EFD_NONBLOCK);
+    taxi_stream.epfd = epoll_create1(0);
+    if(taxi_stream.evfd < 0 || taxi_stream.epfd < 0)
+    {
+        perror("stream eventfd/epoll error:");
+        goto out_close;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = sd };
+    epoll_ctl(taxi_stream.epfd, EPOLL_CTL_ADD, sd, &event);
+    event.data.fd = taxi_stream.evfd;
+    epoll_ctl(taxi_stream.epfd, EPOLL_CTL_ADD, taxi_stream.evfd, &event);
+    if(pthread_create(&receiver->tid, NULL, taxi_stream_thread, NULL))
+    {
+        fprintf(stderr, "Error creating stream thread: [%s]\n", strerror(errno));
+        goto out_close;
+    }
+    pthread_detach(receiver->tid);
+    err = 0;
+    goto out;
+
+    out_close:
+    close(sd);
+    out:
+    return err;
+}
+
+static void request_to_taxi(struct taxi_request *req, struct taxi *taxi)
+{
+    memset(taxi, 0, sizeof(*taxi));
+    taxi->id_len = req->id_len;
+    memcpy(taxi->id, req->id, sizeof(taxi->id));
+    taxi->latitude = req->latitude;
+    taxi->longitude = req->longitude;
+    memcpy(&taxi->addr, &req->addr, sizeof(taxi->addr));
+}
+
+/*
+ * Location updates are held back per taxi id and only the latest one
+ * is applied to the index when the window expires or at the end of each
+ * drained batch if there is no window.
+ * Pending entries are kept in arrival order so the expired ones are always a prefix.
+ */
+struct taxi_pending
+{
+    struct taxi_request req;
+    uint64_t first_seen;
+    int slot; /* in the id hash, -1 once out of it */
+};
+
+/*
+ * Flushed updates are applied grouped by the index cell they land in.
+ */
+struct taxi_pending_order
+{
+    uint64_t cell;
+    int index;
+};
+
+static struct taxi_coalescer
+{
+#define _TAXI_PENDING_MAX (1 << 16)
+    struct taxi_pending *pending;
+    struct taxi_pending_order *order;
+    struct taxi *flushed; /* the ordered updates handed to the index */
+    int num_pending;
+    int *slots; /* id hash of pending index + 1 */
+    unsigned int mask;
+    unsigned long updates;
+    unsigned long merged;
+    unsigned long cancelled; /* pending updates dropped by a delete */
+} taxi_coalescer;
+
+static unsigned int taxi_id_hash(const unsigned char *id, int id_len)
+{
+    unsigned int hash = 2166136261U;
+    for(int i = 0; i < id_len; ++i)
+    {
+        hash ^= id[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void coalescer_init(void)
+{
+    taxi_coalescer.pending = calloc(_TAXI_PENDING_MAX, sizeof(*taxi_coalescer.pending));
+    assert(taxi_coalescer.pending != NULL);
+    taxi_coalescer.order = calloc(_TAXI_PENDING_MAX, sizeof(*taxi_coalescer.order));
+    assert(taxi_coalescer.order != NULL);
+    taxi_coalescer.flushed = calloc(_TAXI_PENDING_MAX, sizeof(*taxi_coalescer.flushed));
+    assert(taxi_coalescer.flushed != NULL);
+    taxi_coalescer.mask = (_TAXI_PENDING_MAX << 1) - 1;
+    taxi_coalescer.slots = calloc(taxi_coalescer.mask + 1, sizeof(*taxi_coalescer.slots));
+    assert(taxi_coalescer.slots != NULL);
+}
+
+/*
+ * Returns the hash slot holding the id or the free slot to insert it at.
+ */
+static int *coalescer_slot(const unsigned char *id, int id_len)
+{
+    unsigned int index = taxi_id_hash(id, id_len) & taxi_coalescer.mask;
+    for(;;)
+    {
+        int *slot = &taxi_coalescer.slots[index];
+        if(!*slot) return slot;
+        struct taxi_request *req = &taxi_coalescer.pending[*slot - 1].req;
+        if(req->id_len == id_len && !memcmp(req->id, id, id_len))
+            return slot;
+        index = (index + 1) & taxi_coalescer.mask;
+    }
+}
+
+/*
+ * Drop the flushed prefix of the pending updates. Only the slots they and
+ * the updates left hold are cleared before the ones left go back in.
+ */
+static void coalescer_rehash(int flushed)
+{
+    for(int i = 0; i < taxi_coalescer.num_pending; ++i)
+    {
+        if(taxi_coalescer.pending[i].slot >= 0)
+            taxi_coalescer.slots[taxi_coalescer.pending[i].slot] = 0;
+    }
+    taxi_coalescer.num_pending -= flushed;
+    memmove(taxi_coalescer.pending, taxi_coalescer.pending + flushed,
+            sizeof(*taxi_coalescer.pending) * taxi_coalescer.num_pending);
+    for(int i = 0; i < taxi_coalescer.num_pending; ++i)
+    {
+        struct taxi_pending *pending = &taxi_coalescer.pending[i];
+        pending->slot = -1;
+        if(pending->req.id_len < 0) continue;
+        int *slot = coalescer_slot(pending->req.id, pending->req.id_len);
+        *slot = i + 1;
+        pending->slot = slot - taxi_coalescer.slots;
+    }
+}
+
+static void subscriptions_note(struct taxi *taxi, int deleted);
+
+static uint64_t pending_cell(struct taxi_request *req)
+{
+    unsigned int lat = (unsigned int)((req->latitude + 90) / TAXI_DISTANCE_BIAS);
+    unsigned int lon = (unsigned int)((req->longitude + 180) / TAXI_DISTANCE_BIAS);
+    return (uint64_t)lat << 32 | lon;
+}
 
-static void fetch_taxi_list(struct taxi *taxi_location, struct taxi **taxis, int *num_taxis)
+static int pending_order_cmp(const void *a, const void *b)
 {
-    find_taxis_by_location(taxi_location->latitude, taxi_location->longitude,
-                           taxis, num_taxis);
+    const struct taxi_pending_order *x = a, *y = b;
+    if(x->cell != y->cell) return x->cell < y->cell ? -1 : 1;
+    return x->index - y->index;
 }
 
 /*
- * Pack and send back the taxi list for this location.
+ * Apply the pending updates seen before the cutoff. There is a single pending
+ * update per taxi so they can be reordered: the updates of a cell are handed
+ * to the index together and it sorts each cluster they grow once.
+ * Cells keep the order of their first update as clusters form around
+ * the taxis added first.
  */
-static int send_taxi_list(struct taxi *taxi, struct taxi *taxis, int num_taxis, int sd, 
-                          struct sockaddr *dest, socklen_t addrlen)
+static void coalescer_flush(uint64_t cutoff)
 {
-    printf("Matched [%d] taxis for location [%lg:%lg]\n", num_taxis,
-           taxi->latitude, taxi->longitude);
-    int len = 1024, err = -1;
-    unsigned char *buf = calloc(1, len);
-    assert(buf);
-    buf = taxi_list_pack_with_buf(taxis, num_taxis, &buf, &len, 0);
-    assert(buf);
-    int nbytes = sendto(sd, buf, len, 0, dest, addrlen);
-    if(nbytes != len)
+    int i, n = 0;
+    for(i = 0; i < taxi_coalescer.num_pending; ++i)
     {
-        printf("Couldn't send [%d] bytes to destination\n", len);
-        goto out_free;
+        struct taxi_pending *pending = &taxi_coalescer.pending[i];
+        if(pending->first_seen > cutoff) break;
+        if(pending->req.id_len < 0) continue; /* cancelled by a delete */
+        taxi_coalescer.order[n].cell = pending_cell(&pending->req);
+        taxi_coalescer.order[n++].index = i;
     }
-    err = 0;
+    if(!i) return;
+    if(n > 1)
+    {
+        struct taxi_pending_order *order = taxi_coalescer.order;
+        qsort(order, n, sizeof(*order), pending_order_cmp);
+        uint64_t cell = order[0].cell;
+        for(int j = 0, first = 0; j < n; ++j)
+        {
+            if(order[j].cell != cell)
+            {
+                cell = order[j].cell;
+                first = j;
+            }
+            order[j].cell = order[first].index;
+        }
+        qsort(order, n, sizeof(*order), pending_order_cmp);
+    }
+    for(int j = 0; j < n; ++j)
+        request_to_taxi(&taxi_coalescer.pending[taxi_coalescer.order[j].index].req,
+                        &taxi_coalescer.flushed[j]);
+    add_taxis(taxi_coalescer.flushed, n); /* add the taxis into the db*/
+    for(int j = 0; j < n; ++j)
+        subscriptions_note(&taxi_coalescer.flushed[j], 0);
+    coalescer_rehash(i);
+}
 
-    out_free:
-    if(buf)
-        free(buf);
-    return err;
+static void coalescer_update(struct taxi_request *req, uint64_t now)
+{
+    ++taxi_coalescer.updates;
+    int *slot = coalescer_slot(req->id, req->id_len);
+    if(*slot)
+    {
+        struct taxi_request *pending = &taxi_coalescer.pending[*slot - 1].req;
+        pending->latitude = req->latitude;
+        pending->longitude = req->longitude;
+        memcpy(&pending->addr, &req->addr, sizeof(pending->addr));
+        ++taxi_coalescer.merged;
+        return;
+    }
+    if(taxi_coalescer.num_pending == _TAXI_PENDING_MAX)
+    {
+        coalescer_flush(now);
+        slot = coalescer_slot(req->id, req->id_len);
+    }
+    struct taxi_pending *pending = &taxi_coalescer.pending[taxi_coalescer.num_pending++];
+    memcpy(&pending->req, req, sizeof(pending->req));
+    pending->first_seen = now;
+    pending->slot = slot - taxi_coalescer.slots;
+    *slot = taxi_coalescer.num_pending;
 }
 
-static int process_request(int sd, unsigned char *buf, int bytes, struct sockaddr_in *dest, socklen_t addrlen)
+/*
+ * A delete supersedes the pending update for the taxi.
+ */
+static void coalescer_cancel(struct taxi_request *req)
 {
-    int err = -1;
-    printf("Got [%d] bytes of data from dest [%s], port [%d]\n", 
-           bytes, inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
-    unsigned char *s = buf;
-    if(bytes < sizeof(unsigned int))
+    int *slot = coalescer_slot(req->id, req->id_len);
+    if(!*slot) return;
+    taxi_coalescer.pending[*slot - 1].req.id_len = -1;
+    ++taxi_coalescer.cancelled;
+}
+
+static uint64_t coalescer_deadline(void)
+{
+    if(!taxi_coalescer.num_pending) return 0;
+    return taxi_coalescer.pending[0].first_seen + server_args.coalesce_window * 1000ULL;
+}
+
+/*
+ * Region subscriptions. Changes to the index are logged as they are applied
+ * and matched against every subscription once per tick. A subscription keeps
+ * the taxis it last reported inside its region to tell enters, moves and
+ * leaves apart and to skip taxis reporting the same location.
+ */
+struct taxi_member
+{
+    int id_len; /* 0 for a free slot */
+    unsigned char id[MAX_ID_LEN];
+    double latitude;
+    double longitude;
+};
+
+struct taxi_subscription
+{
+    struct taxi_request origin; /* address or stream connection of the subscriber */
+    struct taxi_receiver *receiver;
+    unsigned int sub_id;
+    double latitude_min;
+    double longitude_min;
+    double latitude_max;
+    double longitude_max;
+    uint64_t expires;
+    unsigned int seq;
+    struct taxi_member *members; /* open addressed by id hash */
+    unsigned int member_mask;
+    int num_members;
+};
+
+struct taxi_change
+{
+    struct taxi taxi;
+    int deleted;
+};
+
+static struct taxi_subscriptions
+{
+#define _TAXI_MAX_SUBSCRIPTIONS (1024)
+    struct taxi_subscription *subs[_TAXI_MAX_SUBSCRIPTIONS];
+    int num_subs;
+    struct taxi_change *changes; /* latest change per taxi since the last tick */
+    int num_changes;
+    int max_changes;
+    int *change_slots; /* id hash of change index + 1 */
+    unsigned int change_mask;
+    struct taxi *deltas; /* scratch for the enters, moves and leaves of a subscription */
+    int max_deltas;
+    uint64_t next_tick;
+} taxi_subscriptions;
+
+static int *change_slot(const unsigned char *id, int id_len)
+{
+    unsigned int index = taxi_id_hash(id, id_len) & taxi_subscriptions.change_mask;
+    for(;;)
     {
-        printf("Request too short\n");
-        goto out;
+        int *slot = &taxi_subscriptions.change_slots[index];
+        if(!*slot) return slot;
+        struct taxi *taxi = &taxi_subscriptions.changes[*slot - 1].taxi;
+        if(taxi->id_len == id_len && !memcmp(taxi->id, id, id_len))
+            return slot;
+        index = (index + 1) & taxi_subscriptions.change_mask;
     }
-    if(bytes == sizeof(unsigned int))
+}
+
+static void subscriptions_note(struct taxi *taxi, int deleted)
+{
+    if(!taxi_subscriptions.num_subs) return;
+    if(taxi_subscriptions.num_changes == taxi_subscriptions.max_changes)
+    {
+        taxi_subscriptions.max_changes = taxi_subscriptions.max_changes ? taxi_subscriptions.max_changes << 1 : 64;
+        taxi_subscriptions.changes = realloc(taxi_subscriptions.changes,
+                                             sizeof(*taxi_subscriptions.changes) * taxi_subscriptions.max_changes);
+        assert(taxi_subscriptions.changes != NULL);
+        taxi_subscriptions.change_mask = (taxi_subscriptions.max_changes << 1) - 1;
+        free(taxi_subscriptions.change_slots);
+        taxi_subscriptions.change_slots = calloc(taxi_subscriptions.change_mask + 1,
+                                                 sizeof(*taxi_subscriptions.change_slots));
+        assert(taxi_subscriptions.change_slots != NULL);
+        for(int i = 0; i < taxi_subscriptions.num_changes; ++i)
+        {
+            struct taxi *entry = &taxi_subscriptions.changes[i].taxi;
+            *change_slot(entry->id, entry->id_len) = i + 1;
+        }
+    }
+    int *slot = change_slot(taxi->id, taxi->id_len);
+    if(!*slot)
+        *slot = ++taxi_subscriptions.num_changes;
+    struct taxi_change *change = &taxi_subscriptions.changes[*slot - 1];
+    memcpy(&change->taxi, taxi, sizeof(change->taxi));
+    change->deleted = deleted;
+}
+
+static void subscriptions_clear_changes(void)
+{
+    if(!taxi_subscriptions.num_changes) return;
+    memset(taxi_subscriptions.change_slots, 0,
+           sizeof(*taxi_subscriptions.change_slots) * (taxi_subscriptions.change_mask + 1));
+    taxi_subscriptions.num_changes = 0;
+}
+
+static struct taxi_member *member_slot(struct taxi_subscription *sub, const unsigned char *id, int id_len)
+{
+    unsigned int index = taxi_id_hash(id, id_len) & sub->member_mask;
+    for(;;)
+    {
+        struct taxi_member *member = &sub->members[index];
+        if(!member->id_len
+           ||
+           (member->id_len == id_len && !memcmp(member->id, id, id_len)))
+            return member;
+        index = (index + 1) & sub->member_mask;
+    }
+}
+
+static void members_reset(struct taxi_subscription *sub, unsigned int slots)
+{
+    if(sub->members) free(sub->members);
+    sub->members = calloc(slots, sizeof(*sub->members));
+    assert(sub->members != NULL);
+    sub->member_mask = slots - 1;
+    sub->num_members = 0;
+}
+
+static void member_add(struct taxi_subscription *sub, struct taxi *taxi)
+{
+    if((sub->num_members + 1) * 2 > sub->member_mask + 1)
+    {
+        struct taxi_member *members = sub->members;
+        unsigned int slots = sub->member_mask + 1;
+        sub->members = NULL;
+        members_reset(sub, slots << 1);
+        for(unsigned int i = 0; i < slots; ++i)
+        {
+            if(!members[i].id_len) continue;
+            memcpy(member_slot(sub, members[i].id, members[i].id_len), &members[i], sizeof(members[i]));
+            ++sub->num_members;
+        }
+        free(members);
+    }
+    struct taxi_member *member = member_slot(sub, taxi->id, taxi->id_len);
+    if(!member->id_len)
+    {
+        member->id_len = taxi->id_len;
+        memcpy(member->id, taxi->id, taxi->id_len);
+        ++sub->num_members;
+    }
+    member->latitude = taxi->latitude;
+    member->longitude = taxi->longitude;
+}
+
+/*
+ * Backward shift deletion keeps the probe chains intact without tombstones.
+ */
+static void member_del(struct taxi_subscription *sub, struct taxi_member *member)
+{
+    unsigned int mask = sub->member_mask;
+    unsigned int hole = member - sub->members;
+    unsigned int next = hole;
+    for(;;)
     {
+        next = (next + 1) & mask;
+        struct taxi_member *entry = &sub->members[next];
+        if(!entry->id_len) break;
+        unsigned int home = taxi_id_hash(entry->id, entry->id_len) & mask;
         /*
-         * exit request.
+         * Move the entry into the hole unless its home lies cyclically in (hole, next].
          */
-        err = 1;
-        goto out;
+        if( ((next - home) & mask) >= ((next - hole) & mask) )
+        {
+            memcpy(&sub->members[hole], entry, sizeof(*entry));
+            hole = next;
+        }
     }
-    unsigned int cmd = ntohl(*(unsigned int*)s);
-    bytes -= sizeof(unsigned int);
-    s += sizeof(unsigned int);
+    sub->members[hole].id_len = 0;
+    --sub->num_members;
+}
 
-    switch(cmd)
+static int in_region(struct taxi_subscription *sub, struct taxi *taxi)
+{
+    return taxi->latitude >= sub->latitude_min && taxi->latitude <= sub->latitude_max
+        &&
+        taxi->longitude >= sub->longitude_min && taxi->longitude <= sub->longitude_max;
+}
+
+/*
+ * Push the delta split into datagrams of at most the fragment payload,
+ * each with its own sequence.
+ */
+static void send_region_delta(struct taxi_subscription *sub, struct taxi *entered, int num_entered,
+                              struct taxi *moved, int num_moved, struct taxi *left, int num_left)
+{
+    int batch = (server_args.frag_payload - 6 * sizeof(unsigned int)) / _TAXI_MAX_ENTRY_LEN;
+    int snapshot = !sub->seq;
+    if(batch <= 0) batch = 1;
+    do
+    {
+        struct taxi_region_delta delta = { .sub_id = sub->sub_id, .seq = sub->seq++ };
+        int room = batch;
+        delta.entered = entered;
+        delta.num_entered = num_entered < room ? num_entered : room;
+        room -= delta.num_entered;
+        delta.moved = moved;
+        delta.num_moved = num_moved < room ? num_moved : room;
+        room -= delta.num_moved;
+        delta.left = left;
+        delta.num_left = num_left < room ? num_left : room;
+        entered += delta.num_entered;
+        num_entered -= delta.num_entered;
+        moved += delta.num_moved;
+        num_moved -= delta.num_moved;
+        left += delta.num_left;
+        num_left -= delta.num_left;
+
+        int len = sizeof(unsigned int) + taxi_region_delta_packed_size(&delta);
+        unsigned char *buf = malloc(len);
+        assert(buf);
+        *(unsigned int*)buf = htonl(_TAXI_REGION_DELTA_CMD);
+        taxi_region_delta_encode(&delta, buf + sizeof(unsigned int));
+        send_reply(sub->receiver, &sub->origin, buf, len);
+        snapshot = 0;
+    } while(snapshot || num_entered + num_moved + num_left > 0);
+}
+
+static void subscription_snapshot(struct taxi_subscription *sub)
+{
+    struct taxi *taxis = NULL;
+    int num_taxis = 0;
+    members_reset(sub, 16);
+    sub->seq = 0;
+    find_taxis_in_region(sub->latitude_min, sub->longitude_min, sub->latitude_max, sub->longitude_max,
+                         &taxis, &num_taxis);
+    for(int i = 0; i < num_taxis; ++i)
+        member_add(sub, &taxis[i]);
+    if(server_args.verbose)
+        printf("Subscription [%u] from [%s:%d] has [%d] taxis in region [%lg:%lg]-[%lg:%lg]\n",
+               sub->sub_id, inet_ntoa(sub->origin.addr.sin_addr), ntohs(sub->origin.addr.sin_port),
+               num_taxis, sub->latitude_min, sub->longitude_min, sub->latitude_max, sub->longitude_max);
+    send_region_delta(sub, taxis, num_taxis, NULL, 0, NULL, 0);
+    if(taxis) free(taxis);
+}
+
+static void subscription_remove(int index)
+{
+    struct taxi_subscription *sub = taxi_subscriptions.subs[index];
+    taxi_subscriptions.subs[index] = taxi_subscriptions.subs[--taxi_subscriptions.num_subs];
+    if(sub->members) free(sub->members);
+    free(sub);
+    if(!taxi_subscriptions.num_subs)
+        subscriptions_clear_changes();
+}
+
+/*
+ * Subscribe, renew the lease, reset or with a 0 lease unsubscribe.
+ * A new subscription, a reset or a changed region gets a fresh snapshot.
+ */
+static void subscribe_region(struct taxi_receiver *receiver, struct taxi_request *req, uint64_t now)
+{
+    struct taxi_subscription *sub = NULL;
+    int i, reset;
+    for(i = 0; i < taxi_subscriptions.num_subs; ++i)
+    {
+        struct taxi_subscription *entry = taxi_subscriptions.subs[i];
+        if(entry->sub_id != req->req_id || entry->origin.conn != req->conn) continue;
+        if(req->conn >= 0 ? entry->origin.conn_gen == req->conn_gen :
+           entry->origin.addr.sin_addr.s_addr == req->addr.sin_addr.s_addr
+           &&
+           entry->origin.addr.sin_port == req->addr.sin_port)
+        {
+            sub = entry;
+            break;
+        }
+    }
+    if(!req->lease)
+    {
+        if(sub) subscription_remove(i);
+        return;
+    }
+    reset = !sub || (req->flags & _TAXI_SUBSCRIBE_RESET);
+    if(!sub)
+    {
+        if(taxi_subscriptions.num_subs == _TAXI_MAX_SUBSCRIPTIONS)
+        {
+            printf("Too many subscriptions. Dropping subscription [%u] from [%s]\n",
+                   req->req_id, inet_ntoa(req->addr.sin_addr));
+            return;
+        }
+        sub = calloc(1, sizeof(*sub));
+        assert(sub);
+        memcpy(&sub->origin, req, sizeof(sub->origin));
+        sub->receiver = receiver;
+        sub->sub_id = req->req_id;
+        taxi_subscriptions.subs[taxi_subscriptions.num_subs++] = sub;
+        if(taxi_subscriptions.num_subs == 1)
+            taxi_subscriptions.next_tick = now + server_args.sub_tick * 1000ULL;
+    }
+    if(sub->latitude_min != req->latitude || sub->longitude_min != req->longitude
+       ||
+       sub->latitude_max != req->latitude_max || sub->longitude_max != req->longitude_max)
+        reset = 1;
+    sub->latitude_min = req->latitude;
+    sub->longitude_min = req->longitude;
+    sub->latitude_max = req->latitude_max;
+    sub->longitude_max = req->longitude_max;
+    sub->expires = now + req->lease * 1000ULL;
+    if(reset)
+        subscription_snapshot(sub);
+}
+
+static void subscription_deltas(struct taxi_subscription *sub)
+{
+    int num_changes = taxi_subscriptions.num_changes;
+    int num_entered = 0, num_moved = 0, num_left = 0;
+    if(taxi_subscriptions.max_deltas < 3 * num_changes)
+    {
+        taxi_subscriptions.max_deltas = 3 * num_changes;
+        taxi_subscriptions.deltas = realloc(taxi_subscriptions.deltas,
+                                            sizeof(*taxi_subscriptions.deltas) * taxi_subscriptions.max_deltas);
+        assert(taxi_subscriptions.deltas != NULL);
+    }
+    struct taxi *entered = taxi_subscriptions.deltas;
+    struct taxi *moved = entered + num_changes;
+    struct taxi *left = moved + num_changes;
+    for(int i = 0; i < num_changes; ++i)
     {
+        struct taxi_change *change = &taxi_subscriptions.changes[i];
+        struct taxi *taxi = &change->taxi;
+        struct taxi_member *member = member_slot(sub, taxi->id, taxi->id_len);
+        int inside = !change->deleted && in_region(sub, taxi);
+        if(inside)
+        {
+            if(!member->id_len)
+                memcpy(&entered[num_entered++], taxi, sizeof(*taxi));
+            else if(member->latitude != taxi->latitude || member->longitude != taxi->longitude)
+                memcpy(&moved[num_moved++], taxi, sizeof(*taxi));
+            else
+                continue;
+            member_add(sub, taxi);
+        }
+        else if(member->id_len)
+        {
+            memcpy(&left[num_left++], taxi, sizeof(*taxi));
+            member_del(sub, member);
+        }
+    }
+    if(num_entered + num_moved + num_left > 0)
+        send_region_delta(sub, entered, num_entered, moved, num_moved, left, num_left);
+}
+
+/*
+ * Drop the expired subscriptions and push the changes of this tick to the rest.
+ */
+static void subscriptions_tick(uint64_t now)
+{
+    for(int i = taxi_subscriptions.num_subs - 1; i >= 0; --i)
+    {
+        struct taxi_subscription *sub = taxi_subscriptions.subs[i];
+        if(now >= sub->expires)
+        {
+            if(server_args.verbose)
+                printf("Subscription [%u] from [%s:%d] expired\n", sub->sub_id,
+                       inet_ntoa(sub->origin.addr.sin_addr), ntohs(sub->origin.addr.sin_port));
+            subscription_remove(i);
+            continue;
+        }
+        if(taxi_subscriptions.num_changes)
+            subscription_deltas(sub);
+    }
+    subscriptions_clear_changes();
+    taxi_subscriptions.next_tick = now + server_args.sub_tick * 1000ULL;
+}
+
+/*
+ * Sum up the per thread counters. The receivers keep counting meanwhile
+ * so the totals are a close snapshot.
+ */
+static int send_stats(struct taxi_receiver *receiver, struct taxi_request *req, uint64_t now)
+{
+    struct taxi_server_stats *stats = calloc(1, sizeof(*stats));
+    struct taxi_index_stats index_stats;
+    assert(stats);
+    stats->uptime = now - taxi_owner_stats.started;
+    stats->updates = taxi_coalescer.updates;
+    stats->coalesced = taxi_coalescer.merged;
+    get_taxi_index_stats(&index_stats);
+    stats->num_taxis = index_stats.num_taxis;
+    stats->num_clusters = index_stats.num_clusters;
+    stats->max_cluster = index_stats.max_cluster;
+    stats->memory = index_stats.memory;
+    for(int slot = 0; slot < _TAXI_STATS_MAX_CMDS; ++slot)
+    {
+        struct taxi_cmd_stats *cmd = &stats->cmds[stats->num_cmds];
+        cmd->shed = taxi_owner_stats.counters.shed[slot];
+        for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+        {
+            struct taxi_counters *counters = &taxi_pipeline.receivers[i].counters;
+            cmd->requests += __atomic_load_n(&counters->requests[slot], __ATOMIC_RELAXED);
+            cmd->shed += __atomic_load_n(&counters->shed[slot], __ATOMIC_RELAXED);
+        }
+        memcpy(&cmd->latency, &taxi_owner_stats.latency[slot], sizeof(cmd->latency));
+        if(!cmd->requests && !cmd->latency.count) continue;
+        cmd->cmd = slot ? __TAXI_CMD(slot) : _TAXI_EXIT_CMD;
+        ++stats->num_cmds;
+    }
+    for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+        stats->stalls += __atomic_load_n(&taxi_pipeline.receivers[i].counters.stalls, __ATOMIC_RELAXED);
+
+    /*
+     * The reply has to fit a datagram or a stream frame. Coarser histograms
+     * take fewer buckets.
+     */
+    int len = 2 * sizeof(unsigned int);
+    for(int shift = 1; len + taxi_stats_packed_size(stats) > __MAX_PACKET_LEN; ++shift)
+    {
+        if(shift > _TAXI_HIST_SUB_BITS)
+        {
+            output("Stats reply of [%d] bytes too large to send\n", len + taxi_stats_packed_size(stats));
+            free(stats);
+            return -1;
+        }
+        for(int i = 0; i < stats->num_cmds; ++i)
+            taxi_hist_coarsen(&stats->cmds[i].latency, shift);
+    }
+    unsigned char *buf = calloc(1, len);
+    assert(buf);
+    ((unsigned int*)buf)[0] = htonl(_TAXI_STATS_CMD);
+    ((unsigned int*)buf)[1] = htonl(req->req_id);
+    buf = taxi_stats_pack_with_buf(stats, &buf, &len, 2 * sizeof(unsigned int));
+    free(stats);
+    return send_reply(receiver, req, buf, len + 2 * sizeof(unsigned int));
+}
+
+/*
+ * Runs on the index owner. Replies go out of the socket the request arrived on.
+ */
+static int process_request(struct taxi_receiver *receiver, struct taxi_request *req, uint64_t now)
+{
+    int err = 0;
+    struct taxi taxi;
+    request_to_taxi(req, &taxi);
+
+    switch(req->cmd)
+    {
+    case _TAXI_EXIT_CMD:
+        err = 1;
+        break;
+
         /*
          * Location update command.
          */
     case _TAXI_LOCATION_CMD:
+        coalescer_update(req, now);
+        break;
+
+    case _TAXI_DELETE_CMD:
+        printf("Deleting taxi with id [%.*s]\n", taxi.id_len, taxi.id);
+        coalescer_cancel(req);
+        if(!del_taxi(&taxi))
+            subscriptions_note(&taxi, 1);
+        break;
+
+        /*
+         * Return taxis matching the location.
+         */
+    case _TAXI_FETCH_CMD:
         {
-            struct taxi taxi = {0};
-            err = taxi_unpack(s, &bytes, &taxi);
-            if(err < 0)
-            {
-                printf("Error unpacking taxi location data\n");
-                goto out;
-            }
-            memcpy(&taxi.addr, dest, sizeof(taxi.addr));
-            add_taxi(&taxi); /* add the taxi into the db*/
+            /*
+             * Without a window, reads still observe every update queued before them.
+             */
+            if(!server_args.coalesce_window)
+                coalescer_flush(~0ULL);
+            struct taxi_entry *entries = NULL;
+            int num_taxis = 0;
+            fetch_taxi_list(&taxi, &entries, &num_taxis);
+            struct taxi_entry *replied = encode_entries(entries, num_taxis, req);
+            send_taxi_list(replied, num_taxis, receiver, req);
+            if(replied != entries) free(replied);
+            if(entries) free(entries);
         }
         break;
 
-    case _TAXI_DELETE_CMD:
+        /*
+         * Fragmented fetch or a re-request of fragments lost on the way.
+         */
+    case _TAXI_FETCH_FRAG_CMD:
         {
-            
-            struct taxi taxi = {0};
-            err = taxi_unpack(s, &bytes, &taxi);
-            if(err < 0)
+            struct reply_entry *reply = NULL;
+            if(req->frag_mask && req->conn < 0)
+                reply = find_reply(&req->addr, req->req_id);
+            if(reply)
+            {
+                send_reply_frags(reply, req->frag_mask, receiver->sd);
+                break;
+            }
+            if(!server_args.coalesce_window)
+                coalescer_flush(~0ULL);
+            struct taxi_entry *entries = NULL;
+            int num_taxis = 0;
+            fetch_taxi_list(&taxi, &entries, &num_taxis);
+            struct taxi_entry *replied = encode_entries(entries, num_taxis, req);
+            if(req->conn >= 0)
             {
-                printf("Error unpacking taxi delete command\n");
-                goto out;
+                send_taxi_list(replied, num_taxis, receiver, req); /* a single fragment on a stream */
             }
-            memcpy(&taxi.addr, dest, sizeof(taxi.addr));
-            printf("Deleting taxi with id [%.*s]\n", taxi.id_len, taxi.id);
-            del_taxi(&taxi);
+            else
+            {
+                reply = add_reply(req, replied, num_taxis);
+                send_reply_frags(reply, 0, receiver->sd);
+            }
+            if(replied != entries) free(replied);
+            if(entries) free(entries);
         }
         break;
 
         /*
-         * Return taxis matching the location.
+         * Return the taxis to the customer and ping them on its behalf.
+         * Ping replies go to the customers port on the requesting host.
          */
-    case _TAXI_FETCH_CMD:
+    case _TAXI_FETCH_PING_CMD:
         {
-            struct taxi taxi = {0};
-            err = taxi_unpack(s, &bytes, &taxi);
-            if(err < 0)
+            if(!server_args.coalesce_window)
+                coalescer_flush(~0ULL);
+            struct taxi_entry *entries = NULL;
+            int num_taxis = 0;
+            fetch_taxi_list(&taxi, &entries, &num_taxis);
+            struct taxi_entry *replied = encode_entries(entries, num_taxis, req);
+            if(req->conn >= 0)
             {
-                printf("Error unpacking taxi fetch by location command\n");
-                goto out;
+                send_taxi_list(replied, num_taxis, receiver, req);
             }
-            struct taxi *taxis = NULL;
-            int num_taxis = 0;
-            fetch_taxi_list(&taxi, &taxis, &num_taxis);
-            send_taxi_list(&taxi, taxis, num_taxis, sd, (struct sockaddr*)dest, addrlen);
-            if(taxis) free(taxis);
-            break;
+            else
+            {
+                struct reply_entry *reply = add_reply(req, replied, num_taxis);
+                send_reply_frags(reply, 0, receiver->sd);
+            }
+            if(req->peer_port)
+                taxi.addr.sin_port = req->peer_port;
+            send_taxis_ping(&taxi, entries, num_taxis, receiver->sd);
+            if(replied != entries) free(replied);
+            if(entries) free(entries);
         }
         break;
+
+    case _TAXI_STATS_CMD:
+        send_stats(receiver, req, now);
+        break;
+
+    case _TAXI_SUBSCRIBE_CMD:
+        subscribe_region(receiver, req, now);
+        break;
+
     default:
         break;
     }
-    err = 0;
-    out:
+    if(req->received)
+    {
+        uint64_t done = forward_clock();
+        taxi_hist_record(&taxi_owner_stats.latency[stats_slot(req->cmd)],
+                         done > req->received ? done - req->received : 0);
+    }
     return err;
 }
 
-int taxi_server_start(const char *ip, int port)
+/*
+ * Apply up to max updates queued on the receiver. Location updates waiting
+ * past the age limit are shed as the taxi has likely moved on since.
+ */
+static int drain_updates(struct taxi_receiver *receiver, int max, uint64_t now)
 {
-    char buf[0xffff+1];
-    int err = -1;
-    int sd = bind_server(ip, port);
-    if(sd < 0) goto out;
+    struct taxi_request *req;
+    int done = 0;
+    while(done < max && (req = taxi_ring_peek(receiver->updates)))
+    {
+        if(req->cmd == _TAXI_LOCATION_CMD
+           &&
+           server_args.shed_age
+           &&
+           now > req->received + server_args.shed_age * 1000ULL)
+            ++taxi_owner_stats.counters.shed[stats_slot(req->cmd)];
+        else
+            process_request(receiver, req, now);
+        taxi_ring_release(receiver->updates);
+        ++receiver->updates_done;
+        ++done;
+    }
+    return done;
+}
+
+/*
+ * The index owner drains the receiver rings in turns and is the only
+ * thread touching the taxi db. Fetches across all receivers are served
+ * first and only wait for the updates that arrived ahead of them on
+ * their own receiver.
+ */
+static int taxi_owner_loop(void)
+{
+#define _OWNER_BATCH (64)
     for(;;)
     {
-        struct sockaddr_in dest;
-        socklen_t addrlen = sizeof(dest);
-        memset(&dest, 0, sizeof(dest));
-        int nbytes = recvfrom(sd, buf, sizeof(buf), 0, (struct sockaddr*)&dest, &addrlen);
-        if(nbytes <= 0)
+        int processed = 0;
+        uint64_t now = forward_clock();
+        for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
         {
-            if(nbytes == 0 || errno == EINTR) continue;
-            perror("recvfrom server error. exiting:");
-            goto out_close;
+            struct taxi_receiver *receiver = &taxi_pipeline.receivers[i];
+            struct taxi_request *req;
+            int batch = 0;
+            while(batch < _OWNER_BATCH && (req = taxi_ring_peek(receiver->ring)))
+            {
+                int ahead = (int)(req->barrier - receiver->updates_done);
+                if(ahead > 0)
+                    processed += drain_updates(receiver, ahead, now);
+                int err = process_request(receiver, req, now);
+                taxi_ring_release(receiver->ring);
+                ++batch;
+                if(err == 1)
+                {
+                    coalescer_flush(~0ULL);
+                    return 0;
+                }
+            }
+            processed += batch;
         }
-        if(process_request(sd, (unsigned char*)buf, nbytes, &dest, addrlen) == 1)
+        for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+            processed += drain_updates(&taxi_pipeline.receivers[i], _OWNER_BATCH, now);
+        if(!server_args.coalesce_window)
+            coalescer_flush(~0ULL);
+        else if(taxi_coalescer.num_pending)
+            coalescer_flush(forward_clock() - server_args.coalesce_window * 1000ULL);
+        if(taxi_subscriptions.num_subs && forward_clock() >= taxi_subscriptions.next_tick)
+            subscriptions_tick(forward_clock());
+        stream_kick();
+        if(!processed)
         {
-            printf("Server exiting...\n");
-            break;
+            uint64_t deadline = coalescer_deadline();
+            if(taxi_subscriptions.num_subs && (!deadline || taxi_subscriptions.next_tick < deadline))
+                deadline = taxi_subscriptions.next_tick;
+            taxi_pipeline_wait(deadline);
+        }
+    }
+    return 0;
+#undef _OWNER_BATCH
+}
+
+int taxi_server_start(const char *ip, int port)
+{
+    int err = -1;
+    int num_receivers = server_args.receivers;
+    if(num_receivers <= 0) num_receivers = 1;
+    if(server_args.shed_depth <= 0 || server_args.shed_depth > server_args.ring_slots)
+        server_args.shed_depth = server_args.ring_slots - server_args.ring_slots/4;
+    if(sem_init(&taxi_pipeline.wakeup, 0, 0) < 0)
+    {
+        perror("sem_init:");
+        goto out;
+    }
+    coalescer_init();
+    /*
+     * The stream transport takes the last ring.
+     */
+    if(posix_memalign((void**)&taxi_pipeline.receivers, _TAXI_CACHE_LINE,
+                      (num_receivers + 1) * sizeof(*taxi_pipeline.receivers)))
+        taxi_pipeline.receivers = NULL;
+    assert(taxi_pipeline.receivers != NULL);
+    memset(taxi_pipeline.receivers, 0, (num_receivers + 1) * sizeof(*taxi_pipeline.receivers));
+    taxi_owner_stats.started = forward_clock();
+    for(int i = 0; i < num_receivers; ++i)
+    {
+        struct taxi_receiver *receiver = &taxi_pipeline.receivers[i];
+        receiver->sd = bind_server_shared(ip, port);
+        if(receiver->sd < 0) goto out_close;
+        int rcvbuf = _TAXI_SERVER_RCVBUF;
+        setsockopt(receiver->sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        receiver->ring = taxi_ring_create(server_args.ring_slots, sizeof(struct taxi_request));
+        receiver->updates = taxi_ring_create(server_args.ring_slots, sizeof(struct taxi_request));
+        assert(receiver->ring != NULL && receiver->updates != NULL);
+        taxi_pipeline.num_receivers++;
+    }
+    for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+    {
+        struct taxi_receiver *receiver = &taxi_pipeline.receivers[i];
+        if(pthread_create(&receiver->tid, NULL, taxi_receiver_thread, receiver))
+        {
+            fprintf(stderr, "Error creating receiver thread: [%s]\n", strerror(errno));
+            goto out_close;
         }
+        pthread_detach(receiver->tid);
+    }
+    if(server_args.stream)
+    {
+        struct taxi_receiver *receiver = &taxi_pipeline.receivers[num_receivers];
+        receiver->ring = taxi_ring_create(server_args.ring_slots, sizeof(struct taxi_request));
+        receiver->updates = taxi_ring_create(server_args.ring_slots, sizeof(struct taxi_request));
+        assert(receiver->ring != NULL && receiver->updates != NULL);
+        if(taxi_stream_start(ip, port, receiver) < 0)
+            goto out_close;
+        taxi_pipeline.num_receivers++;
     }
 
+    taxi_owner_loop();
+    printf("Server exiting...\n");
+    for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+    {
+        struct taxi_counters *counters = &taxi_pipeline.receivers[i].counters;
+        if(counters->stalls)
+            printf("Receiver [%d] stalled [%lu] times on a full ring\n", i, counters->stalls);
+        if(counters->shed[stats_slot(_TAXI_LOCATION_CMD)])
+            printf("Receiver [%d] shed [%lu] location updates on queue depth\n", i,
+                   counters->shed[stats_slot(_TAXI_LOCATION_CMD)]);
+    }
+    if(taxi_owner_stats.counters.shed[stats_slot(_TAXI_LOCATION_CMD)])
+        printf("Shed [%lu] location updates on age\n",
+               taxi_owner_stats.counters.shed[stats_slot(_TAXI_LOCATION_CMD)]);
+    printf("Coalesced [%lu] of [%lu] location updates, cancelled [%lu] by deletes\n",
+           taxi_coalescer.merged, taxi_coalescer.updates, taxi_coalescer.cancelled);
     err = 0;
+
+    /*
+     * Receivers are left blocked in the kernel and go away with the process.
+     */
+    goto out;
+
     out_close:
-    close(sd);
+    for(int i = 0; i < taxi_pipeline.num_receivers; ++i)
+    {
+        if(&taxi_pipeline.receivers[i] == taxi_stream.receiver) continue;
+        close(taxi_pipeline.receivers[i].sd);
+    }
     out:
     return err;
 }
@@ -169,7 +2180,11 @@ int taxi_server_start(const char *ip, int port)
 static char *prog;
 static void usage(void)
 {
-    fprintf(stderr, "%s [ -p | port ] [ -v | verbose ]\n", prog);
+    fprintf(stderr, "%s [ -p | port ] [ -r | receiver threads ] [ -q | ring slots per receiver ] "
+            "[ -w | coalesce window msecs ] [ -m | fragment payload bytes ] [ -t | tcp stream transport ] "
+            "[ -d | queued updates before shedding ] [ -a | update age msecs before shedding ] "
+            "[ -u | subscription tick msecs ] "
+            "[ -v | verbose ]\n", prog);
     exit(1);
 }
 
@@ -181,13 +2196,37 @@ int main(int argc, char **argv)
     char *s;
     if( (s = strrchr(prog, '/') ) )
         prog = ++s;
-    while( (c = getopt(argc, argv, "p:vh") ) != EOF )
+    while( (c = getopt(argc, argv, "p:r:q:w:m:d:a:u:tvh") ) != EOF )
     {
         switch(c)
         {
         case 'p':
             server_args.port = atoi(optarg);
             break;
+        case 'r':
+            server_args.receivers = atoi(optarg);
+            break;
+        case 'q':
+            server_args.ring_slots = atoi(optarg);
+            break;
+        case 'w':
+            server_args.coalesce_window = atoi(optarg);
+            break;
+        case 'm':
+            server_args.frag_payload = atoi(optarg);
+            break;
+        case 't':
+            server_args.stream = 1;
+            break;
+        case 'd':
+            server_args.shed_depth = atoi(optarg);
+            break;
+        case 'a':
+            server_args.shed_age = atoi(optarg);
+            break;
+        case 'u':
+            server_args.sub_tick = atoi(optarg);
+            break;
         case 'v':
             server_args.verbose = 1;
             break;
@@ -198,6 +2237,10 @@ int main(int argc, char **argv)
         }
     }
     if(optind != argc) usage();
+    if(server_args.frag_payload < 256 || server_args.frag_payload > __MAX_PACKET_LEN)
+        usage();
+    if(server_args.sub_tick <= 0)
+        usage();
     taxi_server_start(NULL, server_args.port);
     return 0;
 }
@@ -12,9 +12,39 @@ extern "C" {
 #define output(...) do { fprintf(stderr, __VA_ARGS__); } while(0)
 
 extern int add_taxi(struct taxi *taxi);
+extern int add_taxis(struct taxi *taxis, int num_taxis);
 extern int del_taxi(struct taxi *taxi);
 extern int find_taxis_by_location(double latitude, double longitude,
                                   struct taxi **matched_taxis, int *num_taxis);
+/*
+ * Cached wire encoding of a taxi in the index. Valid till the index is next modified.
+ */
+struct taxi_entry
+{
+    const unsigned char *buf;
+    int len;
+    const struct sockaddr_in *addr;
+    const unsigned char *id;
+    int id_len;
+    double latitude;
+    double longitude;
+};
+
+extern int find_taxi_entries_by_location(double latitude, double longitude,
+                                         struct taxi_entry **matched_entries, int *num_entries);
+extern int find_taxis_in_region(double latitude_min, double longitude_min,
+                                double latitude_max, double longitude_max,
+                                struct taxi **matched_taxis, int *num_taxis);
+
+struct taxi_index_stats
+{
+    int num_taxis;
+    int num_clusters;
+    int max_cluster;
+    unsigned long memory;
+};
+
+extern int get_taxi_index_stats(struct taxi_index_stats *stats);
 
 #ifdef __cplusplus
 }
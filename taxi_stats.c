@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include "taxi_stats.h"
+
+/*
+ * 64 bit counters go on the wire as 2 words, high word first.
+ */
+#define _PUT_WORD(s, v) do { *(unsigned int*)(s) = htonl(v); (s) += sizeof(unsigned int); } while(0)
+#define _PUT_WORD64(s, v) do {                          \
+        _PUT_WORD(s, (unsigned int)((uint64_t)(v) >> 32)); \
+        _PUT_WORD(s, (unsigned int)(v));                \
+    } while(0)
+#define _GET_WORD(s) get_word(&(s))
+#define _GET_WORD64(s) get_word64(&(s))
+
+#define _STATS_HEADER_WORDS (14)
+#define _STATS_CMD_WORDS (12)
+#define _STATS_BUCKET_WORDS (3)
+
+static unsigned int get_word(unsigned char **s)
+{
+    unsigned int v = ntohl(*(unsigned int*)*s);
+    *s += sizeof(unsigned int);
+    return v;
+}
+
+static uint64_t get_word64(unsigned char **s)
+{
+    uint64_t v = (uint64_t)get_word(s) << 32;
+    return v | get_word(s);
+}
+
+int taxi_hist_bucket(uint64_t value)
+{
+    if(value < _TAXI_HIST_SUB) return (int)value;
+    if(value >> 32) value = 0xffffffffULL;
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (value >> (exp - _TAXI_HIST_SUB_BITS)) & (_TAXI_HIST_SUB - 1);
+    return (exp - _TAXI_HIST_SUB_BITS + 1) * _TAXI_HIST_SUB + sub;
+}
+
+/*
+ * Highest value falling in the bucket.
+ */
+uint64_t taxi_hist_bucket_value(int bucket)
+{
+    if(bucket < _TAXI_HIST_SUB) return bucket;
+    int exp = bucket / _TAXI_HIST_SUB + _TAXI_HIST_SUB_BITS - 1;
+    int sub = bucket % _TAXI_HIST_SUB;
+    uint64_t low = (uint64_t)(_TAXI_HIST_SUB + sub) << (exp - _TAXI_HIST_SUB_BITS);
+    return low + (1ULL << (exp - _TAXI_HIST_SUB_BITS)) - 1;
+}
+
+void taxi_hist_record(struct taxi_histogram *hist, uint64_t value)
+{
+    ++hist->buckets[taxi_hist_bucket(value)];
+    ++hist->count;
+    hist->sum += value;
+    if(value > hist->max) hist->max = value;
+}
+
+uint64_t taxi_hist_percentile(struct taxi_histogram *hist, double percentile)
+{
+    if(!hist->count) return 0;
+    uint64_t target = (uint64_t)(hist->count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    if(!target) target = 1;
+    for(int i = 0; i < _TAXI_HIST_BUCKETS; ++i)
+    {
+        seen += hist->buckets[i];
+        if(seen >= target)
+        {
+            uint64_t value = taxi_hist_bucket_value(i);
+            return value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+/*
+ * Move the counts of each group of 2^shift sub buckets into the highest bucket
+ * of the group, so fewer buckets go on the wire. Percentiles then err on
+ * the high side by up to 2^shift sub buckets.
+ */
+void taxi_hist_coarsen(struct taxi_histogram *hist, int shift)
+{
+    int mask = (1 << shift) - 1;
+    assert(shift <= _TAXI_HIST_SUB_BITS);
+    for(int b = _TAXI_HIST_SUB; b < _TAXI_HIST_BUCKETS; ++b)
+    {
+        if((b & mask) == mask || !hist->buckets[b]) continue;
+        hist->buckets[b | mask] += hist->buckets[b];
+        hist->buckets[b] = 0;
+    }
+}
+
+/*
+ * Only the non empty buckets are sent as bucket index and count.
+ */
+int taxi_stats_packed_size(struct taxi_server_stats *stats)
+{
+    int words = _STATS_HEADER_WORDS;
+    for(int i = 0; i < stats->num_cmds; ++i)
+    {
+        words += _STATS_CMD_WORDS;
+        for(int b = 0; b < _TAXI_HIST_BUCKETS; ++b)
+            if(stats->cmds[i].latency.buckets[b]) words += _STATS_BUCKET_WORDS;
+    }
+    return words * sizeof(unsigned int);
+}
+
+unsigned char *taxi_stats_pack_with_buf(struct taxi_server_stats *stats,
+                                        unsigned char **r_buf, int *p_len, int offset)
+{
+    int len = taxi_stats_packed_size(stats);
+    unsigned char *buf = r_buf ? *r_buf : NULL;
+    if(!buf)
+        buf = calloc(1, offset + len);
+    else if(!p_len || *p_len < offset + len)
+        buf = realloc(buf, offset + len);
+    assert(buf != NULL);
+    unsigned char *s = buf + offset;
+    _PUT_WORD64(s, stats->uptime);
+    _PUT_WORD64(s, stats->stalls);
+    _PUT_WORD64(s, stats->updates);
+    _PUT_WORD64(s, stats->coalesced);
+    _PUT_WORD(s, stats->num_taxis);
+    _PUT_WORD(s, stats->num_clusters);
+    _PUT_WORD(s, stats->max_cluster);
+    _PUT_WORD64(s, stats->memory);
+    _PUT_WORD(s, stats->num_cmds);
+    for(int i = 0; i < stats->num_cmds; ++i)
+    {
+        struct taxi_cmd_stats *cmd = &stats->cmds[i];
+        unsigned char *num_buckets;
+        int n = 0;
+        _PUT_WORD(s, cmd->cmd);
+        _PUT_WORD64(s, cmd->requests);
+        _PUT_WORD64(s, cmd->shed);
+        _PUT_WORD64(s, cmd->latency.count);
+        _PUT_WORD64(s, cmd->latency.sum);
+        _PUT_WORD64(s, cmd->latency.max);
+        num_buckets = s;
+        s += sizeof(unsigned int);
+        for(int b = 0; b < _TAXI_HIST_BUCKETS; ++b)
+        {
+            if(!cmd->latency.buckets[b]) continue;
+            _PUT_WORD(s, b);
+            _PUT_WORD64(s, cmd->latency.buckets[b]);
+            ++n;
+        }
+        _PUT_WORD(num_buckets, n);
+    }
+    assert(s == buf + offset + len);
+    if(r_buf) *r_buf = buf;
+    if(p_len) *p_len = len;
+    return buf;
+}
+
+int taxi_stats_unpack(unsigned char *buf, int *p_len, struct taxi_server_stats *stats)
+{
+    int len = *p_len;
+    unsigned char *s = buf;
+#define _CHECK_WORDS(n) do { len -= (n) * (int)sizeof(unsigned int); if(len < 0) goto out_err; } while(0)
+    memset(stats, 0, sizeof(*stats));
+    _CHECK_WORDS(_STATS_HEADER_WORDS);
+    stats->uptime = _GET_WORD64(s);
+    stats->stalls = _GET_WORD64(s);
+    stats->updates = _GET_WORD64(s);
+    stats->coalesced = _GET_WORD64(s);
+    stats->num_taxis = _GET_WORD(s);
+    stats->num_clusters = _GET_WORD(s);
+    stats->max_cluster = _GET_WORD(s);
+    stats->memory = _GET_WORD64(s);
+    int num_cmds = _GET_WORD(s);
+    if(num_cmds < 0 || num_cmds > _TAXI_STATS_MAX_CMDS) goto out_err;
+    for(int i = 0; i < num_cmds; ++i)
+    {
+        struct taxi_cmd_stats *cmd = &stats->cmds[i];
+        _CHECK_WORDS(_STATS_CMD_WORDS);
+        cmd->cmd = _GET_WORD(s);
+        cmd->requests = _GET_WORD64(s);
+        cmd->shed = _GET_WORD64(s);
+        cmd->latency.count = _GET_WORD64(s);
+        cmd->latency.sum = _GET_WORD64(s);
+        cmd->latency.max = _GET_WORD64(s);
+        int num_buckets = _GET_WORD(s);
+        if(num_buckets < 0 || num_buckets > _TAXI_HIST_BUCKETS) goto out_err;
+        _CHECK_WORDS(num_buckets * _STATS_BUCKET_WORDS);
+        for(int b = 0; b < num_buckets; ++b)
+        {
+            unsigned int bucket = _GET_WORD(s);
+            if(bucket >= _TAXI_HIST_BUCKETS) goto out_err;
+            cmd->latency.buckets[bucket] = _GET_WORD64(s);
+        }
+        stats->num_cmds = i + 1;
+    }
+    *p_len = s - buf;
+    return 0;
+
+    out_err:
+    return -1;
+#undef _CHECK_WORDS
+}
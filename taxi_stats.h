@@ -0,0 +1,64 @@
+#ifndef _TAXI_STATS_H_
+#define _TAXI_STATS_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * HDR style log linear latency histogram in usecs. Values below 16 get a bucket each
+ * and every power of 2 above is split into 16 linear sub buckets, so a recorded value
+ * is off by at most 1/16th.
+ */
+#define _TAXI_HIST_SUB_BITS (4)
+#define _TAXI_HIST_SUB (1 << _TAXI_HIST_SUB_BITS)
+#define _TAXI_HIST_BUCKETS ((32 - _TAXI_HIST_SUB_BITS + 1) * _TAXI_HIST_SUB)
+#define _TAXI_STATS_MAX_CMDS (16) /* commands tracked by offset from the command base */
+
+struct taxi_histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[_TAXI_HIST_BUCKETS];
+};
+
+struct taxi_cmd_stats
+{
+    unsigned int cmd;
+    uint64_t requests; /* decoded by the receivers */
+    uint64_t shed; /* dropped under load */
+    struct taxi_histogram latency; /* receipt to reply */
+};
+
+struct taxi_server_stats
+{
+    uint64_t uptime; /* usecs */
+    uint64_t stalls; /* receivers found their ring full */
+    uint64_t updates; /* location updates through the coalescer */
+    uint64_t coalesced; /* of which merged into a pending one */
+    unsigned int num_taxis;
+    unsigned int num_clusters;
+    unsigned int max_cluster;
+    uint64_t memory; /* bytes held by the index */
+    int num_cmds;
+    struct taxi_cmd_stats cmds[_TAXI_STATS_MAX_CMDS];
+};
+
+extern int taxi_hist_bucket(uint64_t value);
+extern uint64_t taxi_hist_bucket_value(int bucket);
+extern void taxi_hist_record(struct taxi_histogram *hist, uint64_t value);
+extern uint64_t taxi_hist_percentile(struct taxi_histogram *hist, double percentile);
+extern void taxi_hist_coarsen(struct taxi_histogram *hist, int shift);
+extern int taxi_stats_packed_size(struct taxi_server_stats *stats);
+extern unsigned char *taxi_stats_pack_with_buf(struct taxi_server_stats *stats,
+                                               unsigned char **r_buf, int *p_len, int offset);
+extern int taxi_stats_unpack(unsigned char *buf, int *p_len, struct taxi_server_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,8 +3,11 @@
 #include <string.h>
 #include <assert.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "taxi.h"
 #include "taxi_client.h"
+#include "taxi_pack.h"
+#include "dispatcher.h"
 
 #define _XSTR(X) #X
 #define _STR(X) _XSTR(X)
@@ -21,9 +24,21 @@ static struct taxi_test_args
 #define TEST_DELETE (0x1)
 #define TEST_PING (0x2)
 #define TEST_SEARCH (0x3)
+#define TEST_FETCH_PING (0x4)
+#define TEST_STATS (0x5)
+#define TEST_REGION (0x6)
+#define TEST_BATCH (0x7)
+#define TEST_FRAGS (0x8)
+#define TEST_ASYNC (0x9)
+#define TEST_CACHE (0xa)
+#define TEST_SUPPRESSION (0xb)
+#define TEST_CONTEXTS (0xc)
+#define TEST_THREADS (0xd)
+#define TEST_TIMERS (0xe)
     char server[20];
     int port;
     unsigned int test_mask;
+    int num_threads;
     char fname[20];
 } taxi_test_args = { .server = _TAXI_SERVER_IP, .port = _TAXI_SERVER_PORT, 
                      .test_mask = MAKE_TEST_MASK(TEST_ADD) | MAKE_TEST_MASK(TEST_SEARCH),
@@ -35,13 +50,16 @@ static int add_taxi_location(double latitude, double longitude, unsigned char *i
     int err = 0;
     taxis = realloc(taxis, sizeof(*taxis) * (num_taxis+1));
     assert(taxis);
+    memset(&taxis[num_taxis], 0, sizeof(*taxis));
     taxis[num_taxis].latitude = latitude;
     taxis[num_taxis].longitude = longitude;
     int len = id_len > sizeof(taxis[num_taxis].id) ? sizeof(taxis[num_taxis].id) : id_len;
     taxis[num_taxis].id_len = len;
     memcpy(taxis[num_taxis].id, id, len);
     num_taxis++;
-    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_ADD))
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_ADD)
+       &&
+       !CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_BATCH))
         err = update_taxi_location(&taxis[num_taxis-1]);
     return err;
 }
@@ -82,9 +100,21 @@ static int find_taxis(struct taxi *search_taxis, int num_searches)
     {
         struct taxi *taxis = NULL;
         int num_taxis = 0;
-        get_nearest_taxis(search_taxis[i].latitude,
-                          search_taxis[i].longitude,
-                          &taxis, &num_taxis);
+        if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_FETCH_PING))
+        {
+            struct taxi customer = {0};
+            strncat((char*)customer.id, "foobar", sizeof(customer.id)-1);
+            customer.id_len = strlen((const char*)customer.id);
+            customer.latitude = search_taxis[i].latitude;
+            customer.longitude = search_taxis[i].longitude;
+            fetch_and_ping_nearby_taxis(&customer, &taxis, &num_taxis);
+        }
+        else
+        {
+            get_nearest_taxis(search_taxis[i].latitude,
+                              search_taxis[i].longitude,
+                              &taxis, &num_taxis);
+        }
         printf("Matched [%d] taxis for query [%lg:%lg]\n", num_taxis,
                search_taxis[i].latitude, search_taxis[i].longitude);
         if(num_taxis > 0)
@@ -98,7 +128,8 @@ static int find_taxis(struct taxi *search_taxis, int num_searches)
                 delete_taxi(&taxis[0]);
                 i--;
             }
-            else if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_PING))
+            else if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_PING)
+                    && !CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_FETCH_PING))
             {
                 printf("Testing ping command send to the taxis nearby\n");
                 struct taxi customer = {0};
@@ -155,6 +186,8 @@ static int test_taxi_scan(const char *fname)
         }
     }
     fclose(fptr);
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_BATCH) && num_taxis > 0)
+        update_taxi_locations(taxis, num_taxis);
     if(num_searches > 0)
     {
         if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_SEARCH))
@@ -166,10 +199,681 @@ static int test_taxi_scan(const char *fname)
 }
 
 static char *prog;
+static int region_hook(struct taxi_region_delta *delta)
+{
+    output("Region [%u] delta [%u]: entered [%d] moved [%d] left [%d]\n",
+           delta->sub_id, delta->seq, delta->num_entered, delta->num_moved, delta->num_left);
+    for(int i = 0; i < delta->num_entered; ++i)
+        output("Taxi [%.*s] entered at [%lg:%lg]\n", delta->entered[i].id_len, delta->entered[i].id,
+               delta->entered[i].latitude, delta->entered[i].longitude);
+    for(int i = 0; i < delta->num_moved; ++i)
+        output("Taxi [%.*s] moved to [%lg:%lg]\n", delta->moved[i].id_len, delta->moved[i].id,
+               delta->moved[i].latitude, delta->moved[i].longitude);
+    for(int i = 0; i < delta->num_left; ++i)
+        output("Taxi [%.*s] left\n", delta->left[i].id_len, delta->left[i].id);
+    return 0;
+}
+
+static void print_server_stats(void)
+{
+    struct taxi_server_stats *stats = calloc(1, sizeof(*stats));
+    assert(stats);
+    if(get_taxi_server_stats(stats) < 0)
+    {
+        output("Unable to get server stats\n");
+        goto out;
+    }
+    output("Server up [%.3lf] secs, taxis [%u], clusters [%u], max cluster [%u], index memory [%lu] bytes\n",
+           stats->uptime/1e6, stats->num_taxis, stats->num_clusters, stats->max_cluster,
+           (unsigned long)stats->memory);
+    output("Coalesced [%lu] of [%lu] location updates, receivers stalled [%lu] times\n",
+           (unsigned long)stats->coalesced, (unsigned long)stats->updates, (unsigned long)stats->stalls);
+    for(int i = 0; i < stats->num_cmds; ++i)
+    {
+        struct taxi_cmd_stats *cmd = &stats->cmds[i];
+        output("Command [%#x]: requests [%lu] shed [%lu] latency usecs "
+               "mean [%lu] p50 [%lu] p99 [%lu] p99.9 [%lu] max [%lu]\n",
+               cmd->cmd, (unsigned long)cmd->requests, (unsigned long)cmd->shed,
+               (unsigned long)(cmd->latency.count ? cmd->latency.sum / cmd->latency.count : 0),
+               (unsigned long)taxi_hist_percentile(&cmd->latency, 50),
+               (unsigned long)taxi_hist_percentile(&cmd->latency, 99),
+               (unsigned long)taxi_hist_percentile(&cmd->latency, 99.9),
+               (unsigned long)cmd->latency.max);
+    }
+    out:
+    free(stats);
+}
+
+/*
+ * An async fetch finds what a blocking one does, as do a burst of them whose
+ * replies the client drains together, and one from a server that is not there
+ * fails through its timeout.
+ */
+#define TEST_ASYNC_LATITUDE (14.5)
+#define TEST_ASYNC_LONGITUDE (79.0)
+#define TEST_ASYNC_TAXIS (5)
+#define TEST_ASYNC_WAIT (10000) /* msecs, past the fetch timeout */
+#define TEST_ASYNC_BURST (256)
+
+struct async_fetch
+{
+    int done;
+    int err;
+    int num_taxis;
+};
+
+static int async_fetch_hook(int err, struct taxi *taxis, int num_taxis, void *arg)
+{
+    struct async_fetch *fetch = arg;
+    fetch->err = err;
+    fetch->num_taxis = num_taxis;
+    if(taxis) free(taxis);
+    __atomic_store_n(&fetch->done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int async_fetch_wait(struct async_fetch *fetch, int msecs)
+{
+    while(!__atomic_load_n(&fetch->done, __ATOMIC_ACQUIRE) && msecs-- > 0)
+        usleep(1000);
+    return fetch->done ? 0 : -1;
+}
+
+static int test_async(void)
+{
+    struct taxi async_taxis[TEST_ASYNC_TAXIS];
+    struct taxi *found = NULL;
+    int num_found = 0;
+    struct async_fetch fetch = {0}, dead_fetch = {0};
+    struct async_fetch *burst = calloc(TEST_ASYNC_BURST, sizeof(*burst));
+    int num_burst = 0;
+    struct taxi_client_ctx *dead = NULL;
+    int err = -1;
+    assert(burst);
+    memset(async_taxis, 0, sizeof(async_taxis));
+    for(int i = 0; i < TEST_ASYNC_TAXIS; ++i)
+    {
+        async_taxis[i].id_len = snprintf((char*)async_taxis[i].id, sizeof(async_taxis[i].id), "async%d", i);
+        async_taxis[i].latitude = TEST_ASYNC_LATITUDE + i * 1e-4;
+        async_taxis[i].longitude = TEST_ASYNC_LONGITUDE;
+    }
+    if(update_taxi_locations(async_taxis, TEST_ASYNC_TAXIS) < 0
+       ||
+       get_nearest_taxis(TEST_ASYNC_LATITUDE, TEST_ASYNC_LONGITUDE, &found, &num_found) < 0
+       ||
+       num_found < TEST_ASYNC_TAXIS)
+    {
+        output("Blocking fetch found [%d] of [%d] taxis\n", num_found, TEST_ASYNC_TAXIS);
+        goto out;
+    }
+    if(get_nearest_taxis_async(TEST_ASYNC_LATITUDE, TEST_ASYNC_LONGITUDE, async_fetch_hook, &fetch) < 0
+       ||
+       async_fetch_wait(&fetch, TEST_ASYNC_WAIT) < 0
+       ||
+       fetch.err || fetch.num_taxis != num_found)
+    {
+        output("Async fetch found [%d] taxis, blocking fetch [%d]\n", fetch.num_taxis, num_found);
+        goto out;
+    }
+    for(; num_burst < TEST_ASYNC_BURST; ++num_burst)
+    {
+        if(get_nearest_taxis_async(TEST_ASYNC_LATITUDE, TEST_ASYNC_LONGITUDE,
+                                   async_fetch_hook, &burst[num_burst]) < 0)
+        {
+            output("Unable to issue async fetch [%d] of the burst\n", num_burst);
+            goto out;
+        }
+    }
+    for(int i = 0; i < TEST_ASYNC_BURST; ++i)
+    {
+        if(async_fetch_wait(&burst[i], TEST_ASYNC_WAIT) < 0
+           ||
+           burst[i].err || burst[i].num_taxis != num_found)
+        {
+            output("Async fetch [%d] of the burst found [%d] taxis, blocking fetch [%d]\n",
+                   i, burst[i].num_taxis, num_found);
+            goto out;
+        }
+    }
+    dead = taxi_client_ctx_create(taxi_test_args.server, taxi_test_args.port + 1);
+    if(!dead
+       ||
+       get_nearest_taxis_async_ctx(dead, TEST_ASYNC_LATITUDE, TEST_ASYNC_LONGITUDE,
+                                   async_fetch_hook, &dead_fetch) < 0)
+    {
+        output("Unable to fetch from port [%d]\n", taxi_test_args.port + 1);
+        goto out;
+    }
+    if(async_fetch_wait(&dead_fetch, TEST_ASYNC_WAIT) < 0 || !dead_fetch.err)
+    {
+        output("Async fetch from port [%d] with no server %s\n", taxi_test_args.port + 1,
+               dead_fetch.done ? "succeeded" : "never completed");
+        goto out;
+    }
+    output("Async fetches, [%d] at once, found the [%d] taxis of a blocking one "
+           "and timed out with no server\n", TEST_ASYNC_BURST, num_found);
+    err = 0;
+    out:
+    if(dead) taxi_client_ctx_destroy(dead);
+    /*
+     * The fetches of a burst cut short still have the entries to complete on.
+     */
+    for(int i = 0; i < num_burst; ++i)
+        async_fetch_wait(&burst[i], TEST_ASYNC_WAIT);
+    free(burst);
+    for(int i = 0; i < TEST_ASYNC_TAXIS; ++i)
+        delete_taxi(&async_taxis[i]);
+    if(found) free(found);
+    return err;
+}
+
+/*
+ * Fetches of more taxis than a datagram holds, blocking and many at once so
+ * the fragments of their replies interleave, are put back together whole.
+ */
+#define TEST_FRAGS_LATITUDE (15.5)
+#define TEST_FRAGS_LONGITUDE (80.0)
+#define TEST_FRAGS_TAXIS (400)
+#define TEST_FRAGS_FETCHES (32)
+
+static int test_frags(void)
+{
+    struct taxi *frag_taxis = calloc(TEST_FRAGS_TAXIS, sizeof(*frag_taxis));
+    struct async_fetch fetches[TEST_FRAGS_FETCHES];
+    struct taxi *found = NULL;
+    int num_found = 0;
+    int num_fetches = 0;
+    int err = -1;
+    assert(frag_taxis);
+    memset(fetches, 0, sizeof(fetches));
+    for(int i = 0; i < TEST_FRAGS_TAXIS; ++i)
+    {
+        frag_taxis[i].id_len = snprintf((char*)frag_taxis[i].id, sizeof(frag_taxis[i].id), "frag%d", i);
+        frag_taxis[i].latitude = TEST_FRAGS_LATITUDE + (i % 20) * 1e-4;
+        frag_taxis[i].longitude = TEST_FRAGS_LONGITUDE + (i / 20) * 1e-4;
+    }
+    if(update_taxi_locations(frag_taxis, TEST_FRAGS_TAXIS) < 0
+       ||
+       get_nearest_taxis(TEST_FRAGS_LATITUDE, TEST_FRAGS_LONGITUDE, &found, &num_found) < 0
+       ||
+       num_found != TEST_FRAGS_TAXIS)
+    {
+        output("Fragmented fetch found [%d] of [%d] taxis\n", num_found, TEST_FRAGS_TAXIS);
+        goto out;
+    }
+    for(; num_fetches < TEST_FRAGS_FETCHES; ++num_fetches)
+    {
+        if(get_nearest_taxis_async(TEST_FRAGS_LATITUDE, TEST_FRAGS_LONGITUDE,
+                                   async_fetch_hook, &fetches[num_fetches]) < 0)
+        {
+            output("Unable to issue fragmented fetch [%d]\n", num_fetches);
+            goto out;
+        }
+    }
+    for(int i = 0; i < num_fetches; ++i)
+    {
+        if(async_fetch_wait(&fetches[i], TEST_ASYNC_WAIT) < 0
+           ||
+           fetches[i].err || fetches[i].num_taxis != TEST_FRAGS_TAXIS)
+        {
+            output("Fragmented fetch [%d] found [%d] of [%d] taxis\n",
+                   i, fetches[i].num_taxis, TEST_FRAGS_TAXIS);
+            goto out;
+        }
+    }
+    output("[%d] fragmented fetches at once found all [%d] taxis\n", num_fetches + 1, TEST_FRAGS_TAXIS);
+    err = 0;
+    out:
+    for(int i = 0; i < num_fetches; ++i)
+        async_fetch_wait(&fetches[i], TEST_ASYNC_WAIT);
+    for(int i = 0; i < TEST_FRAGS_TAXIS; ++i)
+        delete_taxi(&frag_taxis[i]);
+    free(frag_taxis);
+    if(found) free(found);
+    return err;
+}
+
+/*
+ * Requests of a command the server decoded or -1.
+ */
+static long server_requests(unsigned int cmd)
+{
+    struct taxi_server_stats *stats = calloc(1, sizeof(*stats));
+    long requests = -1;
+    assert(stats);
+    if(get_taxi_server_stats(stats) == 0)
+    {
+        requests = 0;
+        for(int i = 0; i < stats->num_cmds; ++i)
+            if(stats->cmds[i].cmd == cmd)
+                requests = (long)stats->cmds[i].requests;
+    }
+    free(stats);
+    return requests;
+}
+
+static long server_fetches(void)
+{
+    long fetches = server_requests(_TAXI_FETCH_CMD);
+    long frag_fetches = server_requests(_TAXI_FETCH_FRAG_CMD);
+    return fetches < 0 || frag_fetches < 0 ? -1 : fetches + frag_fetches;
+}
+
+/*
+ * A cached fetch does not reach the server till the cache is reset or the
+ * entry expires, and with the cache off every fetch does.
+ */
+#define TEST_CACHE_LATITUDE (16.5)
+#define TEST_CACHE_LONGITUDE (81.0)
+#define TEST_CACHE_MAX_AGE (1000)
+
+static int cache_fetch(long expect_fetches, const char *what)
+{
+    struct taxi *found = NULL;
+    int num_found = 0;
+    long before = server_fetches();
+    int err = get_nearest_taxis(TEST_CACHE_LATITUDE, TEST_CACHE_LONGITUDE, &found, &num_found);
+    long fetches = server_fetches() - before;
+    if(found) free(found);
+    if(before < 0 || err < 0 || num_found != 1 || fetches != expect_fetches)
+    {
+        output("Fetch %s found [%d] taxis with [%ld] server fetches, expected [%ld]\n",
+               what, num_found, fetches, expect_fetches);
+        return -1;
+    }
+    return 0;
+}
+
+static int test_cache(void)
+{
+    struct taxi cache_taxi = {0};
+    int err = -1;
+    cache_taxi.id_len = snprintf((char*)cache_taxi.id, sizeof(cache_taxi.id), "cache0");
+    cache_taxi.latitude = TEST_CACHE_LATITUDE;
+    cache_taxi.longitude = TEST_CACHE_LONGITUDE;
+    if(update_taxi_location(&cache_taxi) < 0
+       ||
+       taxi_client_set_fetch_cache(TEST_CACHE_MAX_AGE, 0.01) < 0)
+    {
+        output("Unable to set up the fetch cache\n");
+        goto out;
+    }
+    if(cache_fetch(1, "filling the cache") < 0
+       ||
+       cache_fetch(0, "from the cache") < 0)
+        goto out;
+    taxi_client_set_fetch_cache(TEST_CACHE_MAX_AGE, 0.01);
+    if(cache_fetch(1, "after a cache reset") < 0)
+        goto out;
+    usleep((TEST_CACHE_MAX_AGE + 100) * 1000);
+    if(cache_fetch(1, "after the entry expired") < 0)
+        goto out;
+    taxi_client_set_fetch_cache(0, 0);
+    if(cache_fetch(1, "with the cache off") < 0
+       ||
+       cache_fetch(1, "again with the cache off") < 0)
+        goto out;
+    output("Cached fetches stayed off the server till reset or expired\n");
+    err = 0;
+    out:
+    taxi_client_set_fetch_cache(0, 0);
+    delete_taxi(&cache_taxi);
+    return err;
+}
+
+/*
+ * Updates within the bound of the last report are not sent till the
+ * heartbeat is due and updates past it always are.
+ */
+#define TEST_SUPPRESSION_BOUND (1e-3)
+#define TEST_SUPPRESSION_HEARTBEAT (300)
+#define TEST_SUPPRESSION_SETTLE (100000) /* usecs for the updates to reach the server */
+
+static int suppressed_update(struct taxi *taxi, double latitude, long expect_sent, const char *what)
+{
+    long before = server_requests(_TAXI_LOCATION_CMD);
+    taxi->latitude = latitude;
+    int err = update_taxi_location(taxi);
+    usleep(TEST_SUPPRESSION_SETTLE);
+    long sent = server_requests(_TAXI_LOCATION_CMD) - before;
+    if(before < 0 || err < 0 || sent != expect_sent)
+    {
+        output("Update %s sent [%ld] times, expected [%ld]\n", what, sent, expect_sent);
+        return -1;
+    }
+    return 0;
+}
+
+static int test_suppression(void)
+{
+    struct taxi report_taxi = {0};
+    double latitude = 17.5;
+    int err = -1;
+    report_taxi.id_len = snprintf((char*)report_taxi.id, sizeof(report_taxi.id), "report0");
+    report_taxi.longitude = 82.0;
+    if(taxi_client_set_update_suppression(TEST_SUPPRESSION_BOUND, TEST_SUPPRESSION_HEARTBEAT) < 0)
+    {
+        output("Unable to set the update suppression\n");
+        goto out;
+    }
+    if(suppressed_update(&report_taxi, latitude, 1, "first reported") < 0
+       ||
+       suppressed_update(&report_taxi, latitude + TEST_SUPPRESSION_BOUND / 2, 0, "within the bound") < 0
+       ||
+       suppressed_update(&report_taxi, latitude + TEST_SUPPRESSION_BOUND * 2, 1, "past the bound") < 0)
+        goto out;
+    usleep(TEST_SUPPRESSION_HEARTBEAT * 1000);
+    if(suppressed_update(&report_taxi, latitude + TEST_SUPPRESSION_BOUND * 2, 1, "on the heartbeat") < 0)
+        goto out;
+    taxi_client_set_update_suppression(0, 0);
+    if(suppressed_update(&report_taxi, latitude + TEST_SUPPRESSION_BOUND * 2, 1, "with suppression off") < 0)
+        goto out;
+    output("Updates within the bound were suppressed till the heartbeat\n");
+    err = 0;
+    out:
+    taxi_client_set_update_suppression(0, 0);
+    delete_taxi(&report_taxi);
+    return err;
+}
+
+/*
+ * Clients sharing the process: each context updates a taxi of its own that the
+ * others find, takes more regions than a single context holds and the last one
+ * is destroyed from its own fetch hook.
+ */
+#define TEST_CONTEXTS_NUM (8)
+#define TEST_CONTEXTS_LATITUDE (12.97)
+#define TEST_CONTEXTS_LONGITUDE (77.59)
+
+static int context_regions(struct taxi_client_ctx *ctx)
+{
+    int num_regions = 0;
+    unsigned int sub_id;
+    while(num_regions <= 64
+          &&
+          subscribe_taxi_region_ctx(ctx, TEST_CONTEXTS_LATITUDE - 1, TEST_CONTEXTS_LONGITUDE - 1,
+                                    TEST_CONTEXTS_LATITUDE + 1, TEST_CONTEXTS_LONGITUDE + 1,
+                                    10000, region_hook, &sub_id) == 0)
+        ++num_regions;
+    return num_regions;
+}
+
+static int context_destroy_hook(int err, struct taxi *taxis, int num_taxis, void *arg)
+{
+    void **args = arg;
+    taxi_client_ctx_destroy(args[0]);
+    if(taxis) free(taxis);
+    __atomic_store_n((int*)args[1], err ? -1 : 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int test_contexts(void)
+{
+    struct taxi_client_ctx *ctxs[TEST_CONTEXTS_NUM];
+    struct taxi ctx_taxis[TEST_CONTEXTS_NUM];
+    struct taxi *found = NULL;
+    int num_found = 0;
+    int err = -1;
+    int i;
+    for(i = 0; i < TEST_CONTEXTS_NUM; ++i)
+    {
+        ctxs[i] = taxi_client_ctx_create(taxi_test_args.server, taxi_test_args.port);
+        if(!ctxs[i])
+        {
+            output("Unable to create client context [%d]\n", i);
+            goto out;
+        }
+        memset(&ctx_taxis[i], 0, sizeof(ctx_taxis[i]));
+        ctx_taxis[i].id_len = snprintf((char*)ctx_taxis[i].id, sizeof(ctx_taxis[i].id), "ctx%d", i);
+        ctx_taxis[i].latitude = TEST_CONTEXTS_LATITUDE + i * 1e-4;
+        ctx_taxis[i].longitude = TEST_CONTEXTS_LONGITUDE;
+        if(update_taxi_location_ctx(ctxs[i], &ctx_taxis[i]) < 0)
+        {
+            output("Unable to update taxi [%s] from its context\n", ctx_taxis[i].id);
+            ++i;
+            goto out;
+        }
+    }
+    if(get_nearest_taxis_ctx(ctxs[0], TEST_CONTEXTS_LATITUDE, TEST_CONTEXTS_LONGITUDE,
+                             &found, &num_found) < 0)
+    {
+        output("Unable to fetch the taxis of the contexts\n");
+        goto out;
+    }
+    for(int j = 0; j < TEST_CONTEXTS_NUM; ++j)
+    {
+        int k;
+        for(k = 0; k < num_found; ++k)
+            if(found[k].id_len == ctx_taxis[j].id_len
+               &&
+               !memcmp(found[k].id, ctx_taxis[j].id, ctx_taxis[j].id_len))
+                break;
+        if(k == num_found)
+        {
+            output("Taxi [%s] updated from context [%d] not found\n", ctx_taxis[j].id, j);
+            goto out;
+        }
+    }
+    for(int j = 0; j < TEST_CONTEXTS_NUM; ++j)
+        delete_taxi_ctx(ctxs[j], &ctx_taxis[j]);
+    int regions[2] = { context_regions(ctxs[0]), context_regions(ctxs[1]) };
+    if(!regions[0] || regions[0] != regions[1])
+    {
+        output("Contexts took [%d] and [%d] regions\n", regions[0], regions[1]);
+        goto out;
+    }
+    int done = 0;
+    void *args[2] = { ctxs[--i], &done };
+    if(get_nearest_taxis_async_ctx(ctxs[i], TEST_CONTEXTS_LATITUDE, TEST_CONTEXTS_LONGITUDE,
+                                   context_destroy_hook, args) < 0)
+    {
+        output("Unable to fetch from context [%d]\n", i);
+        ++i;
+        goto out;
+    }
+    while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+        usleep(1000);
+    if(done < 0)
+    {
+        output("Fetch from context [%d] failed\n", i);
+        goto out;
+    }
+    output("[%d] contexts found each other, took [%d] regions each and one closed itself\n",
+           TEST_CONTEXTS_NUM, regions[0]);
+    err = 0;
+    out:
+    while(i-- > 0)
+        taxi_client_ctx_destroy(ctxs[i]);
+    if(found) free(found);
+    return err;
+}
+
+/*
+ * Contexts spread over the dispatcher threads fetch at once: each finds its
+ * own taxi and the replies come in on every thread.
+ */
+#define TEST_THREADS_LATITUDE (13.5)
+#define TEST_THREADS_LONGITUDE (78.0)
+
+struct thread_fetch
+{
+    struct taxi taxi;
+    pthread_t thread; /* the hook ran on */
+    int done; /* 1 found its taxi, -1 not */
+};
+
+static int thread_fetch_hook(int err, struct taxi *taxis, int num_taxis, void *arg)
+{
+    struct thread_fetch *fetch = arg;
+    int found = 0;
+    for(int i = 0; !err && !found && i < num_taxis; ++i)
+        found = taxis[i].id_len == fetch->taxi.id_len
+            && !memcmp(taxis[i].id, fetch->taxi.id, fetch->taxi.id_len);
+    if(taxis) free(taxis);
+    fetch->thread = pthread_self();
+    __atomic_store_n(&fetch->done, found ? 1 : -1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int test_threads(int num_threads)
+{
+    int num_ctxs = num_threads * 2;
+    struct taxi_client_ctx **ctxs = calloc(num_ctxs, sizeof(*ctxs));
+    struct thread_fetch *fetches = calloc(num_ctxs, sizeof(*fetches));
+    int num_seen = 0;
+    int err = -1;
+    int i;
+    assert(ctxs && fetches);
+    for(i = 0; i < num_ctxs; ++i)
+    {
+        struct taxi *taxi = &fetches[i].taxi;
+        ctxs[i] = taxi_client_ctx_create(taxi_test_args.server, taxi_test_args.port);
+        if(!ctxs[i])
+        {
+            output("Unable to create client context [%d]\n", i);
+            goto out;
+        }
+        taxi->id_len = snprintf((char*)taxi->id, sizeof(taxi->id), "thread%d", i);
+        taxi->latitude = TEST_THREADS_LATITUDE + i * 1e-4;
+        taxi->longitude = TEST_THREADS_LONGITUDE;
+        if(update_taxi_location_ctx(ctxs[i], taxi) < 0)
+        {
+            output("Unable to update taxi [%s]\n", taxi->id);
+            goto out;
+        }
+    }
+    for(int j = 0; j < num_ctxs; ++j)
+    {
+        if(get_nearest_taxis_async_ctx(ctxs[j], fetches[j].taxi.latitude, fetches[j].taxi.longitude,
+                                       thread_fetch_hook, &fetches[j]) < 0)
+        {
+            output("Unable to fetch from context [%d]\n", j);
+            goto out;
+        }
+    }
+    for(int j = 0; j < num_ctxs; ++j)
+    {
+        int done;
+        while(!(done = __atomic_load_n(&fetches[j].done, __ATOMIC_ACQUIRE)))
+            usleep(1000);
+        if(done < 0)
+        {
+            output("Context [%d] did not find taxi [%s]\n", j, fetches[j].taxi.id);
+            goto out;
+        }
+        int k;
+        for(k = 0; k < j && !pthread_equal(fetches[k].thread, fetches[j].thread); ++k);
+        if(k == j)
+            ++num_seen;
+    }
+    if(num_seen != num_threads)
+    {
+        output("Replies came in on [%d] of [%d] dispatcher threads\n", num_seen, num_threads);
+        goto out;
+    }
+    output("[%d] contexts on [%d] dispatcher threads found their taxis\n", num_ctxs, num_threads);
+    err = 0;
+    out:
+    while(i-- > 0)
+    {
+        if(!ctxs[i]) continue;
+        delete_taxi_ctx(ctxs[i], &fetches[i].taxi);
+        taxi_client_ctx_destroy(ctxs[i]);
+    }
+    free(fetches);
+    free(ctxs);
+    return err;
+}
+
+/*
+ * Dispatcher timers fire in deadline order, a cancelled one never fires and a
+ * periodic one stops once cancelled, from its own callback or from outside.
+ */
+struct test_timer
+{
+    int fired;
+    int msecs;
+    int limit; /* runs before the periodic timer cancels itself */
+    unsigned int timer_id;
+    int *order;
+    int *num_order;
+};
+
+static int test_timer_callback(void *arg)
+{
+    struct test_timer *timer = arg;
+    int fired = __atomic_add_fetch(&timer->fired, 1, __ATOMIC_ACQ_REL);
+    if(timer->order)
+        timer->order[__atomic_fetch_add(timer->num_order, 1, __ATOMIC_ACQ_REL)] = timer->msecs;
+    if(timer->limit && fired == timer->limit)
+        dispatcher_cancel_timer(timer->timer_id);
+    return 0;
+}
+
+static int test_timers(void)
+{
+    int order[3], num_order = 0;
+    struct test_timer oneshots[3] = {
+        { .msecs = 60, .order = order, .num_order = &num_order },
+        { .msecs = 20, .order = order, .num_order = &num_order },
+        { .msecs = 40, .order = order, .num_order = &num_order },
+    };
+    struct test_timer cancelled = {0}, periodic = {0}, self = { .limit = 3 };
+    for(int i = 0; i < 3; ++i)
+    {
+        if(dispatcher_add_timer(oneshots[i].msecs, 0, &oneshots[i], test_timer_callback, NULL) < 0)
+        {
+            output("Unable to add a timer\n");
+            return -1;
+        }
+    }
+    if(dispatcher_add_timer(30, 0, &cancelled, test_timer_callback, &cancelled.timer_id) < 0
+       ||
+       dispatcher_cancel_timer(cancelled.timer_id) < 0
+       ||
+       dispatcher_add_timer(10, 10, &periodic, test_timer_callback, &periodic.timer_id) < 0
+       ||
+       dispatcher_add_timer(10, 10, &self, test_timer_callback, &self.timer_id) < 0)
+    {
+        output("Unable to add or cancel a timer\n");
+        return -1;
+    }
+    usleep(200000);
+    dispatcher_cancel_timer_wait(periodic.timer_id);
+    int fired = __atomic_load_n(&periodic.fired, __ATOMIC_ACQUIRE);
+    usleep(50000);
+    if(__atomic_load_n(&num_order, __ATOMIC_ACQUIRE) != 3
+       ||
+       order[0] != 20 || order[1] != 40 || order[2] != 60)
+    {
+        output("One shot timers fired [%d] times out of order\n", num_order);
+        return -1;
+    }
+    if(cancelled.fired)
+    {
+        output("Cancelled timer fired\n");
+        return -1;
+    }
+    if(fired < 5 || __atomic_load_n(&periodic.fired, __ATOMIC_ACQUIRE) != fired)
+    {
+        output("Periodic timer fired [%d] times, [%d] after its cancel\n",
+               fired, periodic.fired - fired);
+        return -1;
+    }
+    if(__atomic_load_n(&self.fired, __ATOMIC_ACQUIRE) != self.limit)
+    {
+        output("Timer cancelling itself after [%d] runs fired [%d] times\n", self.limit, self.fired);
+        return -1;
+    }
+    output("Timers fired in deadline order and stopped on cancel\n");
+    return 0;
+}
+
 static void usage(void)
 {
     fprintf(stderr, "%s [ -s | server ] [ -p | port ] [ -d | test deletion ] "
-            " [ -a | test add ] [ -i | test ping ] [ -f | test search ] [ -w | wait ] [ -h | this help ] location_file\n",
+            " [ -a | test add ] [ -b | batch the adds ] [ -i | test ping ] [ -f | test search ] [ -g | test server fetch and ping ] "
+            " [ -t | use the stream transport ] [ -c | compact fetch replies ] [ -z | compressed fetch replies ] [ -S | print server stats ] [ -R | subscribe to the bay area ] [ -F | test fragmented fetches ] [ -A | test async fetches ] [ -C | test the fetch cache ] [ -U | test update suppression ] [ -m | test client contexts ] [ -T | threads, test the dispatcher threads ] [ -E | test the dispatcher timers ] [ -w | wait ] [ -h | this help ] location_file\n",
             prog);
     exit(1);
 }
@@ -179,13 +883,16 @@ int main(int argc, char **argv)
     int c;
     unsigned int test_mask = 0;
     int loop = 0;
+    int stream = 0;
+    int compact = 0;
+    int compress = 0;
     char *s;
     prog = argv[0];
     if( (s = strrchr(prog, '/') ) )
         prog = s+1;
 
     opterr = 0;
-    while ( (c = getopt(argc, argv, "s:p:dafihw") ) != EOF )
+    while ( (c = getopt(argc, argv, "s:p:dabfightczSRFACUmT:Ew") ) != EOF )
     {
         switch(c)
         {
@@ -206,6 +913,10 @@ int main(int argc, char **argv)
             test_mask |= MAKE_TEST_MASK(TEST_ADD);
             break;
             
+        case 'b':
+            test_mask |= MAKE_TEST_MASK(TEST_ADD) | MAKE_TEST_MASK(TEST_BATCH);
+            break;
+
         case 'i':
             test_mask |= MAKE_TEST_MASK(TEST_PING);
             break;
@@ -214,6 +925,61 @@ int main(int argc, char **argv)
             test_mask |= MAKE_TEST_MASK(TEST_SEARCH);
             break;
 
+        case 'g':
+            test_mask |= MAKE_TEST_MASK(TEST_SEARCH) | MAKE_TEST_MASK(TEST_FETCH_PING);
+            break;
+
+        case 't':
+            stream = 1;
+            break;
+
+        case 'c':
+            compact = 1;
+            break;
+
+        case 'z':
+            compress = 1;
+            break;
+
+        case 'S':
+            test_mask |= MAKE_TEST_MASK(TEST_STATS);
+            break;
+
+        case 'R':
+            test_mask |= MAKE_TEST_MASK(TEST_REGION);
+            break;
+
+        case 'F':
+            test_mask |= MAKE_TEST_MASK(TEST_FRAGS);
+            break;
+
+        case 'A':
+            test_mask |= MAKE_TEST_MASK(TEST_ASYNC);
+            break;
+
+        case 'C':
+            test_mask |= MAKE_TEST_MASK(TEST_CACHE);
+            break;
+
+        case 'U':
+            test_mask |= MAKE_TEST_MASK(TEST_SUPPRESSION);
+            break;
+
+        case 'm':
+            test_mask |= MAKE_TEST_MASK(TEST_CONTEXTS);
+            break;
+
+        case 'T':
+            taxi_test_args.num_threads = atoi(optarg);
+            if(taxi_test_args.num_threads <= 0)
+                usage();
+            test_mask |= MAKE_TEST_MASK(TEST_THREADS);
+            break;
+
+        case 'E':
+            test_mask |= MAKE_TEST_MASK(TEST_TIMERS);
+            break;
+
         case 'w':
             loop = 1;
             break;
@@ -234,15 +1000,72 @@ int main(int argc, char **argv)
     {
         taxi_test_args.test_mask = test_mask;
     }
+    if(taxi_test_args.num_threads
+       &&
+       taxi_client_set_dispatcher_threads(taxi_test_args.num_threads) < 0)
+    {
+        output("Error setting [%d] dispatcher threads\n", taxi_test_args.num_threads);
+        return -1;
+    }
     int err = taxi_client_initialize(taxi_test_args.server, taxi_test_args.port);
     if(err < 0)
     {
         output("Error initializing taxi client\n");
         return -1;
     }
+    if(stream && taxi_client_connect_stream() < 0)
+    {
+        output("Error connecting the stream to the taxi server\n");
+        return -1;
+    }
+    taxi_client_set_compact(compact);
+    taxi_client_set_compress(compress);
+    unsigned int sub_id = 0;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_REGION)
+       &&
+       subscribe_taxi_region(37.0, -123.0, 39.0, -122.0, 10000, region_hook, &sub_id) < 0)
+    {
+        output("Error subscribing to the region\n");
+        return -1;
+    }
     test_taxi_scan(taxi_test_args.fname);
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_ASYNC)
+       &&
+       test_async() < 0)
+        err = -1;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_FRAGS)
+       &&
+       test_frags() < 0)
+        err = -1;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_CACHE)
+       &&
+       test_cache() < 0)
+        err = -1;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_SUPPRESSION)
+       &&
+       test_suppression() < 0)
+        err = -1;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_CONTEXTS)
+       &&
+       test_contexts() < 0)
+        err = -1;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_THREADS)
+       &&
+       test_threads(taxi_test_args.num_threads) < 0)
+        err = -1;
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_TIMERS)
+       &&
+       test_timers() < 0)
+        err = -1;
+    if(sub_id)
+    {
+        sleep(1);
+        unsubscribe_taxi_region(sub_id);
+    }
+    if(CHECK_TEST_MASK(taxi_test_args.test_mask, TEST_STATS))
+        print_server_stats();
     if(loop)
         for(;;) sleep(3);
 
-    return 0;
+    return err;
 }
@@ -140,13 +140,22 @@ void get_server_addr(const char *ip, struct sockaddr_in *addr)
     }
 }
 
-int bind_server(const char *ip, int port)
+static int __bind_server(const char *ip, int port, int shared)
 {
     int sd, err = -1;
     struct sockaddr_in addr;
     sd = socket(PF_INET, SOCK_DGRAM, 0);
     if(sd < 0)
         goto out;
+    if(shared)
+    {
+        int on = 1;
+        if(setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        {
+            perror("setsockopt SO_REUSEPORT error:");
+            goto out_close;
+        }
+    }
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = PF_INET;
     addr.sin_port = htons(port);
@@ -168,3 +177,18 @@ int bind_server(const char *ip, int port)
     out:
     return err;
 }
+
+int bind_server(const char *ip, int port)
+{
+    return __bind_server(ip, port, 0);
+}
+
+/*
+ * Bind a socket sharing the port with other sockets of this process.
+ * The kernel hashes each source to one of the sockets which keeps
+ * the per source ordering intact.
+ */
+int bind_server_shared(const char *ip, int port)
+{
+    return __bind_server(ip, port, 1);
+}
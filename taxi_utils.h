@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <netdb.h>
@@ -14,8 +15,10 @@
 extern "C" {
 #endif
 
+extern uint64_t forward_clock(void);
 extern void get_server_addr(const char *ip, struct sockaddr_in *addr);
 extern int bind_server(const char *ip, int port);
+extern int bind_server_shared(const char *ip, int port);
 extern int get_if_addrs(struct sockaddr **addresses, int *p_num_addresses);
 
 #ifdef __cplusplus